@@ -1,51 +1,52 @@
 
 #include "N1470.h"
+#include "N1470Recorder.h"
+#include "N1470Shm.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+// The error a blocking method reports for a command the bus could not
+// complete, from the status N1470Bus::transaction returned
+static int linkError(int status){
+
+  switch (status){
+  case 2: return ERR_TIMEOUT;
+  case 3: return ERR_ABANDONED;
+  default: return ERR_IO;
+  }
+}
 
 // // Default constructor. Make everything apart from the board number zero and get
 // actual values in initialize function
-// String commands are taken from the N1470 manual available at caen.it
-N1470::N1470(int boardNumber) : 
+// Commands are formatted by N1470Command from templates shared by all boards
+N1470::N1470(int boardNumber) : N1470(boardNumber, NULL){};
+
+// Without a bus the board gets a private link of its own
+N1470::N1470(int boardNumber, N1470Bus *bus) : 
   BD_(boardNumber),
+  bus_(bus != NULL ? bus : new N1470Bus()),
+  owns_bus_(bus == NULL),
   connected_(false), 
-  interlock_(0), 
-  board_name_("$BD:XX,CMD:MON,PAR:BDNAME\r\n"),
-  mon_cmd_("$BD:XX,CMD:MON,CH:X,PAR:XX"),
-  vset_cmd_("$BD:XX,CMD:SET,CH:X,PAR:VSET,VAL:XX"),
-  iset_cmd_("$BD:XX,CMD:SET,CH:X,PAR:ISET,VAL:XX"),
-  vmax_cmd_("$BD:XX,CMD:SET,CH:X,PAR:MAXV,VAL:XX"),
-  rampup_cmd_("$BD:XX,CMD:SET,CH:X,PAR:RUP,VAL:XX"),
-  rampdown_cmd_("$BD:XX,CMD:SET,CH:X,PAR:RDW,VAL:XX"),
-  triptime_cmd_("$BD:XX,CMD:SET,CH:X,PAR:TRIP,VAL:XX"),
-  tripmode_cmd_("$BD:XX,CMD:SET,CH:X,PAR:PDWN,VAL:XX"),
-  channel_on_cmd_("$BD:XX,CMD:SET,CH:X,PAR:ON"),
-  channel_off_cmd_("$BD:XX,CMD:SET,CH:X,PAR:OFF"),
-  interlock_cmd_("$BD:XX,CMD:SET,PAR:BDILKM,VAL:XX"),
-  clearalarm_cmd_("$BD:XX,CMD:SET,PAR:BDCLR"){
-
-  std::string * cmd_list_[] = {&mon_cmd_, &vset_cmd_, &iset_cmd_, &vmax_cmd_, 
-		 &rampup_cmd_, &rampdown_cmd_, &triptime_cmd_, 
-		 &tripmode_cmd_, &channel_on_cmd_, &channel_off_cmd_,
-		 &interlock_cmd_, &clearalarm_cmd_};  
-  
-  // set the board number in the command strings above
-  int pos;
-  std::ostringstream replacement;
-  std::string target = "$BD:XX";
-  
-  replacement << "$BD:" << BD_;
-  
-  for (int cmd = 0; cmd < CMD_LIST_LEN_N1470; cmd++){
-
-    pos = cmd_list_[cmd]->find(target);
-    cmd_list_[cmd]->replace(pos,target.size(),replacement.str());
-
-  }
+  n_async_(0),
+  polling_(false),
+  poll_interval_ms_(0),
+  status_interval_ms_(-1),
+  next_watch_(1),
+  snapshot_seq_(0),
+  recorder_(NULL),
+  shared_status_(NULL),
+  interlock_(0),
+  writes_sent_(0),
+  writes_elided_(0){
   
   // Set all the intial values to 0
   for (int ch = 0; ch <= 3; ch++){
     
     vmon_[ch] = 0.0;
     imon_[ch] = 0.0;
+    status_[ch] = 0;
     vset_[ch] = 0.0;
     iset_[ch] = 0.0;
     vmax_[ch] = 0.0;
@@ -56,89 +57,75 @@ N1470::N1470(int boardNumber) :
     triptime_[ch] = 0.0;
     
     tripmode_[ch] = 1; // By default have trip mean kill
+
+    polarity_[ch] = 1;
+
+    status_seen_[ch] = 0;
+  }
+
+  // Nothing is cached until it has been read or set
+  for (int par = 0; par < PAR_COUNT; par++){
+    setting_ttl_ms_[par] = 0;
+    for (int ch = 0; ch < CH_MAX; ch++)
+      setting_valid_[par][ch] = false;
   }
+  setting_ttl_ms_[PAR_VSET] = SETTING_TTL_MS_N1470;
+  setting_ttl_ms_[PAR_ISET] = SETTING_TTL_MS_N1470;
+  setting_ttl_ms_[PAR_MAXV] = SETTING_TTL_MS_N1470;
+  setting_ttl_ms_[PAR_RUP] = SETTING_TTL_MS_N1470;
+  setting_ttl_ms_[PAR_RDW] = SETTING_TTL_MS_N1470;
+  setting_ttl_ms_[PAR_TRIP] = SETTING_TTL_MS_N1470;
+  setting_ttl_ms_[PAR_PDWN] = SETTING_TTL_MS_N1470;
+  setting_ttl_ms_[PAR_POL] = -1; // fixed by a switch on the module
+
+  for (unsigned int word = 0; word < sizeof(N1470Snapshot) / sizeof(uint64_t); word++)
+    snapshot_words_[word].store(0, std::memory_order_relaxed);
   
 };
 
+N1470::~N1470(){
 
-char * N1470::formCommand(std::string command, std::string target, std::string replacement){
+  // Their completions reach back into this object
+  {
+    std::unique_lock<std::mutex> lock(async_mutex_);
+    async_done_.wait(lock, [this]{ return n_async_ == 0; });
+  }
 
-  int position;
-  char * cmd;
-  unsigned int bufLen;
+  stopPolling();
 
-  std::string newCommand;
+  if (owns_bus_)
+    delete bus_;
 
-  position = command.find(target);
-  if (position < 0){
-    std::cerr << "Target string " << target << " not found" << std::endl;
-    exit(1);
-  }
-  newCommand = command.replace(position, target.size(), replacement);
-  
-  // N1470 accepts C-style strings, now convert from std::string to c_str style
-  // need to append a Windows-style line ending (\<cr>\<lf>) to make N1470 realise it's the end of the command
-  bufLen = newCommand.size() + 3;
-  cmd = (char *)malloc(bufLen);
+};
 
-  if (cmd == NULL){
-    fprintf(stderr,"No memory allocation possible!\n");
-    return NULL;
-  }
-  
-  std::strcpy(cmd,command.c_str());
-  strncat(cmd,"\r\n",2);
-  
-  return cmd;
- 
-} 
 
+int N1470::makeConnection(const char *transport){
 
-int N1470::makeConnection(){
+  int ret;
 
-#ifndef NO_DEVICE
-  
- 
-  unsigned long ret;
-  
-  if ((ret = FT_Open(0, &dev_)) != FT_OK){
-    
-    PRINT_ERR("FT_Open", ret);
-    return -1;
-    
-  }
+  if (owns_bus_){
+
+    bus_->setProbeBoard(BD_);
+    if ((ret = (transport ? bus_->open(transport) : bus_->open(0))) != 0)
+      return ret;
 
-  if ((ret = FT_SetBaudRate(dev_, FT_BAUD_9600)) != FT_OK){
-    
-    PRINT_ERR("FT_SetBaudRate",ret);
-    return -2;
-    
-  }
-  
-  
-  if ((ret = FT_SetDataCharacteristics(dev_, FT_BITS_8, FT_STOP_BITS_1, FT_PARITY_NONE )) != FT_OK){
-    
-    PRINT_ERR("FT_SetDataCharacteristics",ret);
-    return -3;
-    
-  }
-  
-  
-  if ((ret = FT_Purge(dev_, (FT_PURGE_RX & FT_PURGE_TX))) != FT_OK){
-    
-    PRINT_ERR("FT_Purge", ret);
-    return -4;
-    
   }
-  
-#endif
-  connected_ = true;
+  else if (!bus_->isConnected()){
 
+    fprintf(stderr,"Cannot connect board %d, the shared link is not open\n",BD_);
+    return -6;
 
+  }
+
+  connected_ = true;
 
 #ifdef DEBUG
   fprintf(stderr,"Connected to the device with Board ID: %d\n",BD_);
 #endif
+
+  // Boards handed out by a shared bus may not exist; they fill the cache on first read
+  if (owns_bus_ && loadSettings() != 0)
+    fprintf(stderr,"Could not read the settings of board %d, reading them on demand\n",BD_);
 	
   return 0;
   
@@ -146,35 +133,26 @@ int N1470::makeConnection(){
 
 int N1470::readBoardName(){
   
-  std::string * response = new std::string();
+  N1470Response reply;
 
-  char cmd[80];
+  char cmd[CMD_SIZE_N1470];
 
-  strcpy(cmd,board_name_.c_str());
+  N1470Command::boardMonitor(cmd, BD_, PAR_BDNAME);
 
-  if(writeCommand(cmd)!=0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "Problem writing command to get board name!\n" << std::endl;
-    delete(response);
-    return -1;
-  }
+  if (transaction(cmd, &reply) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    delete(response);
-    exit(1);
+    std::cerr << "Problem getting board name!\n" << std::endl;
+    return -1;
   }
 
 #ifdef DEBUG
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
-  int loc = response->find("N1470");
-  delete(response);
-
-  if (loc >= 0){
+  if (reply.text.find("N1470") != std::string_view::npos){
     return 0;
   }
   else{
@@ -185,25 +163,17 @@ int N1470::readBoardName(){
 
 int N1470::dropConnection(){
 
-#ifndef NO_DEVICE
-
-	unsigned long ret;
-
-	if ((ret = FT_Purge(dev_, (FT_PURGE_RX & FT_PURGE_TX))) != 0){
-
-		PRINT_ERR("FT_Purge", ret);
-		return -1;
+	stopPolling();
 
-	}
+	if (owns_bus_){
 
+		int ret;
 
-	if ((ret = FT_Close(dev_)) != FT_OK){
+		if ((ret = bus_->close()) != 0)
+			return ret;
 
-		PRINT_ERR("FT_Close", ret);
-		return -2;
 	}
 
-#endif
 	connected_ = false;
 
 
@@ -216,10 +186,9 @@ int N1470::dropConnection(){
 
 int N1470::switchState(int channel, bool state){
 
-  char * cmd;
-  std::string target = "CH:X";
-  std::ostringstream replacement;
-  std::string *response = new std::string();
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
   // Make sure connected
   if (!connected_){
   	
@@ -230,19 +199,17 @@ int N1470::switchState(int channel, bool state){
   }
   
   // Check input
-  if ((channel < 0) || (channel >=4)){
+  if ((channel < 0) || (channel > CH_ALL)){
 
     PRINT_ERR("switchState",(unsigned long)channel);
-    return -channel;
+    return -ERR_ARG;
   }
 
   // Form command properly
-  replacement << "CH:" << channel;
-  
   if (state){
-    cmd = this->formCommand(channel_on_cmd_, target, replacement.str());
+    N1470Command::set(cmd, BD_, channel, PAR_ON);
   } else{
-    cmd = this->formCommand(channel_off_cmd_, target, replacement.str());
+    N1470Command::set(cmd, BD_, channel, PAR_OFF);
   }
 
   
@@ -255,140 +222,178 @@ int N1470::switchState(int channel, bool state){
 #endif
 
   
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem switching state on channel" << channel << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem switching state on channel" << channel << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,1,NULL) != 0){
+  if (parseResponse(&reply,1,NULL) != 0){
     std::cerr << "Could not parse response" << std::endl;
+    return -(reply.error != ERR_NONE ? reply.error : ERR_FORMAT);
   }
 
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return 0;
 }
 
 
-void N1470::channelCheck(int channel){
+int N1470::waitUntilStable(const int *channels, int nChannels, double tolerance, int timeoutMs){
 
-  if (channel < 0 || channel >=4){
-    std::cerr << "Channel call of " << channel << " not understood" << std::endl;
-    exit(1);
+  static const int all[CH_MAX] = {0, 1, 2, 3};
+  static const N1470Param pars[] = {PAR_VSET, PAR_RUP, PAR_RDW};
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  double settings[3][CH_MAX];
+  double vmon[CH_MAX];
+  int status[CH_MAX];
+
+  if (channels == NULL){
+    channels = all;
+    nChannels = CH_MAX;
   }
+  for (int i = 0; i < nChannels; i++)
+    if (channelCheck(channels[i]) != 0)
+      return -ERR_ARG;
 
-}
-    
-int N1470::writeCommand(char *cmd){
+  // Targets and ramp rates, read with CH:4 unless all are cached
+  for (int p = 0; p < 3; p++){
 
-  int bufLen, bufWrit, ret;
-  bufLen = strlen(cmd); 
+    bool cached = true;
 
-#ifdef DEBUG_MAX
+    for (int ch = 0; ch < CH_MAX && cached; ch++)
+      cached = cachedSetting(pars[p], ch, &settings[p][ch]);
 
-  std::cerr << "Writing the following command to the device: " << cmd << std::endl;
+    if (!cached && refreshSetting(pars[p], settings[p]) != 0)
+      return -1;
+  }
 
-#endif
+  while (true){
 
-#ifndef NO_DEVICE
+    double etaMs = 0;
+    bool stable = true;
 
-  if ((ret = FT_Write(dev_,cmd,bufLen,(LPDWORD) &bufWrit)) != FT_OK){
+    if (getAllVoltages(vmon) != 0 || getAllStatus(status) != 0)
+      return -1;
 
-    PRINT_ERR("FT_Write", (long unsigned)ret);
-    free(cmd);	
-    return -1;
+    for (int i = 0; i < nChannels; i++){
+
+      int ch = channels[i];
+
+      // The channel will not get there
+      if (status[ch] & (STAT_TRIP_N1470 | STAT_KILL_N1470 | STAT_ILK_N1470))
+	return -2;
+
+      double target = (status[ch] & STAT_ON_N1470) ? settings[0][ch] : 0;
+      double distance = fabs(target - vmon[ch]);
+
+      if (!(status[ch] & (STAT_RUP_N1470 | STAT_RDW_N1470)) && distance <= tolerance)
+	continue;
+
+      stable = false;
+
+      double rate = (vmon[ch] < target) ? settings[1][ch] : settings[2][ch];
+      if (distance > tolerance && rate > 0)
+	etaMs = std::max(etaMs, (distance - tolerance) / rate * 1000);
+    }
+
+    if (stable)
+      return 0;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now >= deadline)
+      return 1;
+
+    // Half the predicted time left, so polls are sparse early in a ramp
+    // and close together as it ends
+    long waitMs = std::min(std::max((long)(etaMs / 2), (long)STABLE_POLL_MIN_MS_N1470), (long)STABLE_POLL_MAX_MS_N1470);
+    long leftMs = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(std::min(waitMs, leftMs)));
   }
+}
 
-#else
-  std::cerr << "Faking successful write" << std::endl;
-  bufWrit = bufLen;
-#endif
-  
-  if(bufWrit != bufLen){
-    fprintf(stderr, "Buffersize mismatch: bufLen %u \t bufWrit %u\n",bufLen,bufWrit);
-    return -1;
+int N1470::channelCheck(int channel, bool all){
+
+  if (channel < 0 || channel > (all ? CH_ALL : CH_MAX - 1)){
+    std::cerr << "Channel call of " << channel << " not understood" << std::endl;
+    return -ERR_ARG;
   }
 
- return 0;
+  return 0;
+
+}
+    
+int N1470::transaction(char *cmd, N1470Response *reply){
+
+  int ret;
+
+  // Reuse one receive buffer per board; the reply is parsed where it lies
+  response_.clear();
+
+  if ((ret = bus_->transaction(BD_, cmd, &response_)) != 0)
+    return ret;
+
+  N1470Response::parse(response_, reply);
+  return 0;
 
 }
 
 double N1470::printStatus(int channel){
   
-  char * cmd;
-  std::string target = "CH:X,PAR:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
 
   double status;
  
-  channelCheck(channel);
+  if (channelCheck(channel) != 0)
+    return -ERR_ARG;
 
-  replacement << "CH:" << channel << ",PAR:STAT";
-  cmd = this->formCommand(mon_cmd_,target,replacement.str());
+  N1470Command::monitor(cmd, BD_, channel, PAR_STAT);
 
 #ifdef DEBUG_MAX
   std::cerr << "Getting the status of channel " << channel << std::endl;
 #endif
 
- if (writeCommand(cmd) != 0){
+  {
+    // Released before the status callbacks run
+    std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to read out the voltage" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
+    if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-
-#ifdef DEBUG_MAX
-  std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
-#endif
+      std::cerr << "There was a problem writing the command to read out the voltage" << std::endl;
+      return -linkError(ret);
+    }
 
 #ifdef DEBUG_MAX
-  std::cout << "Parsing response:" << std::endl;
+    std::cout << "Printing response:" << std::endl;
+    std::cout << response_ << std::endl;
 #endif
 
-  if (parseResponse(response,2,&status) != 0){
-    std::cerr << "Could not parse response" << std::endl;
+    if (parseResponse(&reply,2,&status) != 0){
+      std::cerr << "Could not parse response" << std::endl;
+      return -1;
+    }
   }
 
+  updateStatus(channel, (int)status);
+
 #ifdef DEBUG
   fprintf(stderr,"Status was %x\n",(unsigned)status);
 #endif
 
   // No memory leaks!                                                      
-  free(cmd);
-  delete(response);
   parseChannelStatus(status);
   return status;
 
@@ -396,17 +401,16 @@ double N1470::printStatus(int channel){
 
 double N1470::getActualVoltage(int channel){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
   double voltage;
  
-  channelCheck(channel);
+  if (channelCheck(channel) != 0)
+    return -ERR_ARG;
 
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:VMON";
-  cmd = this->formCommand(mon_cmd_, target, replacement.str());
+  N1470Command::monitor(cmd, BD_, channel, PAR_VMON);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -416,32 +420,23 @@ double N1470::getActualVoltage(int channel){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to read out the voltage" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to read out the voltage" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,2,&voltage) != 0){
+  if (parseResponse(&reply,2,&voltage) != 0){
     std::cerr << "Could not parse response" << std::endl;
   }
 #ifdef DEBUG
@@ -449,25 +444,22 @@ double N1470::getActualVoltage(int channel){
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return voltage;
 
 }
 
 double N1470::getActualCurrent(int channel){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
   double current;
  
-  channelCheck(channel);
+  if (channelCheck(channel) != 0)
+    return -ERR_ARG;
 
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:IMON";
-  cmd = this->formCommand(mon_cmd_, target, replacement.str());
+  N1470Command::monitor(cmd, BD_, channel, PAR_IMON);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -477,32 +469,23 @@ double N1470::getActualCurrent(int channel){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to read out the current" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to read out the current" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,2,&current) != 0){
+  if (parseResponse(&reply,2,&current) != 0){
     std::cerr << "Could not parse response" << std::endl;
   }
 #ifdef DEBUG
@@ -510,26 +493,407 @@ double N1470::getActualCurrent(int channel){
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return current;
 
 }
 
 
+int N1470::monitorAll(N1470Param par, double *values){
+
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
+
+  // Form command properly
+  N1470Command::monitor(cmd, BD_, CH_ALL, par);
+
+#ifdef DEBUG_MAX
+  fprintf(stderr,"Writing command to get %s of all N1470 module channels: ",N1470Command::name(par));
+  fputs(cmd,stderr);
+#endif
+
+  std::lock_guard<std::mutex> lock(io_mutex_);
+
+  if ((ret = transaction(cmd, &reply)) != 0){
+
+    std::cerr << "There was a problem writing the command to read out " << N1470Command::name(par) << std::endl;
+    return -linkError(ret);
+  }
+
+#ifdef DEBUG_MAX
+  std::cout << "Printing response:" << std::endl;
+  std::cout << response_ << std::endl;
+#endif
+
+  if (parseResponse(&reply,3,values) != 0){
+    std::cerr << "Could not parse response" << std::endl;
+    return -(reply.error != ERR_NONE ? reply.error : ERR_FORMAT);
+  }
+
+  // Under io_mutex_, like every other writer of the monitored values
+  for (int ch = 0; ch < CH_MAX; ch++){
+    if (par == PAR_VMON) vmon_[ch] = values[ch];
+    else if (par == PAR_IMON) imon_[ch] = values[ch];
+    else if (par == PAR_STAT) status_[ch] = (int)values[ch];
+  }
+
+  // No memory leaks!
+  return 0;
+
+}
+
+int N1470::getAllVoltages(double *voltages){
+
+  double values[CH_MAX];
+  int ret;
+
+  if ((ret = monitorAll(PAR_VMON,values)) != 0)
+    return ret;
+
+  if (voltages != NULL)
+    memcpy(voltages, values, sizeof(values));
+
+#ifdef DEBUG
+  std::cout << "Voltages were " << values[0] << " " << values[1] << " " << values[2] << " " << values[3] << std::endl;
+#endif
+
+  return 0;
+}
+
+int N1470::getAllCurrents(double *currents){
+
+  double values[CH_MAX];
+  int ret;
+
+  if ((ret = monitorAll(PAR_IMON,values)) != 0)
+    return ret;
+
+  if (currents != NULL)
+    memcpy(currents, values, sizeof(values));
+
+#ifdef DEBUG
+  std::cout << "Currents were " << values[0] << " " << values[1] << " " << values[2] << " " << values[3] << std::endl;
+#endif
+
+  return 0;
+}
+
+int N1470::getAllStatus(int *status){
+
+  double values[CH_MAX];
+  int ret;
+
+  if ((ret = monitorAll(PAR_STAT,values)) != 0)
+    return ret;
+
+  if (status != NULL)
+    for (int ch = 0; ch < CH_MAX; ch++)
+      status[ch] = (int)values[ch];
+
+#ifdef DEBUG
+  fprintf(stderr,"Status words were %x %x %x %x\n",(int)values[0],(int)values[1],(int)values[2],(int)values[3]);
+#endif
+
+  for (int ch = 0; ch < CH_MAX; ch++)
+    updateStatus(ch, (int)values[ch]);
+
+  return 0;
+}
+
+
+bool N1470::cachedSetting(N1470Param par, int channel, double *value){
+
+  std::lock_guard<std::mutex> lock(setting_mutex_);
+  int ttl = setting_ttl_ms_[par];
+
+  if (ttl == 0 || !setting_valid_[par][channel])
+    return false;
+
+  if (ttl > 0 && std::chrono::steady_clock::now() - setting_time_[par][channel] > std::chrono::milliseconds(ttl))
+    return false;
+
+  switch (par){
+  case PAR_VSET: *value = vset_[channel]; break;
+  case PAR_ISET: *value = iset_[channel]; break;
+  case PAR_MAXV: *value = vmax_[channel]; break;
+  case PAR_RUP: *value = rampup_[channel]; break;
+  case PAR_RDW: *value = rampdown_[channel]; break;
+  case PAR_TRIP: *value = triptime_[channel]; break;
+  case PAR_PDWN: *value = tripmode_[channel]; break;
+  case PAR_POL: *value = polarity_[channel]; break;
+  default: return false;
+  }
+
+  return true;
+}
+
+void N1470::storeSetting(N1470Param par, int channel, const double *values){
+
+  std::lock_guard<std::mutex> lock(setting_mutex_);
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  int first = (channel == CH_ALL) ? 0 : channel;
+  int last = (channel == CH_ALL) ? CH_MAX - 1 : channel;
+
+  for (int ch = first; ch <= last; ch++){
+
+    double value = values[ch - first];
+
+    switch (par){
+    case PAR_VSET: vset_[ch] = value; break;
+    case PAR_ISET: iset_[ch] = value; break;
+    case PAR_MAXV: vmax_[ch] = value; break;
+    case PAR_RUP: rampup_[ch] = value; break;
+    case PAR_RDW: rampdown_[ch] = value; break;
+    case PAR_TRIP: triptime_[ch] = value; break;
+    case PAR_PDWN: tripmode_[ch] = value; break;
+    case PAR_POL: polarity_[ch] = value; break;
+    default: return;
+    }
+
+    setting_valid_[par][ch] = true;
+    setting_time_[par][ch] = now;
+  }
+}
+
+void N1470::storeSetting(N1470Param par, int channel, double value){
+
+  double values[CH_MAX] = {value, value, value, value};
+
+  storeSetting(par, channel, values);
+}
+
+bool N1470::skipWrite(N1470Param par, int channel, double value, bool force){
+
+  int first = (channel == CH_ALL) ? 0 : channel;
+  int last = (channel == CH_ALL) ? CH_MAX - 1 : channel;
+  double confirmed;
+  int ch;
+
+  // A CH:4 write is skipped only if every channel already has the value
+  for (ch = first; !force && ch <= last; ch++)
+    if (!cachedSetting(par, ch, &confirmed) || fabs(confirmed - value) >= N1470Command::resolution(par) / 2)
+      break;
+
+  if (!force && ch > last){
+    writes_elided_++;
+    return true;
+  }
+
+  return false;
+}
+
+void N1470::setSettingTTL(N1470Param par, int ms){
+
+  std::lock_guard<std::mutex> lock(setting_mutex_);
+
+  if (par >= 0 && par < PAR_COUNT)
+    setting_ttl_ms_[par] = ms;
+}
+
+void N1470::invalidateSettings(){
+
+  std::lock_guard<std::mutex> lock(setting_mutex_);
+
+  for (int par = 0; par < PAR_COUNT; par++)
+    for (int ch = 0; ch < CH_MAX; ch++)
+      setting_valid_[par][ch] = false;
+}
+
+int N1470::loadSettings(){
+
+  static const N1470Param pars[] = {PAR_VSET, PAR_ISET, PAR_MAXV, PAR_RUP, PAR_RDW, PAR_TRIP, PAR_PDWN, PAR_POL};
+  int ret;
+
+  for (unsigned int i = 0; i < sizeof(pars) / sizeof(pars[0]); i++)
+    if ((ret = refreshSetting(pars[i])) != 0)
+      return ret;
+
+  return 0;
+}
+
+int N1470::refreshSetting(N1470Param par, double *read){
+
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  double values[CH_MAX];
+
+  if (par != PAR_VSET && par != PAR_ISET && par != PAR_MAXV && par != PAR_RUP && par != PAR_RDW
+      && par != PAR_TRIP && par != PAR_PDWN && par != PAR_POL){
+    PRINT_ERR("refreshSetting",(unsigned long)par);
+    return -3;
+  }
+
+  N1470Command::monitor(cmd, BD_, CH_ALL, par);
+
+  std::lock_guard<std::mutex> lock(io_mutex_);
+
+  // Unlike the getters, a board that does not answer is not fatal here
+  if (transaction(cmd, &reply) != 0)
+    return -1;
+
+  if (par == PAR_PDWN){
+
+    // KILL or RAMP for each channel, separated by ';'
+    std::string_view text = reply.text;
+
+    if (parseResponse(&reply,1,NULL) != 0)
+      return -2;
+
+    for (int ch = 0; ch < CH_MAX; ch++){
+
+      size_t semi = text.find(';');
+      std::string_view mode = text.substr(0, semi);
+
+      if (mode != "KILL" && mode != "RAMP"){
+	std::cerr << "Could not interpret " << CH_MAX << " power down modes from the response: " << response_ << std::endl;
+	return -2;
+      }
+
+      values[ch] = (mode == "KILL") ? 1 : 0;
+      text = (semi == std::string_view::npos) ? std::string_view() : text.substr(semi + 1);
+    }
+  }
+  else if (parseResponse(&reply,3,values) != 0)
+    return -2;
+
+  storeSetting(par, CH_ALL, values);
+  if (read != NULL)
+    memcpy(read, values, sizeof(values));
+
+  return 0;
+}
+
+int N1470::setTripmode(int channel, int mode){
+
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
+  double kill = mode;
+
+  if (channelCheck(channel, true) != 0)
+    return -ERR_ARG;
+  if (mode != 0 && mode != 1){
+    PRINT_ERR("setTripmode",(unsigned long)mode);
+    return -1;
+  }
+
+  N1470Command::set(cmd, BD_, channel, PAR_PDWN, mode ? "KILL" : "RAMP");
+
+  std::lock_guard<std::mutex> lock(io_mutex_);
+
+  if ((ret = transaction(cmd, &reply)) != 0){
+
+    std::cerr << "There was a problem writing the command to set the power down mode" << std::endl;
+    return -linkError(ret);
+  }
+
+  if (parseResponse(&reply,1,NULL) != 0){
+    std::cerr << "Could not parse response" << std::endl;
+    return -2;
+  }
+
+  storeSetting(PAR_PDWN, channel, kill);
+#ifdef DEBUG
+  std::cout << "Power down mode was set to " << (mode ? "KILL" : "RAMP") << std::endl;
+#endif
+
+  return 0;
+}
+
+int N1470::setInterlock(int mode){
+
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
+
+  if (mode != 0 && mode != 1){
+    PRINT_ERR("setInterlock",(unsigned long)mode);
+    return -9999;
+  }
+
+  N1470Command::boardSet(cmd, BD_, PAR_BDILKM, mode ? "CLOSED" : "OPEN");
+
+  std::lock_guard<std::mutex> lock(io_mutex_);
+
+  if ((ret = transaction(cmd, &reply)) != 0){
+
+    std::cerr << "There was a problem writing the command to set the interlock mode" << std::endl;
+    return -linkError(ret);
+  }
+
+  if (parseResponse(&reply,1,NULL) != 0){
+    std::cerr << "Could not parse response" << std::endl;
+    return -9999;
+  }
+
+  interlock_ = mode;
+  return 0;
+}
+
+int N1470::getInterlock(){
+
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
+
+  N1470Command::boardMonitor(cmd, BD_, PAR_BDILKM);
+
+  std::lock_guard<std::mutex> lock(io_mutex_);
+
+  if ((ret = transaction(cmd, &reply)) != 0){
+
+    std::cerr << "There was a problem writing the command to read out the interlock mode" << std::endl;
+    return -linkError(ret);
+  }
+
+  if (parseResponse(&reply,1,NULL) != 0 || (reply.text != "OPEN" && reply.text != "CLOSED")){
+    std::cerr << "Could not parse response" << std::endl;
+    return -9999;
+  }
+
+  interlock_ = (reply.text == "CLOSED") ? 1 : 0;
+  return interlock_;
+}
+
+int N1470::clearAlarm(){
+
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
+
+  N1470Command::boardSet(cmd, BD_, PAR_BDCLR);
+
+  std::lock_guard<std::mutex> lock(io_mutex_);
+
+  if ((ret = transaction(cmd, &reply)) != 0){
+
+    std::cerr << "There was a problem writing the command to clear the alarm" << std::endl;
+    return -linkError(ret);
+  }
+
+  if (parseResponse(&reply,1,NULL) != 0){
+    std::cerr << "Could not parse response" << std::endl;
+    return -9999;
+  }
+
+  return 0;
+}
+
 double N1470::getTripTime(int channel){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
   double tripTime;
  
-  channelCheck(channel);
+  if (channelCheck(channel) != 0)
+    return -ERR_ARG;
+
+  if (cachedSetting(PAR_TRIP, channel, &tripTime))
+    return tripTime;
 
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:TRIP";
-  cmd = this->formCommand(mon_cmd_, target, replacement.str());
+  N1470Command::monitor(cmd, BD_, channel, PAR_TRIP);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -539,58 +903,51 @@ double N1470::getTripTime(int channel){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to read out the trip time" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to read out the trip time" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,2,&tripTime) != 0){
+  if (parseResponse(&reply,2,&tripTime) != 0){
     std::cerr << "Could not parse response" << std::endl;
   }
+  else
+    storeSetting(PAR_TRIP, channel, &tripTime);
 #ifdef DEBUG
   std::cout << "Trip Time is " << tripTime << std::endl;
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return tripTime;
 
 }
 
 double N1470::getPolarity(int channel){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
   double polarity;
  
-  channelCheck(channel);
+  if (channelCheck(channel) != 0)
+    return -ERR_ARG;
+
+  if (cachedSetting(PAR_POL, channel, &polarity))
+    return polarity;
 
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:POL";
-  cmd = this->formCommand(mon_cmd_, target, replacement.str());
+  N1470Command::monitor(cmd, BD_, channel, PAR_POL);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -600,58 +957,51 @@ double N1470::getPolarity(int channel){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to read out the polarity" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to read out the polarity" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,2,&polarity) != 0){
+  if (parseResponse(&reply,2,&polarity) != 0){
     std::cerr << "Could not parse response" << std::endl;
   }
+  else
+    storeSetting(PAR_POL, channel, &polarity);
 #ifdef DEBUG
   std::cout << "Polarity is " << polarity << std::endl;
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return polarity;
 
 }
 
 double N1470::getMaxVoltage(int channel){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
   double voltage;
  
-  channelCheck(channel);
+  if (channelCheck(channel) != 0)
+    return -ERR_ARG;
+
+  if (cachedSetting(PAR_MAXV, channel, &voltage))
+    return voltage;
 
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:MAXV";
-  cmd = this->formCommand(mon_cmd_, target, replacement.str());
+  N1470Command::monitor(cmd, BD_, channel, PAR_MAXV);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -661,58 +1011,51 @@ double N1470::getMaxVoltage(int channel){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to read out the trip time" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to read out the trip time" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,2,&voltage) != 0){
+  if (parseResponse(&reply,2,&voltage) != 0){
     std::cerr << "Could not parse response" << std::endl;
   }
+  else
+    storeSetting(PAR_MAXV, channel, &voltage);
 #ifdef DEBUG
   std::cout << "Max voltage is " << voltage << std::endl;
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return voltage;
 
 }
 
 double N1470::getRampUpRate(int channel){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
   double rate;
  
-  channelCheck(channel);
+  if (channelCheck(channel) != 0)
+    return -ERR_ARG;
+
+  if (cachedSetting(PAR_RUP, channel, &rate))
+    return rate;
 
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:RUP";
-  cmd = this->formCommand(mon_cmd_, target, replacement.str());
+  N1470Command::monitor(cmd, BD_, channel, PAR_RUP);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -722,58 +1065,51 @@ double N1470::getRampUpRate(int channel){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to read out the ramp up rate" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to read out the ramp up rate" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,2,&rate) != 0){
+  if (parseResponse(&reply,2,&rate) != 0){
     std::cerr << "Could not parse response" << std::endl;
   }
+  else
+    storeSetting(PAR_RUP, channel, &rate);
 #ifdef DEBUG
   std::cout << "Ramp up rate is " << rate << std::endl;
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return rate;
 
 }
 
 double N1470::getRampDownRate(int channel){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
   double rate;
  
-  channelCheck(channel);
+  if (channelCheck(channel) != 0)
+    return -ERR_ARG;
+
+  if (cachedSetting(PAR_RDW, channel, &rate))
+    return rate;
 
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:RDW";
-  cmd = this->formCommand(mon_cmd_, target, replacement.str());
+  N1470Command::monitor(cmd, BD_, channel, PAR_RDW);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -783,61 +1119,54 @@ double N1470::getRampDownRate(int channel){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to read out the ramp down rate" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to read out the ramp down rate" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,2,&rate) != 0){
+  if (parseResponse(&reply,2,&rate) != 0){
     std::cerr << "Could not parse response" << std::endl;
   }
+  else
+    storeSetting(PAR_RDW, channel, &rate);
 #ifdef DEBUG
   std::cout << "Ramp down rate is " << rate << std::endl;
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return rate;
 
 }
 
-double N1470::setRampUpRate(int channel, double rate){
+double N1470::setRampUpRate(int channel, double rate, bool force){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:RUP,VAL:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
  
-  channelCheck(channel);
+  if (channelCheck(channel, true) != 0)
+    return -ERR_ARG;
   if (rate < 0 || rate > 500){
     std::cerr << "Rate is outside of limits" << std::endl;
     return -1;
   }
 
+  if (skipWrite(PAR_RUP, channel, rate, force))
+    return rate;
+
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:RUP,VAL:" << rate;
-  cmd = this->formCommand(rampup_cmd_, target, replacement.str());
+  N1470Command::set(cmd, BD_, channel, PAR_RUP, rate);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -847,60 +1176,55 @@ double N1470::setRampUpRate(int channel, double rate){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to set the ramp up rate" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to set the ramp up rate" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,1,&rate) != 0){
+  if (parseResponse(&reply,1,&rate) != 0){
     std::cerr << "Could not parse response" << std::endl;
+    return -(reply.error != ERR_NONE ? reply.error : ERR_FORMAT);
   }
+
+  storeSetting(PAR_RUP, channel, rate);
+  writes_sent_++;
 #ifdef DEBUG
   std::cout << "Ramp up rate was set to " << rate << std::endl;
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return rate;	
 }
 
-double N1470::setRampDownRate(int channel, double rate){
+double N1470::setRampDownRate(int channel, double rate, bool force){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:RDW,VAL:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
  
-  channelCheck(channel);
+  if (channelCheck(channel, true) != 0)
+    return -ERR_ARG;
   if (rate < 0 || rate > 500){
     std::cerr << "Rate is outside of limits" << std::endl;
     return -1;
   }
 
+  if (skipWrite(PAR_RDW, channel, rate, force))
+    return rate;
+
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:RDW,VAL:" << rate;
-  cmd = this->formCommand(rampup_cmd_, target, replacement.str());
+  N1470Command::set(cmd, BD_, channel, PAR_RDW, rate);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -910,60 +1234,55 @@ double N1470::setRampDownRate(int channel, double rate){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to set the ramp down rate" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to set the ramp down rate" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,1,&rate) != 0){
+  if (parseResponse(&reply,1,&rate) != 0){
     std::cerr << "Could not parse response" << std::endl;
+    return -(reply.error != ERR_NONE ? reply.error : ERR_FORMAT);
   }
+
+  storeSetting(PAR_RDW, channel, rate);
+  writes_sent_++;
 #ifdef DEBUG
   std::cout << "Ramp down rate was set to " << rate << std::endl;
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return rate;	
 }
 
-double N1470::setVoltage(int channel, double voltage){
+double N1470::setVoltage(int channel, double voltage, bool force){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:VSET,VAL:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
  
-  channelCheck(channel);
+  if (channelCheck(channel, true) != 0)
+    return -ERR_ARG;
   if (voltage < 0 || voltage > 1500){
     std::cerr << "Voltage is outside of limits" << std::endl;
     return -1;
   }
 
+  if (skipWrite(PAR_VSET, channel, voltage, force))
+    return voltage;
+
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:VSET,VAL:" << voltage;
-  cmd = this->formCommand(vset_cmd_, target, replacement.str());
+  N1470Command::set(cmd, BD_, channel, PAR_VSET, voltage);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -973,61 +1292,56 @@ double N1470::setVoltage(int channel, double voltage){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to set the voltage" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to set the voltage" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,1,&voltage) != 0){
+  if (parseResponse(&reply,1,&voltage) != 0){
     std::cerr << "Could not parse response" << std::endl;
+    return -(reply.error != ERR_NONE ? reply.error : ERR_FORMAT);
   }
+
+  storeSetting(PAR_VSET, channel, voltage);
+  writes_sent_++;
 #ifdef DEBUG
   std::cout << "Voltage was set to " << voltage << std::endl;
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return voltage;	
 }
 
 	
-double N1470::setMaxVoltage(int channel, double voltage){
+double N1470::setMaxVoltage(int channel, double voltage, bool force){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:MAXV,VAL:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
  
-  channelCheck(channel);
+  if (channelCheck(channel, true) != 0)
+    return -ERR_ARG;
   if (voltage < 0 || voltage > 1500){
     std::cerr << "Voltage is outside of limits" << std::endl;
     return -1;
   }
 
+  if (skipWrite(PAR_MAXV, channel, voltage, force))
+    return voltage;
+
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:MAXV,VAL:" << voltage;
-  cmd = this->formCommand(vmax_cmd_, target, replacement.str());
+  N1470Command::set(cmd, BD_, channel, PAR_MAXV, voltage);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -1037,60 +1351,55 @@ double N1470::setMaxVoltage(int channel, double voltage){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to set the voltage" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to set the voltage" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,1,&voltage) != 0){
+  if (parseResponse(&reply,1,&voltage) != 0){
     std::cerr << "Could not parse response" << std::endl;
+    return -(reply.error != ERR_NONE ? reply.error : ERR_FORMAT);
   }
+
+  storeSetting(PAR_MAXV, channel, voltage);
+  writes_sent_++;
 #ifdef DEBUG
   std::cout << "Max voltage was set to " << voltage << std::endl;
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return voltage;	
 }	
 
-double N1470::setCurrent(int channel, double current){
+double N1470::setCurrent(int channel, double current, bool force){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:ISET,VAL:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
  
-  channelCheck(channel);
+  if (channelCheck(channel, true) != 0)
+    return -ERR_ARG;
   if (current < 0 || current > 3000){
     std::cerr << "Current is outside of limits" << std::endl;
     return -1;
   }
 
+  if (skipWrite(PAR_ISET, channel, current, force))
+    return current;
+
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:ISET,VAL:" << current;
-  cmd = this->formCommand(iset_cmd_, target, replacement.str());
+  N1470Command::set(cmd, BD_, channel, PAR_ISET, current);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -1100,61 +1409,56 @@ double N1470::setCurrent(int channel, double current){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to set the current" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to set the current" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,1,&current) != 0){
+  if (parseResponse(&reply,1,&current) != 0){
     std::cerr << "Could not parse response" << std::endl;
+    return -(reply.error != ERR_NONE ? reply.error : ERR_FORMAT);
   }
+
+  storeSetting(PAR_ISET, channel, current);
+  writes_sent_++;
 #ifdef DEBUG
   std::cout << "Current was set to " << current << std::endl;
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return current;
 
 }
 
-double N1470::setTripTime(int channel, double tripTime){
+double N1470::setTripTime(int channel, double tripTime, bool force){
 
-  char * cmd;
-  std::string target = "CH:X,PAR:TRIP,VAL:XX";
-  std::string *response = new std::string();
-  std::ostringstream replacement;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response reply;
+  int ret;
  
-  channelCheck(channel);
+  if (channelCheck(channel, true) != 0)
+    return -ERR_ARG;
   if (tripTime < 0 || tripTime > 25){
     std::cerr << "tripTime is outside of limits" << std::endl;
     return -1;
   }
 
+  if (skipWrite(PAR_TRIP, channel, tripTime, force))
+    return tripTime;
+
   // Form command properly                                                                                
-  replacement << "CH:" << channel << ",PAR:TRIP,VAL:" << tripTime;
-  cmd = this->formCommand(triptime_cmd_, target, replacement.str());
+  N1470Command::set(cmd, BD_, channel, PAR_TRIP, tripTime);
 
 #ifdef DEBUG_MAX
   // Write the actual command unless there's no device present as defined                                       
@@ -1164,145 +1468,141 @@ double N1470::setTripTime(int channel, double tripTime){
   fputs(cmd,stderr);
 #endif
 
-  if (writeCommand(cmd) != 0){
+  std::lock_guard<std::mutex> lock(io_mutex_);
 
-    std::cerr << "There was a problem writing the command to set the trip time" << std::endl;
-    free(cmd);
-    delete(response);
-    exit(1);
-  }
-    
+  if ((ret = transaction(cmd, &reply)) != 0){
 
-  if (getResponse(response) != 0){
-    
-    fprintf(stderr,"Could not get response\n");
-    free(cmd);
-    delete(response);
-    exit(1);
+    std::cerr << "There was a problem writing the command to set the trip time" << std::endl;
+    return -linkError(ret);
   }
 
 #ifdef DEBUG_MAX
   std::cout << "Printing response:" << std::endl;
-  std::cout << (*response) << std::endl;
+  std::cout << response_ << std::endl;
 #endif
 
 #ifdef DEBUG_MAX
   std::cout << "Parsing response:" << std::endl;
 #endif
-  if (parseResponse(response,1,&tripTime) != 0){
+  if (parseResponse(&reply,1,&tripTime) != 0){
     std::cerr << "Could not parse response" << std::endl;
+    return -(reply.error != ERR_NONE ? reply.error : ERR_FORMAT);
   }
+
+  storeSetting(PAR_TRIP, channel, tripTime);
+  writes_sent_++;
 #ifdef DEBUG
   std::cout << "Trip Time was set to " << tripTime << std::endl;
 #endif
 
   // No memory leaks!                                                      
-  delete(response);
-  free(cmd);
   return tripTime;
 
 }
 
-int N1470::getResponse(std::string * accumulator){
-  
-  char * buf; 
-  
-  DWORD bufLenWd, bufWrtWd, status, bufRead;
-  int ret;
-
-  buf = (char *)calloc(BUFFER_SIZE, sizeof(char));
+int N1470::parseResponse(N1470Response *reply, int type, double *value){
 
-  bufLenWd = 0;
-  bufWrtWd = 0;
-  status = 0;
-  bufRead = 0;
-  ret = 0;
+  if (reply->error != ERR_NONE){
+    parseError(reply);
+    return -9;
+  }
 
-  sleep(RESPONSE_TIME_N1470);
-  
-#ifdef DEBUG_MAX
-  std::cout << "bufLenWd BufWrtWd Status" << std::endl;
-  std::cout << bufLenWd << " " << bufWrtWd << " " << status << std::endl;
-#endif
+  if (reply->bd != BD_){
+    std::cerr << "Reply came from board " << reply->bd << " instead of " << BD_ << ": " << response_;
+    return -3;
+  }
 
-  do {
+  if (type == 3){
 
-    if((ret = FT_GetStatus(dev_, &bufLenWd, &bufWrtWd, &status)) != FT_OK){
-      PRINT_ERR("FT_GetStatus",(long unsigned)ret);
-      return 1;
+    if (reply->nValues != CH_MAX){
+      std::cerr << "Could not interpret " << CH_MAX << " values from the response: " << response_ << std::endl;
+      return -2;
     }
-      
-    if (bufLenWd > BUFFER_SIZE){
 
-      buf = (char *)realloc(buf,bufLenWd);
-      
-      if (buf == NULL){
+    for (int ch = 0; ch < CH_MAX; ch++)
+      value[ch] = reply->values[ch];
+  }
 
-	fprintf(stderr,"OOM ERROR on buffer length %ul\n",bufLenWd);
-	return 1;
-      }
-    }      
-    
-    if((ret = FT_Read(dev_,buf, bufLenWd, &bufRead))!=FT_OK){
-      PRINT_ERR("FT_Read",(long unsigned)ret);
-      return 1;
+  if (type == 2){
+
+    if (reply->nValues < 1){
+      std::cerr << "Could not interpret a value from the response: " << response_ << std::endl;
+      return -2;
     }
 
-    // Null-terminate the response
-    buf[bufLenWd] = '\0';
+    *value = reply->values[0];
+  }
+
+  return 0;
 
-#ifdef DEBUG_MAX
-    std::cerr << "Accumulating buffer" << std::endl;	    
-    puts(buf);
-#endif
-    accumulator->append(buf);
-  }  while (bufLenWd!=0);
-  
-  return 0; 
 }
 
-int N1470::parseResponse(std::string *response, int type, double *value){
+int N1470::parseError(N1470Response *reply){
 
-    int loc, loc2;	
-    loc = response->find("OK");
-    if (loc == -1)
-      {	
-    std::cerr << loc << std::endl;
-    std::cerr << "Something has gone wrong. Command failed!" << std::endl;
-    return -9;
-  }		
+  if (reply->error == ERR_NONE)
+    return -1;
 
-    if(type == 2){
-    
-    loc2 = response->find("VAL:+\r\n",0,5);
+  std::cerr << "Board " << BD_ << " refused the command: " << N1470Response::describe(reply->error)
+	    << " (" << response_.substr(0, response_.find("\r")) << ")" << std::endl;
 
-    if ( loc2  != -1){   
-#ifdef DEBUG_MAX
-    std::cerr << *response;
-#endif
-    *value = 1;	
-    return 0;
-  }				
-    else if ((loc2 = response->find("VAL:-\r\n",0,5)) != -1){
-#ifdef DEBUG_MAX
-    std::cerr << *response;
-#endif
-    *value = -1;
-    return 0;
-  }			
-    
-    
-    
-    if (sscanf(response->substr(loc).c_str(),"OK,VAL:%lf",value) != 1){
-    
-    std::cerr << "Could not interpret a value from the response: " << *response << std::endl;
-    return -2;
-  }			
-  }
-  
   return 0;
 
-  }	
+}
+
+int N1470::addStatusCallback(int mask, N1470StatusCallback callback){
+
+  std::lock_guard<std::mutex> lock(status_mutex_);
+  StatusWatch watch;
+
+  watch.id = next_watch_++;
+  watch.mask = mask;
+  watch.callback = callback;
+  status_watches_.push_back(watch);
+
+  return watch.id;
+}
+
+void N1470::removeStatusCallback(int id){
+
+  std::lock_guard<std::mutex> lock(status_mutex_);
+
+  for (unsigned int i = 0; i < status_watches_.size(); i++)
+    if (status_watches_[i].id == id){
+      status_watches_.erase(status_watches_.begin() + i);
+      return;
+    }
+}
+
+void N1470::updateStatus(int channel, int status){
+
+  std::vector<std::pair<N1470StatusCallback, int> > due;
+  N1470StatusEvent event;
+
+  {
+    std::lock_guard<std::mutex> lock(status_mutex_);
+
+    event.previous = status_seen_[channel];
+    status_seen_[channel] = status;
+
+    if (event.previous == status)
+      return;
+
+    for (unsigned int i = 0; i < status_watches_.size(); i++)
+      if ((status ^ event.previous) & status_watches_[i].mask)
+	due.push_back(std::make_pair(status_watches_[i].callback, status_watches_[i].mask));
+  }
+
+  clock_gettime(CLOCK_REALTIME, &event.time);
+  event.bd = BD_;
+  event.ch = channel;
+  event.status = status;
+
+  // Outside the lock, so a callback may add or remove callbacks
+  for (unsigned int i = 0; i < due.size(); i++){
+    event.changed = (status ^ event.previous) & due[i].second;
+    due[i].first(event);
+  }
+}
 
 void N1470::parseChannelStatus(double statusDb){
     
@@ -1353,3 +1653,323 @@ void N1470::parseChannelStatus(double statusDb){
       std::cerr << "CHANNEL CALIBRATION ERROR" << std::endl;
 
   }
+
+int N1470::startPolling(int intervalMs, int statusIntervalMs){
+
+  if (!connected_){
+    fprintf(stderr,"Cannot poll a module that is not connected\n");
+    return -1;
+  }
+
+  if (intervalMs < 0){
+    PRINT_ERR("startPolling",(unsigned long)intervalMs);
+    return -2;
+  }
+
+  stopPolling();
+
+  polling_ = true;
+  poll_interval_ms_ = intervalMs;
+  status_interval_ms_ = statusIntervalMs;
+  poll_thread_ = std::thread(&N1470::pollLoop, this);
+
+  return 0;
+}
+
+void N1470::stopPolling(){
+
+  {
+    std::lock_guard<std::mutex> lock(poll_mutex_);
+    polling_ = false;
+  }
+  poll_wake_.notify_all();
+
+  if (poll_thread_.joinable())
+    poll_thread_.join();
+}
+
+void N1470::pollLoop(){
+
+  std::unique_lock<std::mutex> lock(poll_mutex_);
+  std::chrono::steady_clock::time_point sweep = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::duration stat(0); // how long the last STAT alone took
+
+  while (polling_){
+
+    lock.unlock();
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now(), next;
+
+    // Full sweeps on their interval, STAT alone in between
+    if (now >= sweep){
+      pollOnce();
+      sweep = std::chrono::steady_clock::now() + std::chrono::milliseconds(poll_interval_ms_);
+    }
+    else {
+      getAllStatus();
+      stat = std::chrono::steady_clock::now() - now;
+    }
+
+    now = std::chrono::steady_clock::now();
+
+    if (status_interval_ms_ > 0)
+      next = now + std::chrono::milliseconds(status_interval_ms_);
+    else if (status_interval_ms_ == 0){
+
+      // STAT is never held back by its budget on the link, so the poller
+      // keeps to it: the time a read takes over the share is the time
+      // from one read to the next
+      double share = bus_->getLinkShare(PRIO_STATUS);
+
+      if (share <= 0)
+	next = sweep;
+      else if (share >= 1)
+	next = now;
+      else
+	next = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(stat * ((1 - share) / share));
+    }
+    else
+      next = sweep;
+
+    lock.lock();
+
+    poll_wake_.wait_until(lock, std::min(sweep, next));
+  }
+}
+
+int N1470::pollOnce(){
+
+  N1470Snapshot snap;
+  int ret;
+
+  memset(&snap, 0, sizeof(snap));
+
+  // Straight into the snapshot, so it holds this sweep whatever other
+  // callers read in between
+  if ((ret = getAllVoltages(snap.vmon)) != 0 || (ret = getAllCurrents(snap.imon)) != 0
+      || (ret = getAllStatus(snap.status)) != 0){
+
+    // The last good sweep stays up, marked as one more sweep out of date
+    publishSnapshot(NULL, -ret);
+    return ret;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &snap.time);
+
+  {
+    std::lock_guard<std::mutex> lock(setting_mutex_);
+    for (int ch = 0; ch < CH_MAX; ch++){
+      snap.vset[ch] = vset_[ch];
+      snap.iset[ch] = iset_[ch];
+    }
+  }
+
+  publishSnapshot(&snap, ERR_NONE);
+  return 0;
+}
+
+void N1470::publishSnapshot(const N1470Snapshot *fresh, int error){
+
+  N1470Snapshot snap;
+  uint64_t words[sizeof(N1470Snapshot) / sizeof(uint64_t)];
+
+  // Writers take turns, so the sequence cannot move under us
+  std::lock_guard<std::mutex> publish_lock(publish_mutex_);
+  unsigned long seq = snapshot_seq_.load(std::memory_order_relaxed);
+
+  if (fresh != NULL)
+    snap = *fresh;
+  else {
+    // Only writers change the words, and we are the only one
+    for (unsigned int word = 0; word < sizeof(words) / sizeof(uint64_t); word++)
+      words[word] = snapshot_words_[word].load(std::memory_order_relaxed);
+    memcpy(&snap, words, sizeof(snap));
+    snap.stale++;
+  }
+
+  snap.error = error;
+  snap.sequence = seq / 2 + 1;
+  memcpy(words, &snap, sizeof(snap));
+
+  snapshot_seq_.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for (unsigned int word = 0; word < sizeof(words) / sizeof(uint64_t); word++)
+    snapshot_words_[word].store(words[word], std::memory_order_relaxed);
+
+  snapshot_seq_.store(seq + 2, std::memory_order_release);
+
+  // Readers in other processes and the recorder only hear of new values
+  if (fresh == NULL)
+    return;
+
+  // Still under publish_mutex_, so this board's slot has a single writer
+  N1470ShmWriter *shared = shared_status_;
+  if (shared != NULL)
+    shared->publish(BD_, snap);
+
+  N1470Recorder *recorder = recorder_;
+  if (recorder != NULL)
+    recorder->record(BD_, snap);
+}
+
+unsigned long N1470::getSnapshot(N1470Snapshot *snap){
+
+  uint64_t words[sizeof(N1470Snapshot) / sizeof(uint64_t)];
+  unsigned long before, after;
+
+  do {
+
+    before = snapshot_seq_.load(std::memory_order_acquire);
+
+    for (unsigned int word = 0; word < sizeof(words) / sizeof(uint64_t); word++)
+      words[word] = snapshot_words_[word].load(std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = snapshot_seq_.load(std::memory_order_relaxed);
+
+  } while ((before & 1) || before != after);
+
+  memcpy(snap, words, sizeof(words));
+  return snap->sequence;
+}
+
+
+// Limits of the blocking setters, so both paths refuse the same values
+static bool withinLimits(N1470Param par, double value){
+
+  switch (par){
+  case PAR_ON:
+  case PAR_OFF: return true;
+  case PAR_VSET:
+  case PAR_MAXV: return value >= 0 && value <= 1500;
+  case PAR_ISET: return value >= 0 && value <= 3000;
+  case PAR_RUP:
+  case PAR_RDW: return value >= 0 && value <= 500;
+  case PAR_TRIP: return value >= 0 && value <= 25;
+  default: return false;
+  }
+}
+
+// Completes a callback at once with an error and no values
+static void failAsync(N1470ResultCallback callback, int error){
+
+  N1470Result result;
+
+  result.error = error;
+  result.nValues = 0;
+  callback(result);
+}
+
+void N1470::submitAsync(const char *cmd, N1470ResultCallback callback){
+
+  int bd = BD_;
+
+  // Outside pipelined mode the bus carries the command out before returning
+  if (!connected_){
+    failAsync(callback, ERR_IO);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    n_async_++;
+  }
+
+  bus_->submit(BD_, cmd, [this, bd, callback](const N1470Reply &reply){
+
+      N1470Result result;
+      N1470Response parsed;
+
+      result.nValues = 0;
+
+      if (reply.status == 1)
+	result.error = ERR_IO;
+      else if (reply.status == 2)
+	result.error = ERR_TIMEOUT;
+      else if (reply.status == 3)
+	result.error = ERR_ABANDONED;
+      else if ((result.error = N1470Response::parse(reply.response, &parsed)) == ERR_NONE){
+	if (parsed.bd != bd)
+	  result.error = ERR_FORMAT;
+	else {
+	  result.nValues = parsed.nValues;
+	  for (int i = 0; i < parsed.nValues; i++)
+	    result.values[i] = parsed.values[i];
+	}
+      }
+
+      callback(result);
+
+      // Notified under the lock, so the destructor cannot free it first
+      std::lock_guard<std::mutex> lock(async_mutex_);
+      if (--n_async_ == 0)
+	async_done_.notify_all();
+    });
+}
+
+void N1470::monitorAsync(int channel, N1470Param par, N1470ResultCallback callback){
+
+  char cmd[CMD_SIZE_N1470];
+
+  if (channel < 0 || channel > CH_ALL){
+    failAsync(callback, ERR_ARG);
+    return;
+  }
+
+  N1470Command::monitor(cmd, BD_, channel, par);
+
+  // Settings read this way refresh the cache as well, and status words
+  // go to the status callbacks
+  submitAsync(cmd, [this, par, channel, callback](const N1470Result &result){
+    if (result.error == ERR_NONE && result.nValues == (channel == CH_ALL ? CH_MAX : 1)){
+      if (par == PAR_STAT)
+	for (int i = 0; i < result.nValues; i++)
+	  updateStatus(channel == CH_ALL ? i : channel, (int)result.values[i]);
+      else
+	storeSetting(par, channel, result.values);
+    }
+    callback(result);
+  });
+}
+
+void N1470::setAsync(int channel, N1470Param par, double value, N1470ResultCallback callback){
+
+  char cmd[CMD_SIZE_N1470];
+
+  if (channel < 0 || channel > CH_ALL || !withinLimits(par, value)){
+    failAsync(callback, ERR_ARG);
+    return;
+  }
+
+  if (par == PAR_ON || par == PAR_OFF)
+    N1470Command::set(cmd, BD_, channel, par);
+  else
+    N1470Command::set(cmd, BD_, channel, par, value);
+
+  submitAsync(cmd, [this, par, channel, value, callback](const N1470Result &result){
+    if (result.error == ERR_NONE)
+      storeSetting(par, channel, value);
+    callback(result);
+  });
+}
+
+std::future<N1470Result> N1470::monitorAsync(int channel, N1470Param par){
+
+  std::shared_ptr<std::promise<N1470Result> > promise = std::make_shared<std::promise<N1470Result> >();
+  std::future<N1470Result> future = promise->get_future();
+
+  monitorAsync(channel, par, [promise](const N1470Result &result){ promise->set_value(result); });
+
+  return future;
+}
+
+std::future<N1470Result> N1470::setAsync(int channel, N1470Param par, double value){
+
+  std::shared_ptr<std::promise<N1470Result> > promise = std::make_shared<std::promise<N1470Result> >();
+  std::future<N1470Result> future = promise->get_future();
+
+  setAsync(channel, par, value, [promise](const N1470Result &result){ promise->set_value(result); });
+
+  return future;
+}
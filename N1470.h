@@ -4,21 +4,102 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "ftd2xx.h"
+#include "N1470Bus.h"
+#include "N1470Command.h"
+#include "N1470Response.h"
 
 #include <iostream>
 #include <cstring>
 #include <string>
-#include <sstream>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <stdint.h>
 
 #define CH_MAX 4 // number of channels on board
-#define CMD_LIST_LEN_N1470 12
-#define RESPONSE_TIME_N1470 1 // the number of seconds that the board needs
-                        // to respond to a normal request
+#define CH_ALL 4 // channel number that addresses all channels at once
 #define NUYMBER_OF_RETRIES 5
-#define BUFFER_SIZE 512
-#define PRINT_ERR(name, err) fprintf(stderr,"Function %s failed with error code %lu in line %d of file %s\n", name, err, __LINE__, __FILE__)
+#define STABLE_POLL_MIN_MS_N1470 20 // shortest pause between polls of waitUntilStable
+#define STABLE_POLL_MAX_MS_N1470 5000 // longest, while a ramp is far from done
+#define SETTING_TTL_MS_N1470 60000 // default time MAXV, RUP, RDW and TRIP are trusted after a read or set
+
+// Bits of the channel status word (STAT)
+#define STAT_ON_N1470 (1 << 0)
+#define STAT_RUP_N1470 (1 << 1) // ramping up
+#define STAT_RDW_N1470 (1 << 2) // ramping down
+#define STAT_OVC_N1470 (1 << 3) // IMON > ISET
+#define STAT_OVV_N1470 (1 << 4) // VMON > VSET + 250 V
+#define STAT_UNV_N1470 (1 << 5) // VMON < VSET - 250 V
+#define STAT_MAXV_N1470 (1 << 6) // VOUT at MAXV
+#define STAT_TRIP_N1470 (1 << 7)
+#define STAT_OVP_N1470 (1 << 8) // max power exceeded
+#define STAT_OVT_N1470 (1 << 9) // over temperature
+#define STAT_DIS_N1470 (1 << 10) // disabled
+#define STAT_KILL_N1470 (1 << 11)
+#define STAT_ILK_N1470 (1 << 12)
+#define STAT_NOCAL_N1470 (1 << 13) // calibration error
+
+// Consistent view of all channels published by the background poller
+struct N1470Snapshot{
+
+  struct timespec time; // CLOCK_REALTIME at the end of the sweep
+  unsigned long sequence; // Number of the sweep, starting from 1
+
+  double vmon[CH_MAX]; // Measured voltage in V
+  double imon[CH_MAX]; // Measured current in uA
+  int status[CH_MAX]; // Channel status words
+  double vset[CH_MAX]; // Last voltage set or read back through this object in V, 0 if none
+  double iset[CH_MAX]; // Same for the current limit in uA
+
+  int stale; // Sweeps failed since these values were read, 0 if they are current
+  int error; // N1470Error that failed the latest sweep, ERR_NONE if it succeeded
+
+};
+static_assert(sizeof(N1470Snapshot) % sizeof(uint64_t) == 0, "N1470Snapshot must be a whole number of 64-bit words");
+
+// Outcome of an asynchronous operation
+struct N1470Result{
+
+  int error; // ERR_NONE on success, otherwise the N1470Error that stopped it
+  int nValues; // numbers in the reply: 0 for a SET, 1, or CH_MAX for CH_ALL
+  double values[VAL_MAX_N1470]; // values[0] for a single channel
+
+};
+
+// Completion callback for the asynchronous operations
+typedef std::function<void(const N1470Result &)> N1470ResultCallback;
+
+// A change of a channel's status word
+struct N1470StatusEvent{
+
+  int bd;
+  int ch;
+  int previous; // status word before the change
+  int status; // status word now
+  int changed; // bits that differ, within the mask the callback asked for
+  struct timespec time; // CLOCK_REALTIME of the read that saw the change
+
+  // Did any of the bits turn on, or off?
+  bool rose(int bits) const { return (changed & status & bits) != 0; }
+  bool fell(int bits) const { return (changed & ~status & bits) != 0; }
+
+};
+
+typedef std::function<void(const N1470StatusEvent &)> N1470StatusCallback;
+
+class N1470Recorder;
+class N1470ShmWriter;
 
 // Header file for C++ module related to CAEN N1470 4-channel HV NIM module
 // Note that the documentation switches between iset and ilim for the same quantity
@@ -30,15 +111,59 @@ class N1470{
 
   // Board ID
   int BD_;
-  // Device handle
-  FT_HANDLE dev_; 
+  // Link this board talks over, possibly shared with other boards
+  N1470Bus *bus_;
+  // Did this object create the link itself (single board per link)?
+  bool owns_bus_;
 
   // Is the module represented by this object connected?
   bool connected_;
+
+  // Held for a whole transaction, so that the poller and callers on other
+  // threads see this board's state change one transaction at a time
+  std::mutex io_mutex_;
+
+  // Async requests whose completion still runs code of this object; the
+  // destructor waits for them to drain
+  std::mutex async_mutex_;
+  std::condition_variable async_done_;
+  int n_async_;
+
+  // Background poller
+  std::thread poll_thread_;
+  std::mutex poll_mutex_;
+  std::condition_variable poll_wake_;
+  bool polling_;
+  int poll_interval_ms_;
+  int status_interval_ms_;
+
+  // Status change callbacks and the words they last saw
+  struct StatusWatch{
+    int id;
+    int mask;
+    N1470StatusCallback callback;
+  };
+  std::mutex status_mutex_;
+  std::vector<StatusWatch> status_watches_;
+  int next_watch_;
+  int status_seen_[4];
+
+  // Serialises writers of the snapshot
+  std::mutex publish_mutex_;
+
+  // Seqlock around the published snapshot: odd while a write is in progress.
+  // The snapshot is stored as atomic words so readers never race the writer.
+  std::atomic<unsigned long> snapshot_seq_;
+  std::atomic<uint64_t> snapshot_words_[sizeof(N1470Snapshot) / sizeof(uint64_t)];
+
+  // Get every published snapshot if set
+  std::atomic<N1470Recorder *> recorder_;
+  std::atomic<N1470ShmWriter *> shared_status_;
 			
   // Hardware settings
   double vmon_[4]; // Measured voltage in V
   double imon_[4]; // Measured current in uA
+  int status_[4]; // Last channel status word read back
 
   double vset_[4]; // Set value in V
 	
@@ -52,76 +177,199 @@ class N1470{
   double triptime_[4]; // Maximum time a current over iset is allowed in seconds before trip
   int tripmode_[4]; // if 0, trip means ramp down, if 1, trip means kill
 
-  int interlock_; // 0 = OPEN, 1 = CLOSED
+  int polarity_[4]; // +1 or -1
 
-  // Commands
+  int interlock_; // 0 = OPEN, 1 = CLOSED
 
-  std::string board_name_,mon_cmd_, vset_cmd_, iset_cmd_, vmax_cmd_, rampup_cmd_, rampdown_cmd_, triptime_cmd_, tripmode_cmd_;
-  std::string channel_on_cmd_, channel_off_cmd_, interlock_cmd_, clearalarm_cmd_;
-			
-  // Forms a command to send to the module
-  // Takes a name from the private list above, a target of what to replace and a replacement
-  // Returns a char* to the command that should be sent to the module.
-  char * formCommand(std::string, std::string, std::string);
+  // Cache of the settings above that only change when set: when each was
+  // last read or set, and how long a parameter is trusted (0 never, <0 always)
+  std::mutex setting_mutex_;
+  bool setting_valid_[PAR_COUNT][CH_MAX];
+  std::chrono::steady_clock::time_point setting_time_[PAR_COUNT][CH_MAX];
+  int setting_ttl_ms_[PAR_COUNT];
 
-  // Writes a command to the N1470 and checks to make sure that it is written.
-  // Takes a command string and returns 0 if no problems.
-  int writeCommand(char *);
+  // Receive buffer for this board's replies, reused for every transaction
+  std::string response_;
 
-  // Get response from the board following a command
-  // Takes std::string pointer to store response string 
-  // Return 0 if response arrives, non-zero if response failed. In that case, response string set to NULL
-  int getResponse(std::string *);
+  // Sends a command to this board over the bus and parses the reply in place.
+  // Takes a command string and the result to fill, whose views point into response_.
+  // Return 0 if the response arrived, non-zero on failure. See N1470Bus::transaction.
+  int transaction(char *, N1470Response *);
 
-  // Parse the response and determine if error
+  // Checks the parsed response and determine if error
   // If error, call parseError()
-  // If not error, fill the appropriate internal variables
+  // If not error, copy out the value(s)
+  // type 1 = acknowledgement only, 2 = one value, 3 = CH_MAX values separated by ';'
   // Return 0 if OK, non-zero if error.
-  int parseResponse(std::string *, int type, double *value);
+  int parseResponse(N1470Response *, int type, double *value);
+
+  // Reads one monitored parameter for all channels with a single CH:4 request
+  // Takes the parameter and an array of CH_MAX values to fill. Returns 0 on
+  // success, otherwise minus the N1470Error, e.g. -ERR_TIMEOUT.
+  int monitorAll(N1470Param, double *);
+
+  // Report an error response
+  // returns 0 if the response carried an error, non-zero if it did not
+  int parseError(N1470Response *);
+
+
+  // Takes a channel number as argument and checks that it is within [0,3],
+  // or is CH_ALL if all is set. Returns 0 if so, -ERR_ARG otherwise.
+  int channelCheck(int, bool all = false);
+
+  // Queues a command for this board and hands the typed result to the
+  // callback
+  void submitAsync(const char *, N1470ResultCallback);
+
+  // Records a setting read from or confirmed by the board. CH_ALL takes
+  // CH_MAX values, one per channel.
+  void storeSetting(N1470Param, int channel, const double *);
+  // Same with one value, for every channel if CH_ALL
+  void storeSetting(N1470Param, int channel, double);
 
-  // Parse an error response
-  // returns 0 if error string parsed correctly, non-zero if error string not parsed
-  int parseError(std::string);
+  // Decides whether a setter can skip writing value because the board
+  // already confirmed it, as far as the cache says. Counts a skipped write;
+  // the setter counts a sent one once the board has acknowledged it.
+  bool skipWrite(N1470Param, int channel, double value, bool force);
+  std::atomic<unsigned long> writes_sent_;
+  std::atomic<unsigned long> writes_elided_;
 
+  // Hands a status word just read to the callbacks whose bits changed
+  void updateStatus(int channel, int status);
 
-  // Takes a channel number as argument and checks that it is within [0,3]
-  void channelCheck(int);
+  // Body of the background polling thread
+  void pollLoop();
+
+  // Publishes a sweep as the new snapshot, or with NULL republishes the
+  // last one with stale counted up and the error of the failed sweep
+  void publishSnapshot(const N1470Snapshot *, int error);
 
   
 
  public:
 
+  // A board alone on its own link: makeConnection opens FTDI device 0
   N1470(int);
+  // A board on a shared daisy chain. Normally obtained from N1470Bus::board()
+  N1470(int, N1470Bus *);
+  // Waits for this board's outstanding async requests to complete, so must
+  // not run on the bus's receive thread, i.e. from an async callback
+  ~N1470();
+
+  // When the link cannot carry a command, the blocking methods below return
+  // minus the N1470Error instead: -ERR_IO, -ERR_TIMEOUT, or -ERR_ABANDONED
+  // if emergencyOff dropped it unsent. switchState and the setters return
+  // minus the error the board gave when it refuses a command, e.g. -ERR_VAL.
+  // A channel outside [0,3], or CH_ALL where it is not taken, gives -ERR_ARG.
 
   // Prints the current status to stdout
   // Returns status field
   double printStatus(int);
   
+  // Starts a background thread that reads VMON, IMON and STAT of all channels
+  // every intervalMs and publishes them as a snapshot. In between it reads
+  // STAT alone every statusIntervalMs, so that status callbacks hear of a
+  // trip quickly. 0 reads it as often as the STATUS share of the link allows
+  // (see N1470Bus::setLinkShare); negative turns that off.
+  // Returns 0 on success.
+  int startPolling(int intervalMs, int statusIntervalMs = 0);
+  // Stops the background thread, if any
+  void stopPolling();
+  // Does one VMON/IMON/STAT sweep of all channels and publishes the snapshot.
+  // For callers that drive polling themselves. Returns 0 on success, or the
+  // error of getAllVoltages and co., leaving the previous values published
+  // with their stale count raised.
+  int pollOnce();
+  // Copies the latest snapshot without touching the device. Safe from any
+  // number of threads. Returns its sequence number, 0 if none published yet.
+  unsigned long getSnapshot(N1470Snapshot *);
+  // Appends every snapshot published from now on to the recorder, or stops
+  // recording if NULL. The recorder must outlive the polling.
+  void setRecorder(N1470Recorder *recorder){ recorder_ = recorder; }
+  // Same, publishing to a shared memory segment for other processes
+  void setSharedStatus(N1470ShmWriter *writer){ shared_status_ = writer; }
+
+  // getMaxVoltage, getPolarity, getRampUpRate, getRampDownRate and
+  // getTripTime answer from the last value read or set while it is younger
+  // than the parameter's TTL in ms. 0 always asks the board, negative trusts
+  // the value until it is set again. POL never expires by default, the others
+  // (VSET and ISET too) after SETTING_TTL_MS_N1470.
+  void setSettingTTL(N1470Param, int ms);
+  // Forgets the cached settings, e.g. after a change from the front panel
+  void invalidateSettings();
+  // Writes the board acknowledged from the numeric setters, and writes
+  // skipped as unchanged
+  unsigned long getSentWrites(){ return writes_sent_; }
+  unsigned long getElidedWrites(){ return writes_elided_; }
+  // Reads every cached setting, VSET, ISET and PDWN included, of all
+  // channels, one CH:4 request per parameter. Done on connect for a board
+  // with a link of its own. Returns 0 on success.
+  int loadSettings();
+  // Same for one cacheable parameter, also copying the CH_MAX values if given
+  int refreshSetting(N1470Param, double *values = NULL);
+  // Looks up a cached setting of a channel (PDWN as 1 = KILL, 0 = RAMP).
+  // Returns true and fills the value if it was read or set within the
+  // parameter's TTL.
+  bool cachedSetting(N1470Param, int channel, double *);
+
+  // Calls back on every change of the status bits in mask of any channel,
+  // as seen by whatever reads STAT: getAllStatus, printStatus, the poller,
+  // or monitorAsync. The callback runs on the thread that made the read, so
+  // it must be quick. The first read counts as a change from 0, so
+  // conditions present at start are reported too. Returns an id for
+  // removeStatusCallback.
+  int addStatusCallback(int mask, N1470StatusCallback);
+  void removeStatusCallback(int id);
+
   // Returns true if connected, false if not connected
   bool isConnected(){ return connected_; }
 
   // Make the connection to the physical module. Sets private connected variable.
-  int makeConnection();
+  // A board on its own link opens the transport named by the spec (see
+  // N1470Transport::create), FTDI device 0 if none is given.
+  // On a shared bus the link must already be open.
+  // A board on its own link is the probe board the link is opened with, so
+  // the line speed and tuning are found with it (see N1470Bus::open).
+  int makeConnection(const char *transport = NULL);
   int dropConnection();
 
-  // Returns 0 on success, non-zero on failure. Takes a channel number [0->3]
+  // Returns 0 on success, non-zero on failure. Takes a channel number [0->3],
+  // or CH_ALL to switch every channel with one command
   int switchState(int, bool);
+  // Switches off every channel of every board on this board's link at once,
+  // ahead of queued traffic; see N1470Bus::emergencyOff
+  int emergencyOff(double *elapsedMs = NULL){ return connected_ ? bus_->emergencyOff(elapsedMs) : -1; }
+
+  // Waits until the listed channels (all if NULL) have stopped ramping and
+  // VMON is within tolerance V of VSET, or of 0 for a channel that is off.
+  // Polls VMON and STAT with CH:4 reads, often when RUP/RDW predict the
+  // ramp is about to end and rarely while it is far away.
+  // Returns 0 once stable, 1 when timeoutMs has passed, -2 if a channel
+  // trips, is killed or interlocked, -1 on a read failure, -ERR_ARG for a
+  // channel outside [0,3].
+  int waitUntilStable(const int *channels, int nChannels, double tolerance, int timeoutMs);
+
+  // The numeric setters below skip the write, and return the value at once,
+  // when the board last confirmed that same value within the parameter's
+  // TTL (see setSettingTTL); force always writes.
+  // Each setter also takes CH_ALL, which sets every channel to the value
+  // with one CH:4 command and records it for all four from the one reply.
 
   // Sets the voltage for a channel in Volts. Takes channel number [0-3] and value [0000.00 - 8000.00]. Returns correct value on success.
-  double setVoltage(int, double);
+  double setVoltage(int, double, bool force = false);
   // Same for current
-  double setCurrent(int, double);
+  double setCurrent(int, double, bool force = false);
 
   // Sets the maximum voltage for a channel. Takes channel number (0-3) and value (0000.00-8100.00). Returns correct value on success.
-  double setMaxVoltage(int, double);
+  double setMaxVoltage(int, double, bool force = false);
 
   // Sets the ramp up for a channel. Takes channel number (0-3) and value (000 - 999). Returns correct value on success.
-  double setRampUpRate(int, double);
+  double setRampUpRate(int, double, bool force = false);
   // Sets the ramp down for a channel. Takes channel number (0-3) and value (000 - 999). Returns correct value on success
-  double setRampDownRate(int, double);
+  double setRampDownRate(int, double, bool force = false);
 		
   // Sets the trip time for a channel. Takes channel number (0-3) and value (0000.0 - 9999.9). Returns correct value on success, -9999 on error.
-  double setTripTime(int, double);
+  double setTripTime(int, double, bool force = false);
 
   // Sets the power down mode for a channel. Takes a channel number and an integer: 0 = RAMP, 1 = KILL. Returns 0 on success.
   int setTripmode(int, int);
@@ -132,11 +380,17 @@ class N1470{
   // Clears the board alarm. Returns 0 on success, -9999 on error.
   int clearAlarm();
 
+  // Reads the interlock mode. Returns 0 = OPEN, 1 = CLOSED, -9999 on error.
+  int getInterlock();
+
 
   // Getters
 		
   // returns the device handle of the current module if set. If not set, return NULL.
-  FT_HANDLE getDeviceHandle(){ if (connected_) return dev_; else return NULL;}
+  FT_HANDLE getDeviceHandle(){ if (connected_) return bus_->getDeviceHandle(); else return NULL;}
+
+  // Board ID
+  int getBoardNumber(){ return BD_; }
 
   // Prints Board name to stdout
   // returns -1 in case of error
@@ -145,6 +399,14 @@ class N1470{
   // gets the actual settings on the board
   double getActualVoltage(int channel);
   double getActualCurrent(int channel);
+
+  // Same for all channels in one transaction. Fill vmon_/imon_/status_ and, if
+  // given, the caller's array of CH_MAX entries. Return 0 on success, otherwise
+  // minus the N1470Error: -ERR_IO or -ERR_TIMEOUT if the link failed, or what
+  // the board refused.
+  int getAllVoltages(double *voltages = NULL);
+  int getAllCurrents(double *currents = NULL);
+  int getAllStatus(int *status = NULL);
   // gets the maximum voltage for a channel. Takes channel number (0-3). Returns correct value on success.
   double getMaxVoltage(int ch);
 
@@ -158,6 +420,40 @@ class N1470{
   double getPolarity(int);
 
 
+  // Asynchronous counterparts. Each queues its command on the bus and returns
+  // at once; the future or the callback receives the typed result. They run on
+  // the bus's receive thread once the owner of the link has called
+  // N1470Bus::startPipeline, so any number can be in flight across the boards
+  // of a link without a thread per call. Callbacks run on that thread too and
+  // must not block or call the blocking methods. Otherwise the command is
+  // carried out stop-and-wait before the call returns, and the callback runs
+  // on the calling thread.
+  // Channel CH_ALL addresses all channels at once. A channel or value outside
+  // the limits of the blocking setters completes at once with ERR_ARG.
+  std::future<N1470Result> monitorAsync(int channel, N1470Param);
+  void monitorAsync(int channel, N1470Param, N1470ResultCallback);
+  // Sets a numeric parameter, or switches with PAR_ON/PAR_OFF (value ignored)
+  std::future<N1470Result> setAsync(int channel, N1470Param, double value);
+  void setAsync(int channel, N1470Param, double value, N1470ResultCallback);
+
+  std::future<N1470Result> getActualVoltageAsync(int ch){ return monitorAsync(ch, PAR_VMON); }
+  std::future<N1470Result> getActualCurrentAsync(int ch){ return monitorAsync(ch, PAR_IMON); }
+  std::future<N1470Result> getStatusAsync(int ch){ return monitorAsync(ch, PAR_STAT); }
+  std::future<N1470Result> getMaxVoltageAsync(int ch){ return monitorAsync(ch, PAR_MAXV); }
+  std::future<N1470Result> getRampUpRateAsync(int ch){ return monitorAsync(ch, PAR_RUP); }
+  std::future<N1470Result> getRampDownRateAsync(int ch){ return monitorAsync(ch, PAR_RDW); }
+  std::future<N1470Result> getTripTimeAsync(int ch){ return monitorAsync(ch, PAR_TRIP); }
+  std::future<N1470Result> getPolarityAsync(int ch){ return monitorAsync(ch, PAR_POL); }
+
+  std::future<N1470Result> setVoltageAsync(int ch, double v){ return setAsync(ch, PAR_VSET, v); }
+  std::future<N1470Result> setCurrentAsync(int ch, double i){ return setAsync(ch, PAR_ISET, i); }
+  std::future<N1470Result> setMaxVoltageAsync(int ch, double v){ return setAsync(ch, PAR_MAXV, v); }
+  std::future<N1470Result> setRampUpRateAsync(int ch, double rate){ return setAsync(ch, PAR_RUP, rate); }
+  std::future<N1470Result> setRampDownRateAsync(int ch, double rate){ return setAsync(ch, PAR_RDW, rate); }
+  std::future<N1470Result> setTripTimeAsync(int ch, double t){ return setAsync(ch, PAR_TRIP, t); }
+  std::future<N1470Result> switchStateAsync(int ch, bool on){ return setAsync(ch, on ? PAR_ON : PAR_OFF, 0); }
+
+
   void parseChannelStatus(double);
 
 };
@@ -0,0 +1,1042 @@
+#include "N1470Bus.h"
+#include "N1470.h"
+
+N1470Bus::N1470Bus() :
+  transport_(NULL),
+  connected_(false),
+  late_reply_(false),
+  baud_(BAUD_N1470),
+  probe_bd_(0),
+  pipelining_(false),
+  max_in_flight_(1),
+  n_in_flight_(0),
+  link_busy_(false){
+
+  for (int bd = 0; bd < BD_MAX; bd++){
+    known_[bd] = false;
+    boards_[bd] = NULL;
+    in_flight_[bd] = NULL;
+  }
+
+};
+
+N1470Bus::~N1470Bus(){
+
+  // Boards stop their pollers before the link goes away
+  for (int bd = 0; bd < BD_MAX; bd++){
+    delete boards_[bd];
+    boards_[bd] = NULL;
+  }
+
+  if (connected_)
+    close();
+
+  delete transport_;
+
+};
+
+
+int N1470Bus::open(N1470Transport *transport){
+
+  int ret;
+
+  if (transport == NULL)
+    return -1;
+
+  if (connected_)
+    close();
+
+  delete transport_;
+  transport_ = transport;
+
+  if ((ret = transport_->open()) != 0){
+    fprintf(stderr,"Could not open %s\n",transport_->describe().c_str());
+    return ret;
+  }
+
+#ifdef DEBUG
+  fprintf(stderr,"Opened %s\n",transport_->describe().c_str());
+#endif
+
+  connected_ = true;
+  baud_ = BAUD_N1470;
+  profile_ = N1470Transport::defaultProfile();
+
+  // Short replies come up without waiting out the adapter's latency timer
+  if (tuneLink(N1470Transport::defaultProfile()) < 0)
+    fprintf(stderr,"Could not tune %s, running with its own settings\n",transport_->describe().c_str());
+
+  // A USB adapter runs at the fastest speed the module answers at, found
+  // once and then remembered by its serial number
+  if (transport_->getSerialNumber().empty())
+    return 0;
+
+  if (negotiateBaudRate(probe_bd_) < 0)
+    fprintf(stderr,"Staying at %d baud\n",BAUD_N1470);
+  // Over D2XX the timings of a board known to answer pick the profile
+  else if (getDeviceHandle() != NULL && calibrateLink(probe_bd_) < 0)
+    fprintf(stderr,"Could not calibrate the link, keeping the default tuning\n");
+
+  return 0;
+
+};
+
+int N1470Bus::open(const char *spec){
+
+  return open(N1470Transport::create(spec));
+
+};
+
+// Builds without a device run the D2XX entry points against the simulator
+int N1470Bus::open(int deviceIndex){
+
+#ifndef NO_DEVICE
+  return open(new N1470D2xxTransport(deviceIndex));
+#else
+  return open(new N1470SimTransport());
+#endif
+
+};
+
+int N1470Bus::openBySerialNumber(const char *serial){
+
+#ifndef NO_DEVICE
+  return open(new N1470D2xxTransport(serial, FT_OPEN_BY_SERIAL_NUMBER));
+#else
+  return open(new N1470SimTransport());
+#endif
+
+};
+
+int N1470Bus::openByDescription(const char *description){
+
+#ifndef NO_DEVICE
+  return open(new N1470D2xxTransport(description, FT_OPEN_BY_DESCRIPTION));
+#else
+  return open(new N1470SimTransport());
+#endif
+
+};
+
+
+int N1470Bus::setBaudRate(int baud){
+
+  int ret;
+
+  if (!connected_)
+    return -1;
+
+  if ((ret = transport_->setBaudRate(baud)) != 0)
+    return ret;
+
+  baud_ = baud;
+  return 0;
+}
+
+bool N1470Bus::cleanAt(int bd, int baud){
+
+  char cmd[CMD_SIZE_N1470];
+  char buf[BUFFER_SIZE];
+  std::string response;
+
+  if (setBaudRate(baud) != 0)
+    return false;
+
+  // Whatever came in at the old speed is noise now
+  while (transport_->receive(buf, sizeof(buf), 10) > 0)
+    ;
+
+  N1470Command::boardMonitor(cmd, bd, PAR_BDNAME);
+
+  for (int i = 0; i < BAUD_PROBES_N1470; i++){
+    response.clear();
+    if (transaction(bd, cmd, &response, BAUD_PROBE_TIMEOUT_MS_N1470) != 0 || response.find(",CMD:OK,VAL:N1470") == std::string::npos)
+      return false;
+  }
+
+  return true;
+}
+
+// Speed remembered for an adapter, 0 if none
+static int rememberedBaud(const char *file, const std::string &serial){
+
+  char line[128], name[64];
+  int baud, found = 0;
+  FILE *in;
+
+  if ((in = fopen(file, "r")) == NULL)
+    return 0;
+
+  while (fgets(line, sizeof(line), in) != NULL)
+    if (sscanf(line, "%63s %d", name, &baud) == 2 && serial == name)
+      found = baud;
+
+  fclose(in);
+  return found;
+}
+
+// Records the speed of an adapter, replacing what was there for it
+static void rememberBaud(const char *file, const std::string &serial, int baud){
+
+  std::vector<std::string> kept;
+  char line[128], name[64];
+  FILE *f;
+
+  if ((f = fopen(file, "r")) != NULL){
+    while (fgets(line, sizeof(line), f) != NULL)
+      if (sscanf(line, "%63s", name) == 1 && serial != name)
+	kept.push_back(line);
+    fclose(f);
+  }
+
+  if ((f = fopen(file, "w")) == NULL){
+    perror(file);
+    return;
+  }
+
+  for (unsigned int i = 0; i < kept.size(); i++)
+    fputs(kept[i].c_str(), f);
+  fprintf(f, "%s %d\n", serial.c_str(), baud);
+  fclose(f);
+}
+
+int N1470Bus::negotiateBaudRate(int bd, const char *file){
+
+  static const int rates[] = {BAUD_RATES_N1470};
+  std::string serial;
+  int remembered = 0;
+
+  if (!connected_ || pipelining_){
+    fprintf(stderr,"The line speed can only be negotiated on an open stop-and-wait link\n");
+    return -1;
+  }
+
+  serial = transport_->getSerialNumber();
+  if (file != NULL && !serial.empty())
+    remembered = rememberedBaud(file, serial);
+
+  if (remembered > 0 && cleanAt(bd, remembered))
+    return remembered;
+
+  for (unsigned int i = 0; i < sizeof(rates) / sizeof(rates[0]); i++){
+
+    if (rates[i] == remembered || !cleanAt(bd, rates[i]))
+      continue;
+
+    if (file != NULL && !serial.empty())
+      rememberBaud(file, serial, rates[i]);
+
+    return rates[i];
+  }
+
+  fprintf(stderr,"Board %d does not answer at any line speed\n",bd);
+  setBaudRate(BAUD_N1470);
+  return -2;
+}
+
+int N1470Bus::tuneLink(const N1470LinkProfile &profile){
+
+  int ret;
+
+  if (!connected_)
+    return -1;
+
+  if ((ret = transport_->tune(profile)) != 0)
+    return ret;
+
+  profile_ = profile;
+  return 0;
+}
+
+double N1470Bus::calibrateLink(int bd){
+
+  static const int latencies[] = {1, 2, 4, 8, 16};
+  N1470LinkProfile profile = N1470Transport::defaultProfile(), best = profile;
+  std::chrono::steady_clock::time_point start;
+  char cmd[CMD_SIZE_N1470];
+  std::string response;
+  double us, bestUs = -1;
+  int i;
+
+  if (!connected_ || pipelining_){
+    fprintf(stderr,"The link can only be calibrated open and in stop-and-wait mode\n");
+    return -1;
+  }
+
+  N1470Command::boardMonitor(cmd, bd, PAR_BDNAME);
+
+  for (int event = 1; event >= 0; event--)
+    for (unsigned int l = 0; l < sizeof(latencies) / sizeof(latencies[0]); l++){
+
+      profile.latency_ms = latencies[l];
+      profile.event_char = event;
+
+      if (transport_->tune(profile) != 0)
+	return -2;
+
+      start = std::chrono::steady_clock::now();
+      for (i = 0; i < CALIBRATE_TRIPS_N1470; i++){
+	response.clear();
+	if (transaction(bd, cmd, &response) != 0 || response.find(",CMD:OK") == std::string::npos)
+	  break;
+      }
+
+      // A profile that loses replies is out
+      if (i < CALIBRATE_TRIPS_N1470)
+	continue;
+
+      us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / CALIBRATE_TRIPS_N1470;
+
+#ifdef DEBUG
+      fprintf(stderr,"Latency timer %d ms, event character %s: %.0f us\n",profile.latency_ms,event ? "on" : "off",us);
+#endif
+
+      if (bestUs < 0 || us < bestUs){
+	bestUs = us;
+	best = profile;
+      }
+    }
+
+  if (bestUs < 0){
+    fprintf(stderr,"Board %d does not answer under any profile\n",bd);
+    tuneLink(profile_);
+    return -3;
+  }
+
+  tuneLink(best);
+  return bestUs;
+}
+
+int N1470Bus::close(){
+
+  // Never opened, or the open failed: nothing to close
+  if (!connected_ || transport_ == NULL)
+    return 0;
+
+  // Nobody may be mid-transaction while the handle goes away
+  for (int bd = 0; bd < BD_MAX; bd++)
+    if (boards_[bd] != NULL)
+      boards_[bd]->stopPolling();
+
+  stopPipeline();
+
+	int ret;
+
+	if ((ret = transport_->close()) != 0)
+		return ret;
+
+	connected_ = false;
+
+#ifdef DEBUG
+	fprintf(stderr,"Closed link\n");
+#endif
+	return 0;
+};
+
+
+FT_HANDLE N1470Bus::getDeviceHandle(){
+
+#ifndef NO_DEVICE
+  N1470D2xxTransport *d2xx = dynamic_cast<N1470D2xxTransport *>(getTransport());
+
+  if (d2xx != NULL)
+    return d2xx->getDeviceHandle();
+#endif
+
+  return NULL;
+}
+
+N1470Sim * N1470Bus::getSimulator(){
+
+  N1470SimTransport *sim = dynamic_cast<N1470SimTransport *>(getTransport());
+
+  if (sim != NULL)
+    return sim->getSimulator();
+
+  return NULL;
+}
+
+
+N1470 * N1470Bus::board(int bd){
+
+  if (bd < 0 || bd >= BD_MAX){
+    PRINT_ERR("board",(unsigned long)bd);
+    return NULL;
+  }
+
+  if (boards_[bd] == NULL){
+    known_[bd] = true;
+    boards_[bd] = new N1470(bd, this);
+    if (connected_)
+      boards_[bd]->makeConnection();
+  }
+
+  return boards_[bd];
+}
+
+int N1470Bus::writeCommand(const char *cmd){
+
+  int bufLen, bufWrit;
+  bufLen = strlen(cmd); 
+
+#ifdef DEBUG_MAX
+
+  std::cerr << "Writing the following command to the device: " << cmd << std::endl;
+
+#endif
+
+  if ((bufWrit = transport_->write(cmd, bufLen)) < 0)
+    return -1;
+  
+  if(bufWrit != bufLen){
+    fprintf(stderr, "Buffersize mismatch: bufLen %u \t bufWrit %u\n",bufLen,bufWrit);
+    return -1;
+  }
+
+ return 0;
+
+}
+
+int N1470Bus::getResponse(std::string * accumulator, int timeoutMs){
+  
+  char buf[BUFFER_SIZE]; 
+
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  long remainingMs;
+  int bufRead;
+
+  // Every reply from the board ends in \r\n, so stop as soon as we have seen it
+  while (accumulator->find("\r\n") == std::string::npos){
+
+    remainingMs = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+
+    // One last look without waiting in case the reply landed just as the deadline passed
+    if ((bufRead = transport_->receive(buf, BUFFER_SIZE - 1, remainingMs > 0 ? remainingMs : 0)) < 0)
+      return 1;
+
+    if (bufRead == 0){
+      if (remainingMs <= 0){
+	fprintf(stderr,"No complete response within %d ms, got: %s\n",timeoutMs,accumulator->c_str());
+	late_reply_ = true;
+	return 2;
+      }
+      continue;
+    }
+
+#ifdef DEBUG_MAX
+    buf[bufRead] = '\0';
+    std::cerr << "Accumulating buffer" << std::endl;	    
+    puts(buf);
+#endif
+    accumulator->append(buf, bufRead);
+  }
+  
+  return 0; 
+}
+
+
+
+void N1470Bus::discardLate(){
+
+  char buf[BUFFER_SIZE];
+  int n, discarded = 0;
+
+  while ((n = transport_->receive(buf, sizeof(buf), LATE_REPLY_MS_N1470)) > 0)
+    discarded += n;
+
+#ifdef DEBUG
+  if (discarded > 0)
+    fprintf(stderr,"Threw away %d bytes of a late reply\n",discarded);
+#endif
+
+  late_reply_ = false;
+}
+
+int N1470Bus::transaction(int bd, const char *cmd, std::string *response, int timeoutMs){
+
+  int ret;
+
+  if (pipelining_){
+
+    N1470Reply reply = submit(bd, cmd, timeoutMs).get();
+    response->append(reply.response);
+    return reply.status;
+
+  }
+
+  if (bd >= 0 && bd < BD_MAX)
+    known_[bd] = true;
+
+  // Wait for the scheduler to give this command the link
+  Turn turn;
+  turn.bd = bd;
+  turn.prio = N1470LinkScheduler::classify(cmd);
+  turn.queued = std::chrono::steady_clock::now();
+  turn.granted = false;
+  turn.abandoned = false;
+
+  {
+    std::unique_lock<std::mutex> lock(sched_mutex_);
+    turns_.push_back(&turn);
+    grantTurn();
+    sched_wake_.wait(lock, [&turn]{ return turn.granted || turn.abandoned; });
+    if (turn.abandoned)
+      return 3;
+  }
+
+  std::chrono::steady_clock::time_point sent = std::chrono::steady_clock::now();
+  bool pipelined;
+
+  {
+    std::lock_guard<std::mutex> lock(io_mutex_);
+
+    // startPipeline may have run while this waited for its turn, and then
+    // the receive thread owns the transport
+    if (!(pipelined = pipelining_)){
+
+      if (late_reply_)
+	discardLate();
+
+      if (writeCommand(cmd) != 0)
+	ret = 1;
+      else
+	ret = getResponse(response, timeoutMs);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(sched_mutex_);
+    link_busy_ = false;
+    finishOnLink(turn.prio, bd, sent);
+    grantTurn();
+  }
+
+  if (pipelined){
+
+    N1470Reply reply = submit(bd, cmd, timeoutMs).get();
+    response->append(reply.response);
+    return reply.status;
+
+  }
+
+  return ret;
+}
+
+void N1470Bus::grantTurn(){
+
+  std::vector<N1470Priority> prios;
+  std::vector<int> bds;
+
+  if (link_busy_ || turns_.empty())
+    return;
+
+  for (unsigned int i = 0; i < turns_.size(); i++){
+    prios.push_back(turns_[i]->prio);
+    bds.push_back(turns_[i]->bd);
+  }
+
+  int next = scheduler_.pick(prios.data(), bds.data(), prios.size());
+  Turn *turn = turns_[next];
+  turns_.erase(turns_.begin() + next);
+
+  scheduler_.started(turn->prio, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - turn->queued).count());
+  link_busy_ = true;
+  turn->granted = true;
+  sched_wake_.notify_all();
+}
+
+void N1470Bus::finishOnLink(N1470Priority prio, int bd, std::chrono::steady_clock::time_point sent){
+
+  scheduler_.finished(prio, bd, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count());
+}
+
+int N1470Bus::emergencyOff(double *elapsedMs){
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<std::future<N1470Reply> > replies;
+  std::vector<Request *> abandoned, failed;
+  std::vector<int> bds;
+  char cmd[CMD_SIZE_N1470];
+  std::string response;
+  bool pipelined;
+  int missing = 0;
+
+  for (int bd = 0; bd < BD_MAX; bd++)
+    if (known_[bd])
+      bds.push_back(bd);
+
+  {
+    std::lock_guard<std::mutex> lock(pipe_mutex_);
+
+    if ((pipelined = pipelining_)){
+
+      // Everything not yet sent makes way, and the OFFs go first. OFFs of
+      // another emergencyOff still waiting go too, ahead of these.
+      std::deque<Request *> kept;
+      for (unsigned int i = 0; i < pending_.size(); i++)
+	if (pending_[i]->prio == PRIO_EMERGENCY)
+	  kept.push_back(pending_[i]);
+	else
+	  abandoned.push_back(pending_[i]);
+      pending_.swap(kept);
+
+      for (unsigned int i = 0; i < bds.size(); i++){
+
+	Request *req = new Request();
+
+	N1470Command::set(cmd, bds[i], CH_ALL, PAR_OFF);
+	req->bd = bds[i];
+	req->cmd = cmd;
+	req->prio = PRIO_EMERGENCY;
+	req->timeout_ms = RESPONSE_TIMEOUT_MS_N1470;
+	req->queued = start;
+	replies.push_back(req->promise.get_future());
+	pending_.push_back(req);
+      }
+
+      dispatch(failed);
+    }
+  }
+
+  if (pipelined){
+
+    for (unsigned int i = 0; i < abandoned.size(); i++)
+      complete(abandoned[i], 3, response);
+    for (unsigned int i = 0; i < failed.size(); i++)
+      complete(failed[i], 1, response);
+
+    for (unsigned int i = 0; i < replies.size(); i++){
+      N1470Reply reply = replies[i].get();
+      if (reply.status != 0 || reply.response.find(",CMD:OK") == std::string::npos){
+	fprintf(stderr,"Board %d did not acknowledge the emergency OFF\n",bds[i]);
+	missing++;
+      }
+    }
+  }
+  else {
+
+    // Stop-and-wait: take the link ahead of every waiter and keep it for
+    // the whole sweep
+    Turn turn;
+    turn.bd = -1;
+    turn.prio = PRIO_EMERGENCY;
+    turn.queued = start;
+    turn.granted = false;
+    turn.abandoned = false;
+
+    {
+      std::unique_lock<std::mutex> lock(sched_mutex_);
+      // Another emergency OFF already waiting keeps its place ahead of this one
+      std::deque<Turn *> kept;
+      for (unsigned int i = 0; i < turns_.size(); i++)
+	if (turns_[i]->prio == PRIO_EMERGENCY)
+	  kept.push_back(turns_[i]);
+	else
+	  turns_[i]->abandoned = true;
+      turns_.swap(kept);
+      turns_.push_back(&turn);
+      sched_wake_.notify_all();
+      grantTurn();
+      sched_wake_.wait(lock, [&turn]{ return turn.granted; });
+    }
+
+    std::chrono::steady_clock::time_point sent = std::chrono::steady_clock::now();
+
+    {
+      std::lock_guard<std::mutex> lock(io_mutex_);
+
+      // Pipelining started meanwhile: the sweep is sent that way below
+      if ((pipelined = pipelining_))
+	bds.clear();
+
+      for (unsigned int i = 0; i < bds.size(); i++){
+
+	N1470Command::set(cmd, bds[i], CH_ALL, PAR_OFF);
+	response.clear();
+
+	if (late_reply_)
+	  discardLate();
+
+	if (writeCommand(cmd) != 0 || getResponse(&response, RESPONSE_TIMEOUT_MS_N1470) != 0 ||
+	    response.find(",CMD:OK") == std::string::npos){
+	  fprintf(stderr,"Board %d did not acknowledge the emergency OFF\n",bds[i]);
+	  missing++;
+	}
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(sched_mutex_);
+      link_busy_ = false;
+      finishOnLink(PRIO_EMERGENCY, -1, sent);
+      grantTurn();
+    }
+
+    if (pipelined)
+      return emergencyOff(elapsedMs);
+  }
+
+  if (elapsedMs != NULL)
+    *elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+  return missing;
+}
+
+void N1470Bus::setLinkShare(N1470Priority prio, double fraction){
+
+  std::lock_guard<std::mutex> lock(sched_mutex_);
+  scheduler_.setShare(prio, fraction);
+}
+
+double N1470Bus::getLinkShare(N1470Priority prio){
+
+  std::lock_guard<std::mutex> lock(sched_mutex_);
+  return scheduler_.getShare(prio);
+}
+
+void N1470Bus::setBoardShare(double fraction){
+
+  std::lock_guard<std::mutex> lock(sched_mutex_);
+  scheduler_.setBoardShare(fraction);
+}
+
+N1470LinkStats N1470Bus::getLinkStats(){
+
+  std::lock_guard<std::mutex> pipe_lock(pipe_mutex_);
+  std::lock_guard<std::mutex> lock(sched_mutex_);
+  N1470LinkStats stats = scheduler_.getStats();
+
+  for (int prio = 0; prio < PRIO_COUNT; prio++)
+    stats.waiting[prio] = 0;
+  for (unsigned int i = 0; i < pending_.size(); i++)
+    stats.waiting[pending_[i]->prio]++;
+  for (unsigned int i = 0; i < turns_.size(); i++)
+    stats.waiting[turns_[i]->prio]++;
+
+  return stats;
+}
+
+std::future<N1470Reply> N1470Bus::submit(int bd, const char *cmd, int timeoutMs){
+
+  Request *req = new Request();
+  std::future<N1470Reply> future = req->promise.get_future();
+
+  req->bd = bd;
+  req->cmd = cmd;
+  req->prio = N1470LinkScheduler::classify(cmd);
+  enqueue(req, timeoutMs);
+
+  return future;
+}
+
+void N1470Bus::submit(int bd, const char *cmd, N1470Callback callback, int timeoutMs){
+
+  Request *req = new Request();
+
+  req->bd = bd;
+  req->cmd = cmd;
+  req->prio = N1470LinkScheduler::classify(cmd);
+  req->callback = callback;
+  enqueue(req, timeoutMs);
+}
+
+void N1470Bus::enqueue(Request *req, int timeoutMs){
+
+  std::vector<Request *> failed;
+  std::string response;
+  bool queued = false;
+  int ret;
+
+  req->timeout_ms = timeoutMs;
+  req->queued = std::chrono::steady_clock::now();
+
+  if (req->bd >= 0 && req->bd < BD_MAX)
+    known_[req->bd] = true;
+
+  if (req->bd < 0 || req->bd >= BD_MAX){
+    PRINT_ERR("submit",(unsigned long)req->bd);
+    complete(req, 1, response);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(pipe_mutex_);
+
+    if (pipelining_){
+      pending_.push_back(req);
+      dispatch(failed);
+      queued = true;
+    }
+  }
+
+  // Stop-and-wait: carry the command out right here
+  if (!queued){
+    ret = transaction(req->bd, req->cmd.c_str(), &response, timeoutMs);
+    complete(req, ret, response);
+    return;
+  }
+
+  for (unsigned int i = 0; i < failed.size(); i++)
+    complete(failed[i], 1, response);
+}
+
+void N1470Bus::dispatch(std::vector<Request *> &failed){
+
+  std::lock_guard<std::mutex> lock(sched_mutex_);
+  std::vector<std::deque<Request *>::iterator> candidates;
+  std::vector<N1470Priority> prios;
+  std::vector<int> bds;
+  bool seen[BD_MAX];
+
+  while (1){
+
+    candidates.clear();
+    prios.clear();
+    bds.clear();
+    for (int bd = 0; bd < BD_MAX; bd++)
+      seen[bd] = false;
+
+    // Only the oldest pending command of a board that is not busy may go,
+    // which keeps each board's commands in order
+    for (std::deque<Request *>::iterator it = pending_.begin(); it != pending_.end(); ++it){
+
+      int bd = (*it)->bd;
+
+      if (seen[bd] || in_flight_[bd] != NULL || ((*it)->prio != PRIO_EMERGENCY && late_until_[bd] > std::chrono::steady_clock::now()))
+	continue;
+
+      seen[bd] = true;
+      candidates.push_back(it);
+      prios.push_back((*it)->prio);
+      bds.push_back(bd);
+    }
+
+    if (candidates.empty())
+      break;
+
+    // Emergency commands go whatever the depth
+    int next = scheduler_.pick(prios.data(), bds.data(), prios.size());
+    if (n_in_flight_ >= max_in_flight_ && prios[next] != PRIO_EMERGENCY)
+      break;
+
+    Request *req = *candidates[next];
+    pending_.erase(candidates[next]);
+
+    req->sent = std::chrono::steady_clock::now();
+    scheduler_.started(req->prio, std::chrono::duration<double, std::milli>(req->sent - req->queued).count());
+
+    if (writeCommand(req->cmd.c_str()) != 0){
+      finishOnLink(req->prio, req->bd, req->sent);
+      failed.push_back(req);
+      continue;
+    }
+
+    // The board's time starts when its command is on the wire, however long
+    // the command waited in the queue
+    req->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(req->timeout_ms);
+    in_flight_[req->bd] = req;
+    n_in_flight_++;
+
+    if (req->deadline < rx_wake_){
+      rx_wake_ = req->deadline;
+      transport_->interrupt();
+    }
+  }
+}
+
+void N1470Bus::complete(Request *req, int status, const std::string &response){
+
+  N1470Reply reply;
+
+  reply.status = status;
+  reply.response = response;
+
+  if (req->callback)
+    req->callback(reply);
+  else
+    req->promise.set_value(reply);
+
+  delete req;
+}
+
+int N1470Bus::startPipeline(int maxInFlight){
+
+  if (!connected_){
+    fprintf(stderr,"Cannot pipeline a link that is not open\n");
+    return -1;
+  }
+
+  if (maxInFlight < 1 || maxInFlight > BD_MAX){
+    PRINT_ERR("startPipeline",(unsigned long)maxInFlight);
+    return -2;
+  }
+
+  // Let any stop-and-wait transaction finish before the receive thread takes over
+  std::lock_guard<std::mutex> io_lock(io_mutex_);
+  std::lock_guard<std::mutex> lock(pipe_mutex_);
+
+  max_in_flight_ = maxInFlight;
+
+  // Already running: the new depth applies from the next dispatch
+  if (pipelining_)
+    return 0;
+
+  pipelining_ = true;
+  rx_thread_ = std::thread(&N1470Bus::rxLoop, this);
+
+  return 0;
+}
+
+void N1470Bus::stopPipeline(){
+
+  std::deque<Request *> abandoned;
+  std::string response;
+
+  {
+    // Stop-and-wait transactions stay off the transport until the receive
+    // thread has gone
+    std::lock_guard<std::mutex> io_lock(io_mutex_);
+
+    {
+      std::lock_guard<std::mutex> lock(pipe_mutex_);
+      pipelining_ = false;
+      abandoned.swap(pending_);
+    }
+
+    // The receive thread drains what is in flight and then exits
+    if (transport_ != NULL)
+      transport_->interrupt();
+
+    if (rx_thread_.joinable())
+      rx_thread_.join();
+
+    // A reply still owed goes to the stop-and-wait path to throw away
+    for (int bd = 0; bd < BD_MAX; bd++)
+      if (late_until_[bd] > std::chrono::steady_clock::now())
+	late_reply_ = true;
+  }
+
+  // Outside the lock, as a callback may start a new transaction
+  for (unsigned int i = 0; i < abandoned.size(); i++)
+    complete(abandoned[i], 1, response);
+}
+
+void N1470Bus::rxLoop(){
+
+  char buf[BUFFER_SIZE];
+  std::string received, line;
+  std::vector<Request *> done, failed;
+  std::chrono::steady_clock::time_point now, wake;
+  size_t end;
+  long waitMs;
+  int bd, inFlight, bufRead;
+
+  while (1){
+
+    now = std::chrono::steady_clock::now();
+    wake = now + std::chrono::milliseconds(RESPONSE_TIMEOUT_MS_N1470);
+
+    // Fail whatever has run out of time and work out when to look again
+    {
+      std::lock_guard<std::mutex> lock(pipe_mutex_);
+
+      rx_wake_ = std::chrono::steady_clock::time_point();
+
+      if (!pipelining_ && n_in_flight_ == 0)
+	break;
+
+      for (bd = 0; bd < BD_MAX; bd++){
+	if (in_flight_[bd] == NULL)
+	  continue;
+	if (in_flight_[bd]->deadline <= now){
+	  {
+	    std::lock_guard<std::mutex> sched_lock(sched_mutex_);
+	    finishOnLink(in_flight_[bd]->prio, bd, in_flight_[bd]->sent);
+	  }
+	  failed.push_back(in_flight_[bd]);
+	  in_flight_[bd] = NULL;
+	  n_in_flight_--;
+	  late_until_[bd] = now + std::chrono::milliseconds(LATE_HOLD_MS_N1470);
+	}
+      }
+
+      dispatch(failed);
+      inFlight = n_in_flight_;
+
+      // Including what dispatch just sent, and boards held back for a late
+      // reply, which go again when the hold ends
+      for (bd = 0; bd < BD_MAX; bd++){
+	if (in_flight_[bd] != NULL && in_flight_[bd]->deadline < wake)
+	  wake = in_flight_[bd]->deadline;
+	if (late_until_[bd] > now && late_until_[bd] < wake)
+	  wake = late_until_[bd];
+      }
+
+      rx_wake_ = wake;
+    }
+
+    for (unsigned int i = 0; i < failed.size(); i++){
+      fprintf(stderr,"No reply from board %d within its deadline\n",failed[i]->bd);
+      complete(failed[i], 2, line);
+    }
+    failed.clear();
+
+    // Sleep until characters arrive or the nearest deadline. Once stopPipeline
+    // has run, only what is still in flight keeps the thread here.
+    if (!pipelining_ && inFlight == 0)
+      waitMs = 0;
+    else
+      waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count() + 1;
+
+    if ((bufRead = transport_->receive(buf, BUFFER_SIZE, waitMs)) <= 0)
+      continue;
+
+    received.append(buf, bufRead);
+
+    // Match every complete reply to its board by the #BD:nn it starts with
+    {
+      std::lock_guard<std::mutex> lock(pipe_mutex_);
+
+      // The loop goes round again, so what is sent here is seen there
+      rx_wake_ = std::chrono::steady_clock::time_point();
+
+      while ((end = received.find("\r\n")) != std::string::npos){
+
+	line = received.substr(0, end + 2);
+	received.erase(0, end + 2);
+
+	if (sscanf(line.c_str(), "#BD:%d", &bd) != 1 || bd < 0 || bd >= BD_MAX){
+	  fprintf(stderr,"Discarding unmatched reply: %s",line.c_str());
+	  continue;
+	}
+
+	// The reply to a request that already timed out, not to the next one
+	if (late_until_[bd] > std::chrono::steady_clock::now()){
+	  fprintf(stderr,"Discarding late reply: %s",line.c_str());
+	  late_until_[bd] = std::chrono::steady_clock::time_point();
+	  continue;
+	}
+
+	if (in_flight_[bd] == NULL){
+	  fprintf(stderr,"Discarding unmatched reply: %s",line.c_str());
+	  continue;
+	}
+
+	{
+	  std::lock_guard<std::mutex> sched_lock(sched_mutex_);
+	  finishOnLink(in_flight_[bd]->prio, bd, in_flight_[bd]->sent);
+	}
+	in_flight_[bd]->response = line;
+	done.push_back(in_flight_[bd]);
+	in_flight_[bd] = NULL;
+	n_in_flight_--;
+      }
+
+      dispatch(failed);
+    }
+
+    for (unsigned int i = 0; i < done.size(); i++)
+      complete(done[i], 0, done[i]->response);
+    done.clear();
+  }
+}
@@ -0,0 +1,291 @@
+#ifndef N1470BUS_H
+#define N1470BUS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "N1470Transport.h"
+#include "N1470LinkScheduler.h"
+
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <future>
+#include <functional>
+#include <thread>
+#include <chrono>
+
+#define BD_MAX 32 // number of board addresses on one daisy chain
+#define RESPONSE_TIMEOUT_MS_N1470 1000 // deadline in ms for the board to finish
+                                       // answering a normal request
+#define PIPELINE_DEPTH_N1470 4 // default number of commands in flight on a pipelined link
+#define BUFFER_SIZE 512
+#define BAUD_FILE_N1470 "/var/tmp/n1470.baud" // line speed found for each adapter serial number
+#define BAUD_PROBES_N1470 3 // clean round trips a speed needs to be chosen
+#define BAUD_PROBE_TIMEOUT_MS_N1470 200 // deadline of a round trip while probing
+#define CALIBRATE_TRIPS_N1470 5 // BDNAME round trips timed per profile when calibrating
+#define LATE_REPLY_MS_N1470 50 // quiet time that ends a late reply being thrown away
+#define LATE_HOLD_MS_N1470 500 // pipelined, how long a board whose reply timed out is held back for it
+
+class N1470;
+class N1470Sim;
+
+// Outcome of one command sent over the link
+struct N1470Reply{
+
+  int status; // 0 if the reply arrived, 1 on I/O error, 2 if the deadline passed,
+              // 3 if abandoned by emergencyOff before it was sent
+  std::string response; // The reply as received, including \r\n
+
+};
+
+// Completion callback for N1470Bus::submit. Runs on the link's receive thread.
+typedef std::function<void(const N1470Reply &)> N1470Callback;
+
+// One serial link to a daisy chain of up to BD_MAX N1470 modules.
+// Owns the single transport (FTDI adapter, tty, TCP server or simulator) and
+// carries the traffic of every board on it.
+//
+// By default the link is stop-and-wait: transaction() holds the link from
+// command to reply. After startPipeline() several commands to different
+// boards are on the wire at once; a receive thread matches each reply to its
+// request by the #BD:nn it carries, so replies may complete out of order.
+//
+// In both modes a N1470LinkScheduler picks which waiting command goes on
+// the link next, by traffic class and link-time budget, rather than
+// whoever asked first.
+
+class N1470Bus{
+
+ private:
+
+  // The byte pipe to the modules, NULL until opened
+  N1470Transport *transport_;
+
+  // Is the link open?
+  bool connected_;
+
+  // Held from command to reply in stop-and-wait mode
+  std::mutex io_mutex_;
+  // Set, under io_mutex_, when a reply missed its deadline, as it may
+  // still come in and be taken for the reply to the next command
+  bool late_reply_;
+
+  // Line speed the transport runs at
+  int baud_;
+  // Board that answers the probes of open()
+  int probe_bd_;
+  // Tuning the transport runs with, if it took one
+  N1470LinkProfile profile_;
+
+  // Switches to baud and checks that board bd answers BAUD_PROBES_N1470
+  // BDNAME requests cleanly. Called in stop-and-wait mode only.
+  bool cleanAt(int bd, int baud);
+
+  // Boards a command has been sent to, which emergencyOff switches off
+  std::atomic<bool> known_[BD_MAX];
+
+  // Board proxies handed out by board(), indexed by BD
+  N1470 *boards_[BD_MAX];
+
+  // A command queued or in flight in pipelined mode
+  struct Request{
+    int bd;
+    std::string cmd;
+    N1470Priority prio;
+    std::chrono::steady_clock::time_point queued;
+    std::chrono::steady_clock::time_point sent;
+    int timeout_ms;
+    std::chrono::steady_clock::time_point deadline; // set when the command is written
+    std::promise<N1470Reply> promise;
+    N1470Callback callback; // used instead of the promise if set
+    std::string response;
+  };
+
+  // Pipelined mode state, all guarded by pipe_mutex_
+  std::mutex pipe_mutex_;
+  std::atomic<bool> pipelining_;
+  int max_in_flight_;
+  int n_in_flight_;
+  std::deque<Request *> pending_; // not yet sent, in submission order
+  Request *in_flight_[BD_MAX]; // sent and awaiting a reply, per BD
+  // Tombstone of a request that timed out, per BD: until then the board is
+  // sent nothing new but emergency OFFs, and its next reply, the late one,
+  // is dropped
+  std::chrono::steady_clock::time_point late_until_[BD_MAX];
+  // When the receive thread next looks at the deadlines; a command sent from
+  // another thread with an earlier one interrupts its wait. Zero while the
+  // thread is working them out itself.
+  std::chrono::steady_clock::time_point rx_wake_;
+  std::thread rx_thread_;
+
+  // Link scheduling in both modes, guarded by sched_mutex_. In pipelined
+  // mode it is taken inside pipe_mutex_.
+  std::mutex sched_mutex_;
+  std::condition_variable sched_wake_;
+  N1470LinkScheduler scheduler_;
+  bool link_busy_; // a stop-and-wait transaction has the link
+
+  // A stop-and-wait transaction waiting for the link
+  struct Turn{
+    int bd;
+    N1470Priority prio;
+    std::chrono::steady_clock::time_point queued;
+    bool granted;
+    bool abandoned; // by emergencyOff, never sent
+  };
+  std::deque<Turn *> turns_;
+
+  // Gives the free link to the waiting transaction the scheduler picks.
+  // Called with sched_mutex_ held.
+  void grantTurn();
+  // Reports a command's time on the link. Called with sched_mutex_ held.
+  void finishOnLink(N1470Priority, int bd, std::chrono::steady_clock::time_point sent);
+
+  // Sends as many pending commands as the pipeline allows. A board only
+  // ever has one command in flight, so replies from it cannot be confused.
+  // Called with pipe_mutex_ held; requests that could not be written are
+  // appended to the list for the caller to complete after unlocking.
+  void dispatch(std::vector<Request *> &);
+
+  // Queues the request, or carries it out at once outside pipelined mode
+  void enqueue(Request *, int timeoutMs);
+
+  // Hands the reply to the requester and frees the request
+  void complete(Request *, int status, const std::string &);
+
+  // Body of the receive thread: reads replies and matches them by BD
+  void rxLoop();
+
+  // Writes a command to the link and checks to make sure that it is written.
+  // Takes a command string and returns 0 if no problems.
+  int writeCommand(const char *);
+
+  // Get response from the board following a command
+  // Takes std::string pointer to store response string and a deadline in ms.
+  // Returns as soon as the \r\n terminated reply is in, sleeping on the driver's
+  // transport rather than polling. Return 0 if response arrives, non-zero if the
+  // read failed or the deadline passed.
+  int getResponse(std::string *, int timeoutMs = RESPONSE_TIMEOUT_MS_N1470);
+
+  // Reads and throws away whatever arrives until the link has been quiet
+  // for LATE_REPLY_MS_N1470. Called with io_mutex_ held before a command.
+  void discardLate();
+
+ public:
+
+  N1470Bus();
+  ~N1470Bus();
+
+  // Opens the link over the given transport, which the bus then owns.
+  // The transport is then tuned with the default profile, and an adapter
+  // with a serial number is switched to the fastest line speed the probe
+  // board answers at (see negotiateBaudRate); the link stays at BAUD_N1470
+  // if it answers at none. A D2XX adapter that answered is also calibrated.
+  // Returns 0 on success, negative on failure.
+  int open(N1470Transport *);
+  // Same, with the transport named by a spec such as "tty:/dev/ttyUSB0";
+  // see N1470Transport::create
+  int open(const char *spec);
+  // Opens the FTDI device with the given index over D2XX
+  int open(int deviceIndex = 0);
+  // Same, picking the adapter by its serial number or description, so that
+  // several adapters on one host can be told apart
+  int openBySerialNumber(const char *);
+  int openByDescription(const char *);
+  // Returns 0 at once if the link is not open
+  int close();
+  // Board that open() probes the link with, 0 unless set before opening
+  void setProbeBoard(int bd){ probe_bd_ = bd; }
+
+  // Returns true if the link is open
+  bool isConnected(){ return connected_; }
+
+  // Returns the proxy for board BD on this link, creating it on first use.
+  // The bus owns the proxy. Returns NULL if BD is outside [0,BD_MAX).
+  N1470 * board(int bd);
+
+  // Sends a command for board BD and waits for its reply, in either mode.
+  // Takes the command, a std::string pointer to store the response and a deadline in ms.
+  // Return 0 if the response arrived, 1 on I/O error, 2 if the deadline passed,
+  // 3 if emergencyOff abandoned the command.
+  int transaction(int bd, const char *, std::string *, int timeoutMs = RESPONSE_TIMEOUT_MS_N1470);
+
+  // Queues a command for board BD without waiting for the reply.
+  // The future (or the callback) is completed when the reply arrives or
+  // timeoutMs after the command was written, however long it was queued.
+  // Outside pipelined mode the command is carried out before returning.
+  std::future<N1470Reply> submit(int bd, const char *, int timeoutMs = RESPONSE_TIMEOUT_MS_N1470);
+  void submit(int bd, const char *, N1470Callback, int timeoutMs = RESPONSE_TIMEOUT_MS_N1470);
+
+  // Switches to pipelined mode with at most maxInFlight commands on the wire
+  // at once (one per board). If already pipelined only the depth changes.
+  // Returns 0 on success.
+  int startPipeline(int maxInFlight = PIPELINE_DEPTH_N1470);
+  // Waits for commands in flight, fails queued ones and returns to stop-and-wait
+  void stopPipeline();
+  bool isPipelined(){ return pipelining_; }
+
+  // Line speed of the link, BAUD_N1470 until changed or negotiated
+  int getBaudRate(){ return baud_; }
+  // Changes the line speed of the host side only; the modules keep theirs,
+  // set on the front panel. Returns 0 on success, negative if the transport
+  // cannot change it.
+  int setBaudRate(int baud);
+  // Finds the fastest of BAUD_RATES_N1470 at which board bd answers cleanly,
+  // trying first the speed remembered in file for the adapter's serial
+  // number, and remembers the one found there. A NULL file, or an adapter
+  // without a serial number, neither reads nor writes it. Stop-and-wait
+  // mode only. Returns the speed chosen, or negative with the link back at
+  // BAUD_N1470 if none works.
+  int negotiateBaudRate(int bd = 0, const char *file = BAUD_FILE_N1470);
+
+  // Applies a tuning profile to the transport. Returns 0 on success, 1 if
+  // the transport has nothing to tune, negative if tuning failed.
+  int tuneLink(const N1470LinkProfile &);
+  N1470LinkProfile getLinkProfile(){ return profile_; }
+  // Times CALIBRATE_TRIPS_N1470 BDNAME round trips to board bd under a range
+  // of latency timers, with and without the event character, and keeps the
+  // fastest profile. Stop-and-wait mode only. Returns the mean round trip
+  // in us under the chosen profile, negative on failure.
+  double calibrateLink(int bd = 0);
+
+  // Switches off every channel of every board this bus has handed out or
+  // sent a command to, with one CH:4 OFF per board, ahead of anything else.
+  // Commands still waiting for the link are abandoned with status 3; a
+  // command already on the wire is let finish. Pipelined, the OFFs go to
+  // all boards at once whatever the depth; otherwise one after the other.
+  // Callers at the same time each send their own sweep, in turn.
+  // Returns the number of boards that did not acknowledge, and in elapsedMs
+  // the time from the call to the last acknowledgement.
+  int emergencyOff(double *elapsedMs = NULL);
+
+  // Shares of link time the traffic classes get while they compete, as
+  // fractions of the link (defaults LINK_SHARE_*_N1470)
+  void setLinkShare(N1470Priority, double fraction);
+  double getLinkShare(N1470Priority);
+  // Caps each board to this fraction of link time while others wait,
+  // 0 for no cap (the default)
+  void setBoardShare(double fraction);
+  // How close the link is to saturation, and what each class gets
+  N1470LinkStats getLinkStats();
+
+  // The transport of an open link, NULL if not open
+  N1470Transport * getTransport(){ return connected_ ? transport_ : NULL; }
+  // returns the D2XX device handle if open over D2XX. Otherwise return NULL.
+  FT_HANDLE getDeviceHandle();
+  // The simulated chain behind a link opened over "sim", NULL otherwise
+  N1470Sim * getSimulator();
+
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include "N1470Command.h"
+
+#include <string.h>
+
+// Command templates from the N1470 manual available at caen.it.
+// Lengths are worked out at compile time so formatting is a few memcpys.
+#define LIT(s) s, sizeof(s) - 1
+
+struct N1470Template{
+
+  const char *name;
+  size_t length;
+  int decimals; // precision of VAL for numeric set commands
+
+};
+
+static const N1470Template templates_[PAR_COUNT] = {
+  { LIT("VSET"),   1 },
+  { LIT("ISET"),   2 },
+  { LIT("MAXV"),   0 },
+  { LIT("RUP"),    0 },
+  { LIT("RDW"),    0 },
+  { LIT("TRIP"),   1 },
+  { LIT("PDWN"),   0 },
+  { LIT("ON"),     0 },
+  { LIT("OFF"),    0 },
+  { LIT("VMON"),   0 },
+  { LIT("IMON"),   0 },
+  { LIT("STAT"),   0 },
+  { LIT("POL"),    0 },
+  { LIT("BDNAME"), 0 },
+  { LIT("BDILKM"), 0 },
+  { LIT("BDCLR"),  0 }
+};
+
+
+char * N1470Command::append(char *out, const char *text, size_t length){
+
+  memcpy(out, text, length);
+  return out + length;
+
+}
+
+char * N1470Command::appendInt(char *out, long value){
+
+  char digits[24];
+  int n = 0;
+
+  if (value < 0){
+    *out++ = '-';
+    value = -value;
+  }
+
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+
+  while (n > 0)
+    *out++ = digits[--n];
+
+  return out;
+}
+
+char * N1470Command::appendFixed(char *out, double value, int decimals){
+
+  static const long scale[] = { 1, 10, 100, 1000 };
+  long fixed, fraction;
+
+  if (value < 0){
+    *out++ = '-';
+    value = -value;
+  }
+
+  fixed = (long)(value * scale[decimals] + 0.5);
+  out = appendInt(out, fixed / scale[decimals]);
+
+  if (decimals > 0){
+
+    *out++ = '.';
+    fraction = fixed % scale[decimals];
+
+    // Leading zeros of the fraction
+    for (int digit = decimals - 1; digit > 0 && fraction < scale[digit]; digit--)
+      *out++ = '0';
+
+    out = appendInt(out, fraction);
+  }
+
+  return out;
+}
+
+char * N1470Command::head(char *out, int bd, bool set, int ch, N1470Param par){
+
+  out = append(out, LIT("$BD:"));
+  out = appendInt(out, bd);
+
+  if (set)
+    out = append(out, LIT(",CMD:SET"));
+  else
+    out = append(out, LIT(",CMD:MON"));
+
+  if (ch >= 0){
+    out = append(out, LIT(",CH:"));
+    out = appendInt(out, ch);
+  }
+
+  out = append(out, LIT(",PAR:"));
+  return append(out, templates_[par].name, templates_[par].length);
+}
+
+// Every command ends with a Windows-style line ending so the N1470 knows it is complete
+static int finish(char *buf, char *out){
+
+  *out++ = '\r';
+  *out++ = '\n';
+  *out = '\0';
+
+  return out - buf;
+}
+
+
+int N1470Command::monitor(char *buf, int bd, int ch, N1470Param par){
+
+  return finish(buf, head(buf, bd, false, ch, par));
+
+}
+
+int N1470Command::set(char *buf, int bd, int ch, N1470Param par){
+
+  return finish(buf, head(buf, bd, true, ch, par));
+
+}
+
+int N1470Command::set(char *buf, int bd, int ch, N1470Param par, double value){
+
+  char *out = head(buf, bd, true, ch, par);
+
+  out = append(out, LIT(",VAL:"));
+  out = appendFixed(out, value, templates_[par].decimals);
+
+  return finish(buf, out);
+}
+
+int N1470Command::set(char *buf, int bd, int ch, N1470Param par, const char *value){
+
+  char *out = head(buf, bd, true, ch, par);
+
+  out = append(out, LIT(",VAL:"));
+  out = append(out, value, strlen(value));
+
+  return finish(buf, out);
+}
+
+int N1470Command::boardMonitor(char *buf, int bd, N1470Param par){
+
+  return finish(buf, head(buf, bd, false, -1, par));
+
+}
+
+int N1470Command::boardSet(char *buf, int bd, N1470Param par, const char *value){
+
+  char *out = head(buf, bd, true, -1, par);
+
+  if (value != NULL){
+    out = append(out, LIT(",VAL:"));
+    out = append(out, value, strlen(value));
+  }
+
+  return finish(buf, out);
+}
+
+const char * N1470Command::name(N1470Param par){
+
+  return templates_[par].name;
+
+}
+
+double N1470Command::resolution(N1470Param par){
+
+  static const double step[] = { 1, 0.1, 0.01, 0.001 };
+
+  return step[templates_[par].decimals];
+
+}
@@ -0,0 +1,62 @@
+#ifndef N1470COMMAND_H
+#define N1470COMMAND_H
+
+#include <stddef.h>
+
+#define CMD_SIZE_N1470 64 // buffer size that holds any command, with \r\n and NUL
+
+// Parameters the driver sends to the module.
+// The order matches the template table in N1470Command.cpp.
+enum N1470Param{
+
+  PAR_VSET, PAR_ISET, PAR_MAXV, PAR_RUP, PAR_RDW, PAR_TRIP, PAR_PDWN,
+  PAR_ON, PAR_OFF,
+  PAR_VMON, PAR_IMON, PAR_STAT, PAR_POL,
+  PAR_BDNAME, PAR_BDILKM, PAR_BDCLR,
+  PAR_COUNT
+
+};
+
+// Formats N1470 commands straight into a caller's buffer of CMD_SIZE_N1470 bytes,
+// e.g. a char array on the stack. There is no allocation and no iostream: the
+// fixed parts of every command come from one table of immutable templates
+// shared by all boards, and numbers are written with integer arithmetic.
+// Every function returns the length of the command, which ends in \r\n.
+
+class N1470Command{
+
+ private:
+
+  // Appends a literal of known length, or a number, and returns the new end
+  static char * append(char *, const char *, size_t);
+  static char * appendInt(char *, long);
+  // Writes value with the given number of decimals, rounded
+  static char * appendFixed(char *, double, int decimals);
+
+  // Writes "$BD:bd,CMD:MON" or "$BD:bd,CMD:SET", then ",CH:ch" if ch >= 0, then ",PAR:name"
+  static char * head(char *, int bd, bool set, int ch, N1470Param);
+
+ public:
+
+  // $BD:bd,CMD:MON,CH:ch,PAR:par
+  static int monitor(char *buf, int bd, int ch, N1470Param);
+  // $BD:bd,CMD:SET,CH:ch,PAR:par  (ON, OFF)
+  static int set(char *buf, int bd, int ch, N1470Param);
+  // $BD:bd,CMD:SET,CH:ch,PAR:par,VAL:value  with the parameter's fixed-point precision
+  static int set(char *buf, int bd, int ch, N1470Param, double);
+  // $BD:bd,CMD:SET,CH:ch,PAR:par,VAL:text  (PDWN RAMP/KILL)
+  static int set(char *buf, int bd, int ch, N1470Param, const char *);
+
+  // Board level commands without a channel: BDNAME, BDILKM, BDCLR
+  static int boardMonitor(char *buf, int bd, N1470Param);
+  static int boardSet(char *buf, int bd, N1470Param, const char *value = NULL);
+
+  // Smallest step of VAL the module tells apart for a numeric parameter
+  static double resolution(N1470Param);
+
+  // Name of a parameter as the module spells it
+  static const char * name(N1470Param);
+
+};
+
+#endif
@@ -0,0 +1,415 @@
+#include "N1470Config.h"
+
+#include <string.h>
+#include <math.h>
+
+#define CONFIG_LINE_MAX 256
+
+// Channel settings a configuration may give, in the order they are read
+static const N1470Param settings_[] = {PAR_VSET, PAR_ISET, PAR_MAXV, PAR_RUP, PAR_RDW, PAR_TRIP, PAR_PDWN};
+static const int nSettings_ = sizeof(settings_) / sizeof(settings_[0]);
+
+// Order in which a board's changes are written: the interlock, switching off,
+// raising MAXV, the other settings, lowering MAXV (once VSET is below it),
+// then switching on with everything in place
+static int stage(const N1470ConfigChange &change){
+
+  switch (change.par){
+  case PAR_BDILKM: return 0;
+  case PAR_ON: return change.to ? 5 : 1;
+  case PAR_MAXV: return (change.to > change.from) ? 2 : 4;
+  default: return 3;
+  }
+}
+
+static bool same(N1470Param par, double a, double b){
+
+  return fabs(a - b) < N1470Command::resolution(par) / 2;
+}
+
+// Does any channel of the board give the parameter?
+static bool mentions(const N1470BoardConfig &board, N1470Param par){
+
+  for (int ch = 0; ch < CH_MAX; ch++)
+    if (board.channels[ch].has[par])
+      return true;
+
+  return false;
+}
+
+
+N1470Config::N1470Config(){
+
+  clear();
+
+};
+
+void N1470Config::clear(){
+
+  for (int bd = 0; bd < BD_MAX; bd++){
+
+    boards_[bd].present = false;
+    boards_[bd].interlock = -1;
+
+    for (int ch = 0; ch < CH_MAX; ch++)
+      for (int par = 0; par < PAR_COUNT; par++){
+	boards_[bd].channels[ch].has[par] = false;
+	boards_[bd].channels[ch].value[par] = 0;
+      }
+  }
+}
+
+int N1470Config::load(const char *path){
+
+  char line[CONFIG_LINE_MAX];
+  int number = 0;
+  FILE *in;
+
+  if ((in = fopen(path, "r")) == NULL){
+    perror(path);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), in) != NULL){
+
+    number++;
+
+    if (parseLine(line) != 0){
+      fprintf(stderr,"%s:%d: not understood: %s",path,number,line);
+      fclose(in);
+      return -2;
+    }
+  }
+
+  fclose(in);
+  return 0;
+}
+
+int N1470Config::parseLine(const char *text){
+
+  std::vector<std::pair<N1470Param, double> > given;
+  char line[CONFIG_LINE_MAX];
+  char *token, *save, *end;
+  int bd = -1, ch = -1, interlock = -1;
+
+  snprintf(line, sizeof(line), "%s", text);
+  if ((end = strchr(line, '#')) != NULL)
+    *end = '\0';
+
+  for (token = strtok_r(line, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save)){
+
+    char *value = strchr(token, ':');
+    if (value != NULL)
+      *value++ = '\0';
+
+    if (strcmp(token, "BD") == 0 && value != NULL && bd < 0){
+      bd = strtol(value, &end, 10);
+      if (*end != '\0' || end == value || bd < 0 || bd >= BD_MAX)
+	return -1;
+      continue;
+    }
+
+    // Everything else belongs to a board
+    if (bd < 0)
+      return -1;
+
+    if (strcmp(token, "CH") == 0 && value != NULL && ch < 0 && given.empty()){
+      ch = strtol(value, &end, 10);
+      if (*end != '\0' || end == value || ch < 0 || ch > CH_ALL)
+	return -1;
+    }
+    else if (strcmp(token, "BDILKM") == 0 && value != NULL && ch < 0){
+      if (strcmp(value, "OPEN") == 0) interlock = 0;
+      else if (strcmp(value, "CLOSED") == 0) interlock = 1;
+      else return -1;
+    }
+    else if ((strcmp(token, "ON") == 0 || strcmp(token, "OFF") == 0) && value == NULL && ch >= 0)
+      given.push_back(std::make_pair(PAR_ON, token[1] == 'N' ? 1.0 : 0.0));
+    else if (strcmp(token, "PDWN") == 0 && value != NULL && ch >= 0){
+      if (strcmp(value, "KILL") == 0) given.push_back(std::make_pair(PAR_PDWN, 1.0));
+      else if (strcmp(value, "RAMP") == 0) given.push_back(std::make_pair(PAR_PDWN, 0.0));
+      else return -1;
+    }
+    else {
+
+      int setting;
+
+      for (setting = 0; setting < nSettings_; setting++)
+	if (strcmp(token, N1470Command::name(settings_[setting])) == 0)
+	  break;
+
+      if (setting == nSettings_ || value == NULL || ch < 0)
+	return -1;
+
+      double number = strtod(value, &end);
+      if (*end != '\0' || end == value)
+	return -1;
+
+      given.push_back(std::make_pair(settings_[setting], number));
+    }
+  }
+
+  // A blank line or a comment
+  if (bd < 0)
+    return 0;
+
+  N1470BoardConfig &board = boards_[bd];
+  board.present = true;
+  if (interlock >= 0)
+    board.interlock = interlock;
+
+  int first = (ch == CH_ALL) ? 0 : ch;
+  int last = (ch == CH_ALL) ? CH_MAX - 1 : ch;
+
+  for (unsigned int i = 0; i < given.size(); i++)
+    for (int c = first; c <= last; c++){
+      board.channels[c].has[given[i].first] = true;
+      board.channels[c].value[given[i].first] = given[i].second;
+    }
+
+  return 0;
+}
+
+int N1470Config::apply(N1470Bus *bus, std::vector<N1470ConfigChange> *changes, bool dryRun){
+
+  int problems = 0;
+
+  for (int bd = 0; bd < BD_MAX; bd++){
+
+    const N1470BoardConfig &want = boards_[bd];
+    N1470 *board;
+
+    if (!want.present)
+      continue;
+
+    // Saves waiting out a timeout per parameter on a board that is not there
+    if ((board = bus->board(bd)) == NULL || board->readBoardName() != 0){
+      fprintf(stderr,"Board %d does not answer, not configured\n",bd);
+      problems++;
+      continue;
+    }
+
+    size_t first = changes->size();
+    N1470ConfigChange change;
+    change.bd = bd;
+    change.applied = false;
+    change.verified = false;
+
+    if (want.interlock >= 0){
+
+      int interlock = board->getInterlock();
+
+      if (interlock < 0){
+	fprintf(stderr,"Could not read the interlock mode of board %d, left as it is\n",bd);
+	problems++;
+      }
+      else if (interlock != want.interlock){
+	change.ch = -1;
+	change.par = PAR_BDILKM;
+	change.from = interlock;
+	change.to = want.interlock;
+	changes->push_back(change);
+      }
+    }
+
+    // One CH:4 read for each setting given for any channel
+    for (int setting = 0; setting < nSettings_; setting++){
+
+      N1470Param par = settings_[setting];
+      double values[CH_MAX];
+
+      if (!mentions(want, par))
+	continue;
+
+      if (board->refreshSetting(par, values) != 0){
+	fprintf(stderr,"Could not read %s of board %d, left as it is\n",N1470Command::name(par),bd);
+	problems++;
+	continue;
+      }
+
+      for (int ch = 0; ch < CH_MAX; ch++)
+	if (want.channels[ch].has[par] && !same(par, values[ch], want.channels[ch].value[par])){
+	  change.ch = ch;
+	  change.par = par;
+	  change.from = values[ch];
+	  change.to = want.channels[ch].value[par];
+	  changes->push_back(change);
+	}
+    }
+
+    if (mentions(want, PAR_ON)){
+
+      int status[CH_MAX];
+
+      if (board->getAllStatus(status) != 0){
+	fprintf(stderr,"Could not read the status of board %d, not switched\n",bd);
+	problems++;
+      }
+      else {
+	for (int ch = 0; ch < CH_MAX; ch++)
+	  if (want.channels[ch].has[PAR_ON] && (status[ch] & 1) != want.channels[ch].value[PAR_ON]){
+	    change.ch = ch;
+	    change.par = PAR_ON;
+	    change.from = status[ch] & 1;
+	    change.to = want.channels[ch].value[PAR_ON];
+	    changes->push_back(change);
+	  }
+      }
+    }
+
+    if (dryRun || changes->size() == first)
+      continue;
+
+    write(board, changes, first);
+    verify(board, changes, first);
+
+    for (size_t i = first; i < changes->size(); i++)
+      if (!(*changes)[i].verified)
+	problems++;
+  }
+
+  return problems;
+}
+
+// Finds the changes of the same pass that set every channel of the board to
+// the value change i sets its channel to, so that one CH:4 command does them
+// all. Returns false, with only i in members, if some channel differs.
+static bool everyChannel(const std::vector<N1470ConfigChange> &changes, size_t first, size_t i, std::vector<size_t> *members){
+
+  const N1470ConfigChange &change = changes[i];
+
+  members->clear();
+
+  if (change.ch >= 0)
+    for (int ch = 0; ch < CH_MAX; ch++)
+      for (size_t j = first; j < changes.size(); j++)
+	if (changes[j].ch == ch && changes[j].par == change.par && changes[j].to == change.to && stage(changes[j]) == stage(change)){
+	  members->push_back(j);
+	  break;
+	}
+
+  if (members->size() == CH_MAX)
+    return true;
+
+  members->assign(1, i);
+  return false;
+}
+
+void N1470Config::write(N1470 *board, std::vector<N1470ConfigChange> *changes, size_t first){
+
+  std::vector<bool> done(changes->size(), false);
+  std::vector<size_t> members;
+
+  for (int pass = 0; pass <= 5; pass++)
+    for (size_t i = first; i < changes->size(); i++){
+
+      N1470ConfigChange &change = (*changes)[i];
+      bool applied = false;
+
+      if (stage(change) != pass || done[i])
+	continue;
+
+      int ch = everyChannel(*changes, first, i, &members) ? CH_ALL : change.ch;
+
+      switch (change.par){
+      case PAR_BDILKM: applied = (board->setInterlock(change.to) == 0); break;
+      case PAR_ON: applied = (board->switchState(ch, change.to != 0) == 0); break;
+      case PAR_PDWN: applied = (board->setTripmode(ch, change.to) == 0); break;
+      case PAR_VSET: applied = (board->setVoltage(ch, change.to) >= 0); break;
+      case PAR_ISET: applied = (board->setCurrent(ch, change.to) >= 0); break;
+      case PAR_MAXV: applied = (board->setMaxVoltage(ch, change.to) >= 0); break;
+      case PAR_RUP: applied = (board->setRampUpRate(ch, change.to) >= 0); break;
+      case PAR_RDW: applied = (board->setRampDownRate(ch, change.to) >= 0); break;
+      case PAR_TRIP: applied = (board->setTripTime(ch, change.to) >= 0); break;
+      default: break;
+      }
+
+      for (unsigned int m = 0; m < members.size(); m++){
+	(*changes)[members[m]].applied = applied;
+	done[members[m]] = true;
+      }
+
+      // The later stages count on the earlier ones, so the board is left
+      // as it is with the rest not applied
+      if (!applied){
+	fprintf(stderr,"Board %d did not take %s, stopped configuring it\n",board->getBoardNumber(),
+		N1470Command::name(change.par == PAR_ON && !change.to ? PAR_OFF : change.par));
+	return;
+      }
+    }
+}
+
+void N1470Config::verify(N1470 *board, std::vector<N1470ConfigChange> *changes, size_t first){
+
+  bool changed[PAR_COUNT];
+  double values[PAR_COUNT][CH_MAX];
+  bool read[PAR_COUNT];
+  int status[CH_MAX];
+  int interlock = -1;
+
+  for (int par = 0; par < PAR_COUNT; par++)
+    changed[par] = read[par] = false;
+  for (size_t i = first; i < changes->size(); i++)
+    if ((*changes)[i].applied)
+      changed[(*changes)[i].par] = true;
+
+  // Again one CH:4 read per parameter that changed
+  for (int setting = 0; setting < nSettings_; setting++)
+    if (changed[settings_[setting]])
+      read[settings_[setting]] = (board->refreshSetting(settings_[setting], values[settings_[setting]]) == 0);
+
+  if (changed[PAR_ON])
+    read[PAR_ON] = (board->getAllStatus(status) == 0);
+  if (changed[PAR_BDILKM])
+    interlock = board->getInterlock();
+
+  for (size_t i = first; i < changes->size(); i++){
+
+    N1470ConfigChange &change = (*changes)[i];
+
+    if (!change.applied)
+      continue;
+
+    if (change.par == PAR_BDILKM)
+      change.verified = (interlock == change.to);
+    else if (change.par == PAR_ON)
+      // A channel switched off may still be ramping down (bit 2)
+      change.verified = read[PAR_ON] && (change.to ? (status[change.ch] & 1) : (!(status[change.ch] & 1) || (status[change.ch] & 4)));
+    else
+      change.verified = read[change.par] && same(change.par, values[change.par][change.ch], change.to);
+  }
+}
+
+// Value of a change as the configuration file spells it
+static void describe(char *text, size_t size, N1470Param par, double value){
+
+  if (par == PAR_ON)
+    snprintf(text, size, "%s", value ? "ON" : "OFF");
+  else if (par == PAR_PDWN)
+    snprintf(text, size, "%s", value ? "KILL" : "RAMP");
+  else if (par == PAR_BDILKM)
+    snprintf(text, size, "%s", value == 1 ? "CLOSED" : value == 0 ? "OPEN" : "?");
+  else
+    snprintf(text, size, "%g", value);
+}
+
+void N1470Config::print(const std::vector<N1470ConfigChange> &changes, FILE *out){
+
+  char from[16], to[16];
+
+  for (unsigned int i = 0; i < changes.size(); i++){
+
+    const N1470ConfigChange &change = changes[i];
+
+    describe(from, sizeof(from), change.par, change.from);
+    describe(to, sizeof(to), change.par, change.to);
+
+    if (change.ch >= 0)
+      fprintf(out,"BD:%d CH:%d ",change.bd,change.ch);
+    else
+      fprintf(out,"BD:%d ",change.bd);
+
+    fprintf(out,"%s %s -> %s %s\n",change.par == PAR_ON ? "STATE" : N1470Command::name(change.par),from,to,
+	    change.verified ? "done" : change.applied ? "NOT VERIFIED" : "not applied");
+  }
+}
@@ -0,0 +1,94 @@
+#ifndef N1470CONFIG_H
+#define N1470CONFIG_H
+
+#include "N1470.h"
+#include "N1470Bus.h"
+
+#include <stdio.h>
+
+#include <vector>
+
+// Desired settings of one channel. has[par] marks what the configuration
+// gives; PDWN is 1 = KILL, 0 = RAMP and PAR_ON is 1 = on, 0 = off.
+struct N1470ChannelConfig{
+
+  bool has[PAR_COUNT];
+  double value[PAR_COUNT];
+
+};
+
+struct N1470BoardConfig{
+
+  bool present; // mentioned in the configuration
+  int interlock; // BDILKM: -1 if not given, 0 = OPEN, 1 = CLOSED
+  N1470ChannelConfig channels[CH_MAX];
+
+};
+
+// One difference between the configuration and a board, and its outcome
+struct N1470ConfigChange{
+
+  int bd;
+  int ch; // -1 for BDILKM
+  N1470Param par; // PAR_ON for the switch, PAR_BDILKM for the interlock
+  double from; // as the board reported it
+  double to;
+  bool applied; // the board accepted the command
+  bool verified; // and reported the new value when read back
+
+};
+
+// A full HV configuration, read from a text file with one line per board
+// or channel, in the module's own parameter names:
+//
+//   # comment
+//   BD:0 BDILKM:CLOSED
+//   BD:0 CH:4 MAXV:1000 ISET:170 RUP:100 RDW:50 TRIP:5 PDWN:KILL
+//   BD:0 CH:2 VSET:900 ON
+//
+// CH:4 applies to every channel; later lines override earlier ones.
+//
+// apply() reads what each board reports with one CH:4 request per
+// parameter the configuration mentions, sends only the commands that
+// differ, through the blocking setters, with one CH:4 command where all
+// four channels of a board change to the same value, and reads the changed parameters
+// back the same way to verify them.
+
+class N1470Config{
+
+ private:
+
+  N1470BoardConfig boards_[BD_MAX];
+
+  // Applies the listed changes of one board in a safe order, stopping at
+  // the first one the board does not take
+  void write(N1470 *, std::vector<N1470ConfigChange> *, size_t first);
+  // Reads back the changed parameters of one board
+  void verify(N1470 *, std::vector<N1470ConfigChange> *, size_t first);
+
+ public:
+
+  N1470Config();
+
+  // Forgets everything
+  void clear();
+  // Adds the lines of a file. Returns 0 on success, negative with the
+  // offending line reported on stderr otherwise.
+  int load(const char *path);
+  // Adds one line. Returns 0 on success, negative if it is not understood.
+  int parseLine(const char *line);
+
+  const N1470BoardConfig & getBoard(int bd){ return boards_[bd]; }
+
+  // Brings the boards of an open bus to the configuration, or with dryRun
+  // only works out what would change. Every difference found is appended
+  // to changes. Returns the number of boards that did not answer plus the
+  // changes that were refused or did not verify, 0 if all went well.
+  int apply(N1470Bus *, std::vector<N1470ConfigChange> *changes, bool dryRun = false);
+
+  // Prints one line per change
+  static void print(const std::vector<N1470ConfigChange> &, FILE *out = stdout);
+
+};
+
+#endif
@@ -0,0 +1,167 @@
+#include "N1470Coro.h"
+
+std::coroutine_handle<> N1470Task::FinalAwaiter::await_suspend(Handle handle) noexcept {
+
+  promise_type &promise = handle.promise();
+
+  // A step of another procedure: carry on with that one. The awaiting
+  // N1470Task object frees this frame when it goes out of scope.
+  if (promise.continuation)
+    return promise.continuation;
+
+  // A spawned procedure is done for good
+  if (promise.scheduler != NULL)
+    promise.scheduler->finished(handle);
+
+  return std::noop_coroutine();
+}
+
+
+N1470Scheduler::N1470Scheduler() :
+  timer_order_(0),
+  live_(0){
+
+};
+
+void N1470Scheduler::spawn(N1470Task &&task){
+
+  N1470Task::Handle handle = task.handle_;
+
+  // From here on the scheduler owns the frame
+  task.handle_ = NULL;
+  handle.promise().scheduler = this;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  live_++;
+  ready_.push_back(handle);
+}
+
+void N1470Scheduler::finished(std::coroutine_handle<> handle){
+
+  // The coroutine is suspended at its final point, so it may go now
+  handle.destroy();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  live_--;
+}
+
+void N1470Scheduler::post(std::coroutine_handle<> handle){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  ready_.push_back(handle);
+  wake_.notify_one();
+}
+
+void N1470Scheduler::at(std::chrono::steady_clock::time_point when, std::function<void()> fire){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  Timer timer;
+
+  timer.when = when;
+  timer.order = timer_order_++;
+  timer.fire = fire;
+  timers_.push(timer);
+  wake_.notify_one();
+}
+
+unsigned long N1470Scheduler::run(){
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::vector<std::function<void()> > due;
+  std::coroutine_handle<> handle;
+  unsigned long resumed = 0;
+
+  while (live_ > 0){
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    while (!timers_.empty() && timers_.top().when <= now){
+      due.push_back(timers_.top().fire);
+      timers_.pop();
+    }
+
+    if (!due.empty()){
+      lock.unlock();
+      for (unsigned int i = 0; i < due.size(); i++)
+	due[i]();
+      due.clear();
+      lock.lock();
+      continue;
+    }
+
+    if (ready_.empty()){
+      if (timers_.empty())
+	wake_.wait(lock);
+      else
+	wake_.wait_until(lock, timers_.top().when);
+      continue;
+    }
+
+    handle = ready_.front();
+    ready_.pop_front();
+
+    lock.unlock();
+    handle.resume();
+    resumed++;
+    lock.lock();
+  }
+
+  return resumed;
+}
+
+
+void N1470Scheduler::Operation::await_suspend(std::coroutine_handle<> handle){
+
+  N1470Scheduler *scheduler = scheduler_;
+  N1470Result *result = &result_;
+
+  // The callback may run on the bus's receive thread, or right here if the
+  // call is refused, so it only stores the result and queues the resumption
+  start_([scheduler, result, handle](const N1470Result &r){
+      *result = r;
+      scheduler->post(handle);
+    });
+}
+
+void N1470Scheduler::Sleep::await_suspend(std::coroutine_handle<> handle){
+
+  N1470Scheduler *scheduler = scheduler_;
+
+  scheduler_->at(until_, [scheduler, handle](){ scheduler->post(handle); });
+}
+
+void N1470Scheduler::Ramp::check(){
+
+  board_->monitorAsync(channel_, PAR_STAT, [this](const N1470Result &r){
+
+      bool ramping = false;
+
+      result_ = r;
+
+      // Status bits 1 and 2: ramping up or down
+      for (int i = 0; i < r.nValues; i++)
+	if ((int)r.values[i] & 0x6)
+	  ramping = true;
+
+      if (r.error == ERR_NONE && ramping){
+	if (std::chrono::steady_clock::now() < deadline_){
+	  scheduler_->at(std::chrono::steady_clock::now() + std::chrono::milliseconds(poll_ms_), [this](){ check(); });
+	  return;
+	}
+	result_.error = ERR_TIMEOUT;
+      }
+
+      scheduler_->post(handle_);
+    });
+}
+
+N1470Scheduler::Operation N1470Scheduler::monitor(N1470 *board, int channel, N1470Param par){
+
+  return Operation(this, [board, channel, par](N1470ResultCallback done){ board->monitorAsync(channel, par, done); });
+}
+
+N1470Scheduler::Operation N1470Scheduler::set(N1470 *board, int channel, N1470Param par, double value){
+
+  return Operation(this, [board, channel, par, value](N1470ResultCallback done){ board->setAsync(channel, par, value, done); });
+}
@@ -0,0 +1,205 @@
+#ifndef N1470CORO_H
+#define N1470CORO_H
+
+#include "N1470.h"
+
+#include <coroutine>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#define RAMP_POLL_MS_N1470 500 // how often waitRamp looks at STAT
+#define RAMP_TIMEOUT_MS_N1470 600000 // longest waitRamp waits for a ramp to finish
+
+class N1470Scheduler;
+
+// A coroutine running an HV procedure. Start it with N1470Scheduler::spawn,
+// or co_await it from another procedure to run it as a step of that one.
+//
+//   N1470Task rampUp(N1470Scheduler &s, N1470 *hv, int ch){
+//     co_await s.set(hv, ch, PAR_VSET, 900);
+//     co_await s.set(hv, ch, PAR_ON);
+//     N1470Result r = co_await s.waitRamp(hv, ch);
+//     ...
+//   }
+//   scheduler.spawn(rampUp(scheduler, hv, 0));
+//   scheduler.run();
+
+class N1470Task{
+
+ public:
+
+  struct promise_type;
+  typedef std::coroutine_handle<promise_type> Handle;
+
+  // Hands control to whoever awaited the task, or lets the scheduler free it
+  struct FinalAwaiter{
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(Handle) noexcept;
+    void await_resume() noexcept {}
+  };
+
+  struct promise_type{
+    std::coroutine_handle<> continuation; // procedure awaiting this one, if any
+    N1470Scheduler *scheduler; // set for tasks started by spawn()
+
+    promise_type() : scheduler(NULL){}
+    N1470Task get_return_object(){ return N1470Task(Handle::from_promise(*this)); }
+    std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+    FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+    void return_void(){}
+    void unhandled_exception(){ std::terminate(); }
+  };
+
+ private:
+
+  Handle handle_;
+
+  friend class N1470Scheduler;
+
+ public:
+
+  explicit N1470Task(Handle handle) : handle_(handle){}
+  N1470Task(N1470Task &&other) : handle_(other.handle_){ other.handle_ = NULL; }
+  N1470Task(const N1470Task &) = delete;
+  ~N1470Task(){ if (handle_) handle_.destroy(); }
+
+  // co_await task runs it to completion before the caller goes on
+  bool await_ready(){ return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller){
+    handle_.promise().continuation = caller;
+    return handle_;
+  }
+  void await_resume(){}
+
+};
+
+// Runs many procedures concurrently on the thread that calls run().
+// A procedure suspends while its command is on the bus or while it sleeps,
+// and the scheduler resumes it when the reply or the time comes, so a
+// single thread keeps any number of boards busy once the bus is pipelined
+// (N1470Bus::startPipeline); before that each command completes in turn.
+
+class N1470Scheduler{
+
+ private:
+
+  struct Timer{
+    std::chrono::steady_clock::time_point when;
+    unsigned long order; // keeps timers for the same instant in order
+    std::function<void()> fire;
+    bool operator>(const Timer &other) const {
+      return when > other.when || (when == other.when && order > other.order);
+    }
+  };
+
+  // Guards everything below. Bus callbacks arrive on the receive thread.
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<std::coroutine_handle<> > ready_;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer> > timers_;
+  unsigned long timer_order_;
+  int live_; // spawned procedures not yet finished
+
+  friend struct N1470Task::FinalAwaiter;
+
+  // Called when a spawned procedure returns
+  void finished(std::coroutine_handle<>);
+
+ public:
+
+  // Every spawned procedure must have finished in run() before the
+  // scheduler goes away, as bus callbacks still refer to it until then
+  N1470Scheduler();
+
+  // Queues a procedure to start on the next run()
+  void spawn(N1470Task &&);
+  // Runs procedures until all spawned ones have finished.
+  // Returns the number of resumptions, for benchmarks.
+  unsigned long run();
+
+  // Resumes a suspended coroutine from run(). Safe from any thread.
+  void post(std::coroutine_handle<>);
+  // Calls fire from run() at the given time. Safe from any thread.
+  void at(std::chrono::steady_clock::time_point, std::function<void()> fire);
+
+
+  // Awaitable for one asynchronous N1470 operation
+  class Operation{
+
+    N1470Scheduler *scheduler_;
+    std::function<void(N1470ResultCallback)> start_;
+    N1470Result result_;
+
+  public:
+
+    Operation(N1470Scheduler *scheduler, std::function<void(N1470ResultCallback)> start) :
+      scheduler_(scheduler), start_(start){}
+
+    bool await_ready(){ return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    N1470Result await_resume(){ return result_; }
+
+  };
+
+  // Awaitable that resumes after a delay
+  class Sleep{
+
+    N1470Scheduler *scheduler_;
+    std::chrono::steady_clock::time_point until_;
+
+  public:
+
+    Sleep(N1470Scheduler *scheduler, int ms) :
+      scheduler_(scheduler), until_(std::chrono::steady_clock::now() + std::chrono::milliseconds(ms)){}
+
+    bool await_ready(){ return until_ <= std::chrono::steady_clock::now(); }
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume(){}
+
+  };
+
+  // Awaitable that resumes once a channel (or every channel for CH_ALL) has
+  // stopped ramping, reading STAT every pollMs. The result holds the last
+  // status words, or ERR_TIMEOUT if still ramping after timeoutMs.
+  class Ramp{
+
+    N1470Scheduler *scheduler_;
+    N1470 *board_;
+    int channel_;
+    int poll_ms_;
+    std::chrono::steady_clock::time_point deadline_;
+    std::coroutine_handle<> handle_;
+    N1470Result result_;
+
+    // Reads STAT and either resumes the waiter or looks again later
+    void check();
+
+  public:
+
+    Ramp(N1470Scheduler *scheduler, N1470 *board, int channel, int pollMs, int timeoutMs) :
+      scheduler_(scheduler), board_(board), channel_(channel), poll_ms_(pollMs),
+      deadline_(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs)){}
+
+    bool await_ready(){ return false; }
+    void await_suspend(std::coroutine_handle<> handle){ handle_ = handle; check(); }
+    N1470Result await_resume(){ return result_; }
+
+  };
+
+  // co_await these from a procedure
+  Operation monitor(N1470 *, int channel, N1470Param);
+  // Sets a numeric parameter, or switches with PAR_ON/PAR_OFF
+  Operation set(N1470 *, int channel, N1470Param, double value = 0);
+  Sleep sleep(int ms){ return Sleep(this, ms); }
+  Ramp waitRamp(N1470 *board, int channel, int pollMs = RAMP_POLL_MS_N1470, int timeoutMs = RAMP_TIMEOUT_MS_N1470){
+    return Ramp(this, board, channel, pollMs, timeoutMs);
+  }
+
+};
+
+#endif
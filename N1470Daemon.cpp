@@ -0,0 +1,469 @@
+#include "N1470Daemon.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Fills in a reply to the client
+static void toReply(N1470DaemonReply *reply, uint32_t id, const N1470Result &result, uint32_t ageMs){
+
+  memset(reply, 0, sizeof(*reply));
+  reply->id = id;
+  reply->error = result.error;
+  reply->n_values = (result.nValues >= 0 && result.nValues <= VAL_MAX_N1470) ? result.nValues : 0;
+  reply->age_ms = ageMs;
+  for (unsigned int i = 0; i < reply->n_values; i++)
+    reply->values[i] = result.values[i];
+}
+
+
+N1470Daemon::N1470Daemon(N1470Bus *bus) :
+  bus_(bus),
+  listen_fd_(-1),
+  running_(false),
+  next_serial_(1){
+
+  wake_[0] = wake_[1] = -1;
+  memset(&stats_, 0, sizeof(stats_));
+
+};
+
+N1470Daemon::~N1470Daemon(){
+
+  for (std::map<uint64_t, Client *>::iterator it = clients_.begin(); it != clients_.end(); it++){
+    ::close(it->second->fd);
+    delete it->second;
+  }
+
+  // Reads still on the wire complete into done_, which is never looked at
+  // again, but their Read objects must stay valid until then
+  bus_->stopPipeline();
+  for (unsigned int i = 0; i < done_.size(); i++)
+    delete done_[i].read;
+
+  if (listen_fd_ >= 0){
+    ::close(listen_fd_);
+    unlink(path_.c_str());
+  }
+  if (wake_[0] >= 0){
+    ::close(wake_[0]);
+    ::close(wake_[1]);
+  }
+
+};
+
+int N1470Daemon::open(const char *path){
+
+  struct sockaddr_un addr;
+
+  if (strlen(path) >= sizeof(addr.sun_path)){
+    fprintf(stderr,"Socket path %s is too long\n",path);
+    return -1;
+  }
+
+  if (pipe(wake_) != 0){
+    perror("pipe");
+    return -2;
+  }
+  fcntl(wake_[0], F_SETFL, O_NONBLOCK);
+  fcntl(wake_[1], F_SETFL, O_NONBLOCK);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  // A socket file left by a daemon that died is in the way
+  unlink(path);
+
+  if ((listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0
+      || bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr)) != 0
+      || listen(listen_fd_, SOMAXCONN) != 0){
+    perror(path);
+    if (listen_fd_ >= 0)
+      ::close(listen_fd_);
+    listen_fd_ = -1;
+    return -3;
+  }
+
+  path_ = path;
+
+  // One read per board may be on the wire at once
+  if (bus_->startPipeline(BD_MAX) != 0)
+    return -4;
+
+  return 0;
+}
+
+void N1470Daemon::stop(){
+
+  char c = 0;
+
+  running_ = false;
+  if (wake_[1] >= 0 && write(wake_[1], &c, 1) < 0){
+    // The pipe is full, so run() is being woken anyway
+  }
+}
+
+void N1470Daemon::finish(const Done &done){
+
+  char c = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(done_mutex_);
+    done_.push_back(done);
+  }
+
+  if (write(wake_[1], &c, 1) < 0){
+    // The pipe is full, so run() is being woken anyway
+  }
+}
+
+void N1470Daemon::reply(uint64_t client, uint32_t id, const N1470Result &result, uint32_t ageMs){
+
+  std::map<uint64_t, Client *>::iterator it = clients_.find(client);
+  N1470DaemonReply msg;
+
+  if (it == clients_.end())
+    return;
+
+  toReply(&msg, id, result, ageMs);
+  it->second->out.append((const char *)&msg, sizeof(msg));
+}
+
+void N1470Daemon::accept(){
+
+  int fd;
+
+  while ((fd = ::accept4(listen_fd_, NULL, NULL, SOCK_NONBLOCK)) >= 0){
+
+    Client *client = new Client;
+    client->fd = fd;
+    client->serial = next_serial_++;
+    clients_[client->serial] = client;
+  }
+}
+
+void N1470Daemon::drop(Client *client){
+
+  // Reads it waits for still complete; their replies are just not sent
+  ::close(client->fd);
+  clients_.erase(client->serial);
+  delete client;
+}
+
+bool N1470Daemon::receive(Client *client){
+
+  char buf[BUFFER_SIZE];
+  ssize_t n;
+
+  while ((n = ::read(client->fd, buf, sizeof(buf))) > 0)
+    client->in.append(buf, n);
+
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    return false;
+
+  size_t used = 0;
+  while (client->in.size() - used >= sizeof(N1470DaemonRequest)){
+
+    N1470DaemonRequest request;
+    memcpy(&request, client->in.data() + used, sizeof(request));
+    used += sizeof(request);
+    handle(client, request);
+  }
+  client->in.erase(0, used);
+
+  return true;
+}
+
+void N1470Daemon::handle(Client *client, const N1470DaemonRequest &request){
+
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  uint32_t k = key(request.bd, request.ch, request.par);
+  uint64_t serial = client->serial;
+  N1470Result fail;
+  N1470 *board;
+
+  stats_.requests++;
+
+  fail.nValues = 0;
+  if (request.par >= PAR_COUNT || (board = bus_->board(request.bd)) == NULL){
+    fail.error = ERR_ARG;
+    reply(serial, request.id, fail, 0);
+    return;
+  }
+
+  if (request.op == DAEMON_SET_N1470){
+
+    // Whatever was read from the board before may be out of date now
+    std::map<uint32_t, Cached>::iterator c = cache_.lower_bound(key(request.bd, 0, 0));
+    while (c != cache_.end() && (c->first >> 16) == request.bd)
+      c = cache_.erase(c);
+    std::map<uint32_t, Read *>::iterator r = reading_.lower_bound(key(request.bd, 0, 0));
+    while (r != reading_.end() && (r->first >> 16) == request.bd){
+      r->second->stale = true;
+      r = reading_.erase(r);
+    }
+
+    Done done;
+    done.read = NULL;
+    done.waiter.client = serial;
+    done.waiter.id = request.id;
+
+    stats_.transactions++;
+    board->setAsync(request.ch, (N1470Param)request.par, request.value,
+		    [this, done](const N1470Result &result) mutable { done.result = result; finish(done); });
+    return;
+  }
+
+  if (request.op != DAEMON_MON_N1470){
+    fail.error = ERR_ARG;
+    reply(serial, request.id, fail, 0);
+    return;
+  }
+
+  // Recent enough for this client?
+  std::map<uint32_t, Cached>::iterator c = cache_.find(k);
+  if (c != cache_.end()){
+    long age = std::chrono::duration_cast<std::chrono::milliseconds>(now - c->second.time).count();
+    if (age <= (long)request.max_age_ms){
+      stats_.cached++;
+      reply(serial, request.id, c->second.result, age);
+      return;
+    }
+  }
+
+  // The same read is already on the wire
+  std::map<uint32_t, Read *>::iterator r = reading_.find(k);
+  if (r != reading_.end()){
+    stats_.coalesced++;
+    r->second->waiters.push_back(Waiter{serial, request.id});
+    return;
+  }
+
+  Read *read = new Read;
+  read->key = k;
+  read->stale = false;
+  read->waiters.push_back(Waiter{serial, request.id});
+  reading_[k] = read;
+
+  stats_.transactions++;
+  board->monitorAsync(request.ch, (N1470Param)request.par,
+		      [this, read](const N1470Result &result){
+			Done done;
+			done.read = read;
+			done.result = result;
+			finish(done);
+		      });
+}
+
+void N1470Daemon::run(){
+
+  std::vector<struct pollfd> fds;
+  std::vector<Client *> polled;
+  std::vector<Done> done;
+  char drain[64];
+
+  running_ = true;
+
+  while (running_){
+
+    fds.clear();
+    polled.clear();
+    fds.push_back(pollfd{listen_fd_, POLLIN, 0});
+    fds.push_back(pollfd{wake_[0], POLLIN, 0});
+    for (std::map<uint64_t, Client *>::iterator it = clients_.begin(); it != clients_.end(); it++){
+      fds.push_back(pollfd{it->second->fd, (short)(POLLIN | (it->second->out.empty() ? 0 : POLLOUT)), 0});
+      polled.push_back(it->second);
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0){
+      if (errno == EINTR)
+	continue;
+      perror("poll");
+      break;
+    }
+
+    if (fds[1].revents & POLLIN)
+      while (::read(wake_[0], drain, sizeof(drain)) > 0);
+
+    // Replies from the modules
+    {
+      std::lock_guard<std::mutex> lock(done_mutex_);
+      done.swap(done_);
+    }
+    for (unsigned int i = 0; i < done.size(); i++){
+
+      Read *read = done[i].read;
+
+      if (read == NULL){
+	reply(done[i].waiter.client, done[i].waiter.id, done[i].result, 0);
+	continue;
+      }
+
+      std::map<uint32_t, Read *>::iterator r = reading_.find(read->key);
+      if (r != reading_.end() && r->second == read)
+	reading_.erase(r);
+
+      if (!read->stale && done[i].result.error == ERR_NONE)
+	cache_[read->key] = Cached{done[i].result, std::chrono::steady_clock::now()};
+
+      for (unsigned int w = 0; w < read->waiters.size(); w++)
+	reply(read->waiters[w].client, read->waiters[w].id, done[i].result, 0);
+
+      delete read;
+    }
+    done.clear();
+
+    // Requests from clients and replies to them
+    for (unsigned int i = 0; i < polled.size(); i++){
+
+      Client *client = polled[i];
+      short revents = fds[i + 2].revents;
+
+      if ((revents & (POLLIN | POLLHUP | POLLERR)) && !receive(client)){
+	drop(client);
+	continue;
+      }
+    }
+
+    for (std::map<uint64_t, Client *>::iterator it = clients_.begin(); it != clients_.end();){
+
+      Client *client = (it++)->second;
+      ssize_t n;
+
+      if (client->out.empty())
+	continue;
+
+      n = send(client->fd, client->out.data(), client->out.size(), MSG_NOSIGNAL);
+      if (n > 0)
+	client->out.erase(0, n);
+      else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	drop(client);
+    }
+
+    if (fds[0].revents & POLLIN)
+      accept();
+  }
+}
+
+
+N1470DaemonClient::N1470DaemonClient() :
+  fd_(-1),
+  next_id_(1){
+
+};
+
+N1470DaemonClient::~N1470DaemonClient(){
+
+  close();
+
+};
+
+int N1470DaemonClient::connect(const char *path){
+
+  struct sockaddr_un addr;
+
+  close();
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if ((fd_ = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return -2;
+
+  if (::connect(fd_, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+    ::close(fd_);
+    fd_ = -1;
+    return -3;
+  }
+
+  return 0;
+}
+
+void N1470DaemonClient::close(){
+
+  if (fd_ < 0)
+    return;
+
+  ::close(fd_);
+  fd_ = -1;
+}
+
+int N1470DaemonClient::call(N1470DaemonRequest *request, N1470DaemonReply *reply){
+
+  size_t done;
+  ssize_t n;
+
+  if (fd_ < 0)
+    return ERR_IO;
+
+  request->id = next_id_++;
+
+  for (done = 0; done < sizeof(*request); done += n)
+    if ((n = send(fd_, (const char *)request + done, sizeof(*request) - done, MSG_NOSIGNAL)) <= 0)
+      return ERR_IO;
+
+  // Replies come in order of requests on a blocking client, but skip any
+  // left over from a call that was abandoned
+  do {
+    for (done = 0; done < sizeof(*reply); done += n)
+      if ((n = recv(fd_, (char *)reply + done, sizeof(*reply) - done, 0)) <= 0)
+	return ERR_IO;
+  } while (reply->id != request->id);
+
+  return reply->error;
+}
+
+int N1470DaemonClient::monitor(int bd, int ch, N1470Param par, N1470Result *result, unsigned int maxAgeMs){
+
+  N1470DaemonRequest request;
+  N1470DaemonReply reply;
+  int error;
+
+  memset(&request, 0, sizeof(request));
+  request.op = DAEMON_MON_N1470;
+  request.bd = bd;
+  request.ch = ch;
+  request.par = par;
+  request.max_age_ms = maxAgeMs;
+
+  error = call(&request, &reply);
+
+  result->error = error;
+  result->nValues = (error == ERR_IO) ? 0 : reply.n_values;
+  for (int i = 0; i < result->nValues; i++)
+    result->values[i] = reply.values[i];
+
+  return error;
+}
+
+int N1470DaemonClient::set(int bd, int ch, N1470Param par, double value, N1470Result *result){
+
+  N1470DaemonRequest request;
+  N1470DaemonReply reply;
+  int error;
+
+  memset(&request, 0, sizeof(request));
+  request.op = DAEMON_SET_N1470;
+  request.bd = bd;
+  request.ch = ch;
+  request.par = par;
+  request.value = value;
+
+  error = call(&request, &reply);
+
+  result->error = error;
+  result->nValues = (error == ERR_IO) ? 0 : reply.n_values;
+  for (int i = 0; i < result->nValues; i++)
+    result->values[i] = reply.values[i];
+
+  return error;
+}
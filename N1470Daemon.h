@@ -0,0 +1,174 @@
+#ifndef N1470DAEMON_H
+#define N1470DAEMON_H
+
+#include "N1470.h"
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#define DAEMON_SOCKET_N1470 "/tmp/n1470.sock" // default Unix socket path
+#define DAEMON_MON_N1470 1 // request op: monitor a parameter
+#define DAEMON_SET_N1470 2 // request op: set a parameter or switch
+
+// One request from a client. Requests and replies are sent as these raw
+// structs; a client may send many before reading and replies come back
+// as they complete, matched by id.
+struct N1470DaemonRequest{
+
+  uint32_t id; // chosen by the client, echoed in the reply
+  uint8_t op; // DAEMON_MON_N1470 or DAEMON_SET_N1470
+  uint8_t bd;
+  uint8_t ch; // 0-3, or CH_ALL
+  uint8_t par; // N1470Param
+  uint32_t max_age_ms; // MON: a cached value this old is good enough, 0 = read now
+  uint32_t reserved;
+  double value; // SET: the value, ignored for PAR_ON/PAR_OFF
+
+};
+static_assert(sizeof(N1470DaemonRequest) == 24, "N1470DaemonRequest is part of the protocol");
+
+struct N1470DaemonReply{
+
+  uint32_t id;
+  int32_t error; // N1470Error
+  uint32_t n_values;
+  uint32_t age_ms; // how old the value is, 0 if read for this request
+  double values[VAL_MAX_N1470];
+
+};
+static_assert(sizeof(N1470DaemonReply) == 48, "N1470DaemonReply is part of the protocol");
+
+// Counters since the daemon started
+struct N1470DaemonStats{
+
+  unsigned long requests; // requests received
+  unsigned long transactions; // commands sent to the modules
+  unsigned long coalesced; // reads that joined an identical one in flight
+  unsigned long cached; // reads answered from the cache
+
+};
+
+// Owns one link and serves any number of local clients over a Unix socket.
+//
+// Identical reads (same BD, CH and PAR) that arrive while one is on the
+// wire share its reply, so ten clients polling channel 2 VMON cost one
+// transaction. Replies are kept, and a read whose client accepts values up
+// to max_age_ms old is answered from them without touching the link. A SET
+// to a board drops that board's cached values, and reads already in flight
+// for it are no longer joined by new ones.
+
+class N1470Daemon{
+
+ private:
+
+  struct Client{
+    int fd;
+    uint64_t serial; // never reused, so a late reply cannot reach a new client
+    std::string in; // bytes of a partial request
+    std::string out; // replies not yet written
+  };
+
+  struct Waiter{
+    uint64_t client;
+    uint32_t id;
+  };
+
+  // A read on the wire and everyone waiting for it
+  struct Read{
+    uint32_t key;
+    bool stale; // a SET went to the board since it was sent; do not cache
+    std::vector<Waiter> waiters;
+  };
+
+  struct Cached{
+    N1470Result result;
+    std::chrono::steady_clock::time_point time;
+  };
+
+  // A finished transaction handed from the bus's receive thread to run()
+  struct Done{
+    Read *read; // NULL for a SET
+    Waiter waiter; // for a SET
+    N1470Result result;
+  };
+
+  N1470Bus *bus_;
+  std::string path_;
+  int listen_fd_;
+  int wake_[2];
+  std::atomic<bool> running_;
+
+  uint64_t next_serial_;
+  std::map<uint64_t, Client *> clients_;
+  std::map<uint32_t, Read *> reading_; // reads that new requests may join, by key
+  std::map<uint32_t, Cached> cache_;
+  N1470DaemonStats stats_;
+
+  std::mutex done_mutex_;
+  std::vector<Done> done_;
+
+  static uint32_t key(int bd, int ch, int par){ return (bd << 16) | (ch << 8) | par; }
+
+  void accept();
+  // Reads and handles whatever the client sent. Returns false if it hung up.
+  bool receive(Client *);
+  void handle(Client *, const N1470DaemonRequest &);
+  // Queues a reply for a client if it is still connected
+  void reply(uint64_t client, uint32_t id, const N1470Result &, uint32_t ageMs);
+  // Hands a finished transaction to run(). Called on the receive thread.
+  void finish(const Done &);
+  void drop(Client *);
+
+ public:
+
+  // Serves the boards of an open bus, which must outlive the daemon
+  N1470Daemon(N1470Bus *);
+  ~N1470Daemon();
+
+  // Binds the socket. Returns 0 on success.
+  int open(const char *path = DAEMON_SOCKET_N1470);
+  // Serves clients until stop() is called
+  void run();
+  // Makes run() return. Safe from any thread or a signal handler.
+  void stop();
+
+  N1470DaemonStats getStats(){ return stats_; }
+
+};
+
+// Blocking client for tools and scripts
+
+class N1470DaemonClient{
+
+ private:
+
+  int fd_;
+  uint32_t next_id_;
+
+ public:
+
+  N1470DaemonClient();
+  ~N1470DaemonClient();
+
+  // Returns 0 on success
+  int connect(const char *path = DAEMON_SOCKET_N1470);
+  void close();
+
+  // Reads a parameter, accepting a value up to maxAgeMs old.
+  // Returns the N1470Error of the result.
+  int monitor(int bd, int ch, N1470Param, N1470Result *, unsigned int maxAgeMs = 0);
+  // Sets a parameter, or switches with PAR_ON/PAR_OFF
+  int set(int bd, int ch, N1470Param, double value, N1470Result *);
+
+  // Sends a request and waits for its reply. Returns the N1470Error.
+  int call(N1470DaemonRequest *, N1470DaemonReply *);
+
+};
+
+#endif
@@ -0,0 +1,205 @@
+#include "N1470Fleet.h"
+
+N1470Fleet::N1470Fleet() :
+  running_(false),
+  interval_ms_(0),
+  requested_(0){
+
+};
+
+N1470Fleet::~N1470Fleet(){
+
+  stop();
+
+  for (unsigned int a = 0; a < adapters_.size(); a++){
+    delete adapters_[a]->bus;
+    delete adapters_[a];
+  }
+
+};
+
+
+int N1470Fleet::addAdapter(const char *id, const int *boards, int nBoards, bool bySerial){
+
+  int ret;
+
+  if (running_){
+    fprintf(stderr,"Cannot add adapter %s while the fleet is running\n",id);
+    return -1;
+  }
+
+  Adapter *adapter = new Adapter();
+  adapter->bus = new N1470Bus();
+  adapter->id = id;
+  adapter->swept = 0;
+  adapter->failed = 0;
+
+  // The line speed is negotiated with a board known to be on the chain
+  if (nBoards > 0)
+    adapter->bus->setProbeBoard(boards[0]);
+
+  if (bySerial)
+    ret = adapter->bus->openBySerialNumber(id);
+  else
+    ret = adapter->bus->openByDescription(id);
+
+  if (ret != 0){
+    fprintf(stderr,"Could not open adapter %s\n",id);
+    delete adapter->bus;
+    delete adapter;
+    return -2;
+  }
+
+  for (int b = 0; b < nBoards; b++){
+
+    if (adapter->bus->board(boards[b]) == NULL){
+      delete adapter->bus;
+      delete adapter;
+      return -3;
+    }
+    adapter->boards.push_back(boards[b]);
+  }
+
+  adapters_.push_back(adapter);
+  return adapters_.size() - 1;
+}
+
+int N1470Fleet::start(int intervalMs){
+
+  if (intervalMs < 0){
+    PRINT_ERR("start",(unsigned long)intervalMs);
+    return -1;
+  }
+
+  stop();
+
+  running_ = true;
+  interval_ms_ = intervalMs;
+
+  for (unsigned int a = 0; a < adapters_.size(); a++){
+    adapters_[a]->swept = requested_;
+    adapters_[a]->thread = std::thread(&N1470Fleet::adapterLoop, this, adapters_[a]);
+  }
+
+  return 0;
+}
+
+void N1470Fleet::stop(){
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+  wake_.notify_all();
+  swept_.notify_all();
+
+  for (unsigned int a = 0; a < adapters_.size(); a++)
+    if (adapters_[a]->thread.joinable())
+      adapters_[a]->thread.join();
+}
+
+void N1470Fleet::adapterLoop(Adapter *adapter){
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  unsigned long target;
+  int failed;
+
+  while (running_){
+
+    // Sleep until a sweep is asked for or, when polling periodically, the interval is up
+    if (interval_ms_ > 0)
+      wake_.wait_for(lock, std::chrono::milliseconds(interval_ms_),
+		     [this, adapter]{ return !running_ || requested_ > adapter->swept; });
+    else
+      wake_.wait(lock, [this, adapter]{ return !running_ || requested_ > adapter->swept; });
+
+    if (!running_)
+      break;
+
+    target = requested_;
+    lock.unlock();
+
+    failed = 0;
+    for (unsigned int b = 0; b < adapter->boards.size(); b++)
+      if (adapter->bus->board(adapter->boards[b])->pollOnce() != 0)
+	failed++;
+
+    lock.lock();
+
+    if (failed != adapter->failed)
+      fprintf(stderr,"Adapter %s: %d of %zu boards not answering\n",adapter->id.c_str(),failed,adapter->boards.size());
+
+    adapter->failed = failed;
+    adapter->swept = target;
+    swept_.notify_all();
+  }
+}
+
+int N1470Fleet::sweep(){
+
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  if (!running_){
+    fprintf(stderr,"Fleet threads are not running\n");
+    return -1;
+  }
+
+  unsigned long target = ++requested_;
+  wake_.notify_all();
+
+  swept_.wait(lock, [this, target]{
+      if (!running_)
+	return true;
+      for (unsigned int a = 0; a < adapters_.size(); a++)
+	if (adapters_[a]->swept < target)
+	  return false;
+      return true;
+    });
+
+  if (!running_)
+    return -1;
+
+  int failed = 0;
+  for (unsigned int a = 0; a < adapters_.size(); a++)
+    failed += adapters_[a]->failed;
+
+  return failed;
+}
+
+int N1470Fleet::getFailures(int adapter){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (adapter < 0 || adapter >= (int)adapters_.size())
+    return -1;
+
+  return adapters_[adapter]->failed;
+}
+
+int N1470Fleet::getFleetSnapshot(std::vector<N1470FleetEntry> *entries){
+
+  N1470FleetEntry entry;
+
+  entries->clear();
+
+  for (unsigned int a = 0; a < adapters_.size(); a++){
+    for (unsigned int b = 0; b < adapters_[a]->boards.size(); b++){
+
+      entry.adapter = a;
+      entry.id = adapters_[a]->id;
+      entry.bd = adapters_[a]->boards[b];
+      adapters_[a]->bus->board(entry.bd)->getSnapshot(&entry.snapshot);
+      entries->push_back(entry);
+    }
+  }
+
+  return entries->size();
+}
+
+N1470Bus * N1470Fleet::getBus(int adapter){
+
+  if (adapter < 0 || adapter >= (int)adapters_.size())
+    return NULL;
+
+  return adapters_[adapter]->bus;
+}
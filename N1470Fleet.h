@@ -0,0 +1,88 @@
+#ifndef N1470FLEET_H
+#define N1470FLEET_H
+
+#include "N1470.h"
+#include "N1470Bus.h"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// One board's entry in the fleet-wide view
+struct N1470FleetEntry{
+
+  int adapter; // Index returned by N1470Fleet::addAdapter
+  std::string id; // Serial number or description the adapter was opened by
+  int bd; // Board ID on that adapter's daisy chain
+  N1470Snapshot snapshot; // Latest sweep, sequence 0 if none yet
+
+};
+
+// Several USB adapters on one host, each with a daisy chain of N1470 boards.
+// Every adapter gets its own I/O thread, so the adapters are swept in
+// parallel and a fleet-wide sweep takes as long as the slowest adapter.
+// A board or adapter that stops answering only holds up its own thread;
+// its snapshots stay at the last good sweep, marked stale.
+
+class N1470Fleet{
+
+ private:
+
+  struct Adapter{
+    N1470Bus *bus;
+    std::string id;
+    std::vector<int> boards;
+    std::thread thread;
+    unsigned long swept; // last sweep request this adapter has completed
+    int failed; // boards whose latest sweep failed
+  };
+
+  std::vector<Adapter *> adapters_;
+
+  // Guards the fields below and wakes the adapter threads
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable swept_;
+  bool running_;
+  int interval_ms_;
+  unsigned long requested_; // number of sweeps asked for through sweep()
+
+  // Body of an adapter's I/O thread
+  void adapterLoop(Adapter *);
+
+ public:
+
+  N1470Fleet();
+  ~N1470Fleet();
+
+  // Opens the adapter with the given serial number (or description if
+  // bySerial is false) and attaches the listed boards on its daisy chain.
+  // Must be called before start(). Returns the adapter index, negative on failure.
+  int addAdapter(const char *id, const int *boards, int nBoards, bool bySerial = true);
+
+  // Starts one I/O thread per adapter. Each sweeps its boards every intervalMs,
+  // or only when sweep() is called if intervalMs is 0. Returns 0 on success.
+  int start(int intervalMs = 0);
+  // Stops the I/O threads
+  void stop();
+
+  // Sweeps every adapter in parallel and returns when all are done.
+  // Returns 0 on success, the number of boards whose sweep failed, or -1
+  // if the threads are not running.
+  int sweep();
+  // Boards of an adapter whose latest sweep failed, -1 if the index is out
+  // of range
+  int getFailures(int adapter);
+
+  // Copies the latest snapshot of every board into the vector. Never touches
+  // the devices. Returns the number of boards.
+  int getFleetSnapshot(std::vector<N1470FleetEntry> *);
+
+  // Returns the bus of an adapter, NULL if the index is out of range
+  N1470Bus * getBus(int adapter);
+
+};
+
+#endif
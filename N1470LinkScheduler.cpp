@@ -0,0 +1,157 @@
+#include "N1470LinkScheduler.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+N1470LinkScheduler::N1470LinkScheduler() :
+  busy_(0),
+  window_busy_ms_(0){
+
+  static const double shares[PRIO_COUNT] = {1, LINK_SHARE_STATUS_N1470, LINK_SHARE_MONITOR_N1470,
+					    LINK_SHARE_CONFIG_N1470, LINK_SHARE_DIAG_N1470};
+
+  refilled_ = window_start_ = busy_since_ = std::chrono::steady_clock::now();
+
+  memset(&stats_, 0, sizeof(stats_));
+
+  for (int prio = 0; prio < PRIO_COUNT; prio++){
+    classes_[prio].rate = shares[prio] * 1000;
+    classes_[prio].tokens = LINK_BURST_MS_N1470;
+    window_class_ms_[prio] = 0;
+  }
+
+  for (int bd = 0; bd < LINK_BOARDS_N1470; bd++){
+    boards_[bd].rate = 0;
+    boards_[bd].tokens = LINK_BURST_MS_N1470;
+  }
+
+};
+
+N1470Priority N1470LinkScheduler::classify(const char *cmd){
+
+  static const char *settings[] = {"VSET", "ISET", "MAXV", "RUP", "RDW", "TRIP", "PDWN", "POL", "BDILKM"};
+  const char *par;
+
+  if (strstr(cmd, ",CMD:SET") != NULL)
+    return PRIO_CONFIG;
+
+  if ((par = strstr(cmd, ",PAR:")) == NULL)
+    return PRIO_DIAG;
+  par += 5;
+
+  // The name runs up to the next field or the line end
+  size_t length = strcspn(par, ",\r\n");
+
+  if (length == 4 && strncmp(par, "STAT", 4) == 0)
+    return PRIO_STATUS;
+  if (length == 4 && (strncmp(par, "VMON", 4) == 0 || strncmp(par, "IMON", 4) == 0))
+    return PRIO_MONITOR;
+
+  for (unsigned int i = 0; i < sizeof(settings) / sizeof(settings[0]); i++)
+    if (length == strlen(settings[i]) && strncmp(par, settings[i], length) == 0)
+      return PRIO_CONFIG;
+
+  return PRIO_DIAG;
+}
+
+void N1470LinkScheduler::setShare(N1470Priority prio, double fraction){
+
+  if (prio >= 0 && prio < PRIO_COUNT && fraction >= 0)
+    classes_[prio].rate = fraction * 1000;
+}
+
+void N1470LinkScheduler::setBoardShare(double fraction){
+
+  for (int bd = 0; bd < LINK_BOARDS_N1470; bd++)
+    boards_[bd].rate = (fraction > 0) ? fraction * 1000 : 0;
+}
+
+void N1470LinkScheduler::refill(std::chrono::steady_clock::time_point now){
+
+  double seconds = std::chrono::duration<double>(now - refilled_).count();
+
+  refilled_ = now;
+
+  for (int prio = 0; prio < PRIO_COUNT; prio++)
+    classes_[prio].tokens = std::min(classes_[prio].tokens + classes_[prio].rate * seconds, (double)LINK_BURST_MS_N1470);
+
+  for (int bd = 0; bd < LINK_BOARDS_N1470; bd++)
+    boards_[bd].tokens = std::min(boards_[bd].tokens + boards_[bd].rate * seconds, (double)LINK_BURST_MS_N1470);
+}
+
+int N1470LinkScheduler::pick(const N1470Priority *prio, const int *bd, int n){
+
+  int best = -1, bestRank = 0;
+
+  refill(std::chrono::steady_clock::now());
+
+  for (int i = 0; i < n; i++){
+
+    // Overspending the class or the board pushes a command behind every
+    // command that has not, whatever its class. STAT only ever yields to
+    // an emergency OFF.
+    bool board = bd[i] >= 0 && bd[i] < LINK_BOARDS_N1470;
+    int overspent = (classes_[prio[i]].tokens <= 0) + (board && boards_[bd[i]].rate > 0 && boards_[bd[i]].tokens <= 0);
+    int rank = (prio[i] <= PRIO_STATUS) ? prio[i] - 1 : overspent * PRIO_COUNT + prio[i];
+
+    // Ties go to the earlier arrival
+    if (best < 0 || rank < bestRank){
+      best = i;
+      bestRank = rank;
+    }
+  }
+
+  return best;
+}
+
+void N1470LinkScheduler::account(std::chrono::steady_clock::time_point now){
+
+  if (busy_ > 0)
+    window_busy_ms_ += std::chrono::duration<double, std::milli>(now - busy_since_).count();
+  busy_since_ = now;
+
+  double span = std::chrono::duration<double, std::milli>(now - window_start_).count();
+
+  if (span < LINK_WINDOW_MS_N1470)
+    return;
+
+  stats_.saturation = std::min(window_busy_ms_ / span, 1.0);
+  for (int prio = 0; prio < PRIO_COUNT; prio++){
+    stats_.share[prio] = window_class_ms_[prio] / span;
+    window_class_ms_[prio] = 0;
+  }
+
+  window_start_ = now;
+  window_busy_ms_ = 0;
+}
+
+void N1470LinkScheduler::started(N1470Priority prio, double waitedMs){
+
+  account(std::chrono::steady_clock::now());
+
+  busy_++;
+  stats_.served[prio]++;
+  stats_.max_wait_ms[prio] = std::max(stats_.max_wait_ms[prio], waitedMs);
+}
+
+void N1470LinkScheduler::finished(N1470Priority prio, int bd, double costMs){
+
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+  account(now);
+  refill(now);
+
+  busy_--;
+  classes_[prio].tokens -= costMs;
+  if (bd >= 0 && bd < LINK_BOARDS_N1470)
+    boards_[bd].tokens -= costMs;
+  window_class_ms_[prio] += costMs;
+}
+
+N1470LinkStats N1470LinkScheduler::getStats(){
+
+  account(std::chrono::steady_clock::now());
+
+  return stats_;
+}
@@ -0,0 +1,101 @@
+#ifndef N1470LINKSCHEDULER_H
+#define N1470LINKSCHEDULER_H
+
+#include <chrono>
+
+#define LINK_SHARE_STATUS_N1470 0.4 // default shares of link time per class
+#define LINK_SHARE_MONITOR_N1470 0.3
+#define LINK_SHARE_CONFIG_N1470 0.2
+#define LINK_SHARE_DIAG_N1470 0.1
+#define LINK_BURST_MS_N1470 500 // link time a class or board may save up while idle
+#define LINK_WINDOW_MS_N1470 1000 // span over which saturation is measured
+#define LINK_BOARDS_N1470 32 // BD_MAX
+
+// Traffic classes, most urgent first
+enum N1470Priority{
+
+  PRIO_EMERGENCY, // N1470Bus::emergencyOff, always first and never held back
+  PRIO_STATUS, // STAT polling, which is how trips are seen
+  PRIO_MONITOR, // VMON and IMON
+  PRIO_CONFIG, // every SET, and reads of settings
+  PRIO_DIAG, // board name and anything else
+  PRIO_COUNT
+
+};
+
+// How busy the link is
+struct N1470LinkStats{
+
+  double saturation; // fraction of the last window with a command on the link
+  double share[PRIO_COUNT]; // fraction of that window each class used
+  unsigned long served[PRIO_COUNT]; // commands sent since the link was opened
+  double max_wait_ms[PRIO_COUNT]; // longest any command waited for the link
+  int waiting[PRIO_COUNT]; // commands waiting right now, filled in by the bus
+
+};
+
+// Decides which waiting command gets the link next. Policy only: the bus
+// does the locking and the I/O and reports each command's link time back.
+//
+// Each class, and optionally each board, has a token bucket filled with
+// its share of link time (ms per second). The next command is the most
+// urgent one whose class and board still have time in hand; when every
+// waiter has overspent, the most urgent one goes anyway, so the link never
+// idles while work waits. STAT is never held back by its budget, as it is
+// how trips are seen; the poller keeps to its share by pacing itself
+// instead. A command is never cut short, so a status poll waits at most for
+// the one command already on the link.
+
+class N1470LinkScheduler{
+
+ private:
+
+  struct Bucket{
+    double rate; // ms of link time per s, 0 for no limit
+    double tokens; // ms in hand, negative when overspent
+  };
+
+  Bucket classes_[PRIO_COUNT];
+  Bucket boards_[LINK_BOARDS_N1470];
+  std::chrono::steady_clock::time_point refilled_;
+
+  // Saturation over the current window
+  int busy_; // commands on the link
+  std::chrono::steady_clock::time_point busy_since_;
+  std::chrono::steady_clock::time_point window_start_;
+  double window_busy_ms_;
+  double window_class_ms_[PRIO_COUNT];
+
+  N1470LinkStats stats_;
+
+  void refill(std::chrono::steady_clock::time_point);
+  // Adds the busy time up to now to the window and closes it if it is over
+  void account(std::chrono::steady_clock::time_point);
+
+ public:
+
+  N1470LinkScheduler();
+
+  // The class a command belongs to, from its CMD and PAR
+  static N1470Priority classify(const char *cmd);
+
+  // Fraction of link time a class is entitled to while others compete
+  void setShare(N1470Priority, double fraction);
+  double getShare(N1470Priority prio){ return classes_[prio].rate / 1000; }
+  // Same for every board, 0 for no per-board limit (the default)
+  void setBoardShare(double fraction);
+
+  // Index of the waiting command to send next, given the class and board of
+  // each in arrival order, or -1 if n is 0
+  int pick(const N1470Priority *, const int *bd, int n);
+
+  // Bookkeeping: a command was put on the link after waiting waitedMs, and
+  // came back after costMs of link time
+  void started(N1470Priority, double waitedMs);
+  void finished(N1470Priority, int bd, double costMs);
+
+  N1470LinkStats getStats();
+
+};
+
+#endif
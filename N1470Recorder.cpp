@@ -0,0 +1,308 @@
+#include "N1470Recorder.h"
+#include "N1470.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <algorithm>
+
+static const char REC_MAGIC[8] = {'N','1','4','7','0','R','E','C'};
+
+// Finds the segment files of prefix, sorted by index. Returns -1 if the
+// directory cannot be read.
+static int listSegments(const std::string &prefix, std::vector<std::pair<uint64_t, std::string> > *segments){
+
+  size_t slash = prefix.rfind('/');
+  std::string dir = (slash == std::string::npos) ? "." : prefix.substr(0, slash + 1);
+  std::string base = (slash == std::string::npos) ? prefix : prefix.substr(slash + 1);
+  struct dirent *entry;
+  unsigned long long index;
+  char tail[8];
+  DIR *d;
+
+  if ((d = opendir(dir.c_str())) == NULL)
+    return -1;
+
+  while ((entry = readdir(d)) != NULL){
+
+    std::string name(entry->d_name);
+
+    if (name.size() != base.size() + 13 || name.compare(0, base.size(), base) != 0)
+      continue;
+    if (sscanf(name.c_str() + base.size(), ".%6llu.%5s", &index, tail) != 2 || strcmp(tail, "n1470") != 0)
+      continue;
+
+    segments->push_back(std::make_pair((uint64_t)index, (slash == std::string::npos) ? name : dir + name));
+  }
+
+  closedir(d);
+  std::sort(segments->begin(), segments->end());
+
+  return 0;
+}
+
+
+N1470Recorder::N1470Recorder() :
+  segment_records_(REC_SEGMENT_RECORDS),
+  fd_(-1),
+  header_(NULL),
+  records_(NULL),
+  segment_(0),
+  written_(0){
+
+};
+
+N1470Recorder::~N1470Recorder(){
+
+  close();
+
+};
+
+int N1470Recorder::open(const char *prefix, unsigned long recordsPerSegment){
+
+  std::vector<std::pair<uint64_t, std::string> > existing;
+
+  close();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (recordsPerSegment == 0){
+    PRINT_ERR("N1470Recorder::open", recordsPerSegment);
+    return -1;
+  }
+
+  prefix_ = prefix;
+  segment_records_ = recordsPerSegment;
+
+  if (listSegments(prefix_, &existing) != 0){
+    fprintf(stderr,"Cannot read the directory of %s\n",prefix);
+    return -2;
+  }
+
+  // Never append to an old segment; it may have been trimmed already
+  segment_ = existing.empty() ? 0 : existing.back().first + 1;
+
+  return openSegment();
+}
+
+void N1470Recorder::close(){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  closeSegment();
+}
+
+int N1470Recorder::openSegment(){
+
+  char name[32];
+  std::string path;
+  size_t size = sizeof(N1470RecordHeader) + segment_records_ * sizeof(N1470Record);
+  void *map;
+
+  snprintf(name, sizeof(name), ".%06llu.n1470", (unsigned long long)segment_);
+  path = prefix_ + name;
+
+  if ((fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644)) < 0){
+    perror(path.c_str());
+    return -3;
+  }
+
+  if (ftruncate(fd_, size) != 0 || (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0)) == MAP_FAILED){
+    perror(path.c_str());
+    ::close(fd_);
+    fd_ = -1;
+    return -4;
+  }
+
+  header_ = (N1470RecordHeader *)map;
+  records_ = (N1470Record *)(header_ + 1);
+  written_ = 0;
+
+  memcpy(header_->magic, REC_MAGIC, sizeof(REC_MAGIC));
+  header_->version = REC_VERSION_N1470;
+  header_->record_size = sizeof(N1470Record);
+  header_->segment = segment_;
+  header_->capacity = segment_records_;
+  header_->first_ns = 0;
+  header_->last_ns = 0;
+  std::atomic_ref<uint64_t>(header_->count).store(0, std::memory_order_release);
+
+  return 0;
+}
+
+void N1470Recorder::commit(){
+
+  if (header_ == NULL || written_ == 0)
+    return;
+
+  header_->first_ns = records_[0].time_ns;
+  header_->last_ns = records_[written_ - 1].time_ns;
+
+  // Readers that see the new count also see the records and times before it
+  std::atomic_ref<uint64_t>(header_->count).store(written_, std::memory_order_release);
+}
+
+void N1470Recorder::closeSegment(){
+
+  size_t size = sizeof(N1470RecordHeader) + segment_records_ * sizeof(N1470Record);
+
+  if (header_ == NULL)
+    return;
+
+  commit();
+  header_->capacity = written_;
+
+  munmap(header_, size);
+
+  // Give back the room the segment did not use
+  if (ftruncate(fd_, sizeof(N1470RecordHeader) + written_ * sizeof(N1470Record)) != 0)
+    perror("N1470Recorder ftruncate");
+  ::close(fd_);
+
+  header_ = NULL;
+  records_ = NULL;
+  fd_ = -1;
+  segment_++;
+}
+
+int N1470Recorder::record(const N1470Record &sample){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  int ret;
+
+  if (header_ == NULL)
+    return -1;
+
+  records_[written_++] = sample;
+
+  if (written_ == segment_records_){
+    closeSegment();
+    if ((ret = openSegment()) != 0)
+      return ret;
+  }
+  else if (written_ % REC_BATCH_N1470 == 0)
+    commit();
+
+  return 0;
+}
+
+int N1470Recorder::record(int bd, const N1470Snapshot &snap){
+
+  N1470Record sample;
+  int ret;
+
+  sample.time_ns = (int64_t)snap.time.tv_sec * 1000000000LL + snap.time.tv_nsec;
+  sample.bd = bd;
+
+  for (int ch = 0; ch < CH_MAX; ch++){
+
+    sample.ch = ch;
+    sample.vmon = snap.vmon[ch];
+    sample.imon = snap.imon[ch];
+    sample.status = snap.status[ch];
+
+    if ((ret = record(sample)) != 0)
+      return ret;
+  }
+
+  return 0;
+}
+
+int N1470Recorder::flush(){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (header_ == NULL)
+    return -1;
+
+  commit();
+
+  if (msync(header_, sizeof(N1470RecordHeader) + written_ * sizeof(N1470Record), MS_ASYNC) != 0){
+    perror("msync");
+    return -2;
+  }
+
+  return 0;
+}
+
+
+int N1470RecordReader::open(const char *prefix){
+
+  std::vector<std::pair<uint64_t, std::string> > segments;
+
+  files_.clear();
+
+  if (listSegments(prefix, &segments) != 0){
+    fprintf(stderr,"Cannot read the directory of %s\n",prefix);
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < segments.size(); i++)
+    files_.push_back(segments[i].second);
+
+  return files_.size();
+}
+
+uint64_t N1470RecordReader::scan(int64_t from_ns, int64_t to_ns, std::function<void(const N1470Record *, size_t)> visit){
+
+  uint64_t visited = 0;
+
+  for (unsigned int i = 0; i < files_.size(); i++){
+
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = ::open(files_[i].c_str(), O_RDONLY)) < 0)
+      continue;
+
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(N1470RecordHeader)
+	|| (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+      ::close(fd);
+      continue;
+    }
+    ::close(fd);
+
+    // The records are visited front to back; let the kernel read ahead
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    N1470RecordHeader *header = (N1470RecordHeader *)map;
+    const N1470Record *records = (const N1470Record *)(header + 1);
+
+    uint64_t count = std::atomic_ref<uint64_t>(header->count).load(std::memory_order_acquire);
+    uint64_t fits = (st.st_size - sizeof(N1470RecordHeader)) / sizeof(N1470Record);
+
+    if (memcmp(header->magic, REC_MAGIC, sizeof(REC_MAGIC)) != 0 || header->version != REC_VERSION_N1470
+	|| header->record_size != sizeof(N1470Record)){
+      fprintf(stderr,"Skipping %s, not a version %d recording\n",files_[i].c_str(),REC_VERSION_N1470);
+      munmap(map, st.st_size);
+      continue;
+    }
+
+    if (count > fits)
+      count = fits;
+
+    if (count > 0 && header->last_ns >= from_ns && header->first_ns <= to_ns){
+
+      const N1470Record *first = std::lower_bound(records, records + count, from_ns,
+	  [](const N1470Record &r, int64_t t){ return r.time_ns < t; });
+      const N1470Record *last = std::upper_bound(first, records + count, to_ns,
+	  [](int64_t t, const N1470Record &r){ return t < r.time_ns; });
+
+      if (last > first){
+	visit(first, last - first);
+	visited += last - first;
+      }
+    }
+
+    munmap(map, st.st_size);
+  }
+
+  return visited;
+}
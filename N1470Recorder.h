@@ -0,0 +1,121 @@
+#ifndef N1470RECORDER_H
+#define N1470RECORDER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+
+struct N1470Snapshot;
+
+#define REC_VERSION_N1470 1
+#define REC_SEGMENT_RECORDS (1UL << 20) // records per segment file, 24 MB
+#define REC_BATCH_N1470 256 // records written between commits of the count
+
+// One sample of one channel. Fixed size, so the file is an array of these.
+struct N1470Record{
+
+  int64_t time_ns; // CLOCK_REALTIME in ns since the epoch
+  float vmon; // V
+  float imon; // uA
+  uint32_t status; // channel status word
+  uint16_t bd;
+  uint16_t ch;
+
+};
+static_assert(sizeof(N1470Record) == 24, "N1470Record is part of the file format");
+
+// Start of every segment file. The records follow it directly.
+struct N1470RecordHeader{
+
+  char magic[8]; // "N1470REC"
+  uint32_t version; // REC_VERSION_N1470
+  uint32_t record_size; // sizeof(N1470Record)
+  uint64_t segment; // index in the file name
+  uint64_t capacity; // records the file has room for
+  uint64_t count; // records committed; readers never look past this
+  int64_t first_ns; // time of the first record, 0 if none
+  int64_t last_ns; // time of the last committed record
+  uint64_t reserved;
+
+};
+static_assert(sizeof(N1470RecordHeader) == 64, "N1470RecordHeader is part of the file format");
+
+// Appends samples to memory-mapped segment files <prefix>.NNNNNN.n1470.
+//
+// Samples are copied straight into the mapping. The record count in the
+// header is committed every REC_BATCH_N1470 records, on flush() and on close,
+// so a reader, even a live one in another process, only ever sees whole
+// records. A full segment is trimmed to its records and the next one started.
+// Records are expected in time order, which the reader relies on to seek.
+
+class N1470Recorder{
+
+ private:
+
+  std::mutex mutex_;
+  std::string prefix_;
+  unsigned long segment_records_;
+
+  int fd_;
+  N1470RecordHeader *header_; // the mapped segment, NULL if none open
+  N1470Record *records_;
+  uint64_t segment_;
+  uint64_t written_; // records in the current segment, committed or not
+
+  // Maps a fresh segment. Called with mutex_ held. Returns 0 on success.
+  int openSegment();
+  // Commits, trims and unmaps the current segment. Called with mutex_ held.
+  void closeSegment();
+  // Publishes written_ as the header count. Called with mutex_ held.
+  void commit();
+
+ public:
+
+  N1470Recorder();
+  ~N1470Recorder();
+
+  // Starts recording into segments named after prefix, after any segments
+  // already there. Returns 0 on success.
+  int open(const char *prefix, unsigned long recordsPerSegment = REC_SEGMENT_RECORDS);
+  void close();
+
+  // Appends one sample. Returns 0 on success.
+  int record(const N1470Record &);
+  // Appends the CH_MAX channels of a snapshot of board bd
+  int record(int bd, const N1470Snapshot &);
+  // Commits what has been written so far and schedules it for writeback
+  int flush();
+
+};
+
+// Reads the segments a recorder wrote, mapping each in turn.
+
+class N1470RecordReader{
+
+ private:
+
+  std::vector<std::string> files_; // segment files in order
+
+ public:
+
+  // Collects the segments of prefix. Returns how many there are, negative
+  // if the directory cannot be read.
+  int open(const char *prefix);
+
+  // Calls visit with each run of records between from_ns and to_ns
+  // (inclusive), oldest first, straight from the mapped files. Segments
+  // outside the range are skipped by their header and the ends of the range
+  // found by binary search. Returns the number of records visited.
+  uint64_t scan(int64_t from_ns, int64_t to_ns, std::function<void(const N1470Record *, size_t)> visit);
+
+  // Same over everything recorded
+  uint64_t scan(std::function<void(const N1470Record *, size_t)> visit){ return scan(INT64_MIN, INT64_MAX, visit); }
+
+};
+
+#endif
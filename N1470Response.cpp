@@ -0,0 +1,133 @@
+#include "N1470Response.h"
+
+#include <charconv>
+
+// Reads an integer field value, -1 if it is not a number
+static int toInt(std::string_view value){
+
+  int number;
+
+  if (std::from_chars(value.data(), value.data() + value.size(), number).ec != std::errc())
+    return -1;
+
+  return number;
+}
+
+// Fills result->values from a VAL field: one number, a;b;c;d or the polarity signs
+static void readValues(std::string_view value, N1470Response *result){
+
+  const char *p = value.data();
+  const char *end = p + value.size();
+
+  while (p < end && result->nValues < VAL_MAX_N1470){
+
+    // A polarity is a sign alone, one per channel for CH:4
+    if ((*p == '+' || *p == '-') && (p + 1 == end || p[1] == ';')){
+      result->values[result->nValues++] = (*p == '+') ? 1 : -1;
+      if (p + 1 == end)
+	break;
+      p += 2;
+      continue;
+    }
+
+    // from_chars does not take a leading '+'
+    if (*p == '+')
+      p++;
+
+    std::from_chars_result read = std::from_chars(p, end, result->values[result->nValues]);
+
+    // Text values such as BDNAME or PDWN are left in result->text only
+    if (read.ec != std::errc() || (read.ptr != end && *read.ptr != ';')){
+      result->nValues = 0;
+      return;
+    }
+
+    result->nValues++;
+    if (read.ptr == end)
+      break;
+    p = read.ptr + 1;
+  }
+}
+
+int N1470Response::parse(std::string_view reply, N1470Response *result){
+
+  size_t comma, colon;
+  std::string_view field, key, value;
+
+  result->error = ERR_NONE;
+  result->bd = -1;
+  result->ch = -1;
+  result->par = std::string_view();
+  result->text = std::string_view();
+  result->nValues = 0;
+
+  // Drop the \r\n terminator
+  while (!reply.empty() && (reply.back() == '\n' || reply.back() == '\r'))
+    reply.remove_suffix(1);
+
+  if (reply.empty() || reply[0] != '#'){
+    result->error = ERR_FORMAT;
+    return result->error;
+  }
+  reply.remove_prefix(1);
+
+  bool ok = false;
+
+  while (!reply.empty()){
+
+    comma = reply.find(',');
+    field = reply.substr(0, comma);
+    reply = (comma == std::string_view::npos) ? std::string_view() : reply.substr(comma + 1);
+
+    if ((colon = field.find(':')) == std::string_view::npos)
+      continue;
+
+    key = field.substr(0, colon);
+    value = field.substr(colon + 1);
+
+    if (value == "ERR"){
+      if (key == "CMD") result->error = ERR_CMD;
+      else if (key == "CH") result->error = ERR_CH;
+      else if (key == "PAR") result->error = ERR_PAR;
+      else if (key == "VAL") result->error = ERR_VAL;
+      else if (key == "LOC") result->error = ERR_LOC;
+      else result->error = ERR_FORMAT;
+      return result->error;
+    }
+
+    if (key == "BD")
+      result->bd = toInt(value);
+    else if (key == "CMD")
+      ok = (value == "OK");
+    else if (key == "CH")
+      result->ch = toInt(value);
+    else if (key == "PAR")
+      result->par = value;
+    else if (key == "VAL"){
+      result->text = value;
+      readValues(value, result);
+    }
+  }
+
+  if (!ok)
+    result->error = ERR_FORMAT;
+
+  return result->error;
+}
+
+const char * N1470Response::describe(int error){
+
+  switch (error){
+  case ERR_NONE: return "no error";
+  case ERR_CMD: return "wrong command format or command not recognized";
+  case ERR_CH: return "channel field not correct";
+  case ERR_PAR: return "parameter field not correct";
+  case ERR_VAL: return "value out of range";
+  case ERR_LOC: return "command refused, module is in local mode";
+  case ERR_IO: return "link failed or not open";
+  case ERR_TIMEOUT: return "no reply within the deadline";
+  case ERR_ARG: return "channel or value outside the driver's limits";
+  case ERR_ABANDONED: return "dropped by an emergency OFF before it was sent";
+  default: return "reply could not be read";
+  }
+}
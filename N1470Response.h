@@ -0,0 +1,51 @@
+#ifndef N1470RESPONSE_H
+#define N1470RESPONSE_H
+
+#include <string_view>
+
+#define VAL_MAX_N1470 4 // most values in one reply, from a CH:4 request
+
+// What the module rejected, from the field that carries ERR, or why no
+// usable reply came back
+enum N1470Error{
+
+  ERR_NONE = 0,
+  ERR_CMD, // CMD:ERR, wrong command format or command not recognised
+  ERR_CH, // CH:ERR, channel field not correct
+  ERR_PAR, // PAR:ERR, parameter field not correct
+  ERR_VAL, // VAL:ERR, value out of range
+  ERR_LOC, // LOC:ERR, module is in local mode
+  ERR_FORMAT, // reply could not be read at all
+
+  // Failures on this side, before or instead of a reply
+  ERR_IO, // the link failed or is not open
+  ERR_TIMEOUT, // no reply within the deadline
+  ERR_ARG, // channel or value outside the driver's limits, nothing sent
+  ERR_ABANDONED // dropped unsent by an emergency OFF
+
+};
+
+// One reply from the module, parsed in place: par and text are views into
+// the receive buffer and stay valid only as long as it does.
+// Replies look like #BD:01,CMD:OK,VAL:0123.4 or #BD:01,VAL:ERR
+struct N1470Response{
+
+  int error; // ERR_NONE if CMD:OK and nothing rejected
+  int bd; // board that answered, -1 if missing
+  int ch; // channel if the reply carries one, -1 otherwise
+  std::string_view par; // parameter if the reply carries one
+  std::string_view text; // raw VAL field, e.g. "N1470" for BDNAME
+
+  int nValues; // number of numbers in VAL: 0, 1 or VAL_MAX_N1470
+  double values[VAL_MAX_N1470]; // VAL:+ and VAL:- (polarity) read as 1 and -1
+
+  // Parses reply into result without copying or allocating.
+  // Returns result->error.
+  static int parse(std::string_view reply, N1470Response *result);
+
+  // Short description of an error code
+  static const char * describe(int error);
+
+};
+
+#endif
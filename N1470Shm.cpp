@@ -0,0 +1,204 @@
+#include "N1470Shm.h"
+#include "N1470.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <atomic>
+
+static const char SHM_MAGIC[8] = {'N','1','4','7','0','S','H','M'};
+
+// Slot bd of the segment starting at header, stepping by the publisher's slot size
+static N1470ShmSlot * slotOf(const N1470ShmHeader *header, int bd){
+
+  return (N1470ShmSlot *)((char *)header + header->header_size + (size_t)bd * header->slot_size);
+}
+
+
+N1470ShmWriter::N1470ShmWriter() :
+  header_(NULL),
+  size_(0){
+
+  name_[0] = '\0';
+
+};
+
+N1470ShmWriter::~N1470ShmWriter(){
+
+  close();
+
+};
+
+int N1470ShmWriter::open(const char *name){
+
+  void *map;
+  int fd;
+
+  close();
+
+  size_ = sizeof(N1470ShmHeader) + SHM_BOARDS_N1470 * sizeof(N1470ShmSlot);
+  snprintf(name_, sizeof(name_), "%s", name);
+
+  if ((fd = shm_open(name_, O_RDWR | O_CREAT, 0644)) < 0){
+    perror(name_);
+    return -1;
+  }
+
+  if (ftruncate(fd, size_) != 0 || (map = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+    perror(name_);
+    ::close(fd);
+    return -2;
+  }
+  ::close(fd);
+
+  header_ = (N1470ShmHeader *)map;
+
+  // Readers refuse the segment until the magic is written last
+  memset(map, 0, size_);
+  header_->version = SHM_VERSION_N1470;
+  header_->header_size = sizeof(N1470ShmHeader);
+  header_->slot_size = sizeof(N1470ShmSlot);
+  header_->data_size = sizeof(N1470ShmData);
+  header_->n_slots = SHM_BOARDS_N1470;
+  header_->publisher_pid = getpid();
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(header_->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+
+  return 0;
+}
+
+void N1470ShmWriter::close(){
+
+  if (header_ == NULL)
+    return;
+
+  munmap(header_, size_);
+  shm_unlink(name_);
+  header_ = NULL;
+}
+
+void N1470ShmWriter::publish(int bd, const N1470Snapshot &snap){
+
+  N1470ShmData data;
+  uint64_t words[sizeof(N1470ShmData) / sizeof(uint64_t)];
+
+  if (header_ == NULL || bd < 0 || bd >= SHM_BOARDS_N1470)
+    return;
+
+  memset(&data, 0, sizeof(data));
+  data.time_ns = (int64_t)snap.time.tv_sec * 1000000000LL + snap.time.tv_nsec;
+  data.sequence = snap.sequence;
+  for (int ch = 0; ch < SHM_CH_N1470; ch++){
+    data.vmon[ch] = snap.vmon[ch];
+    data.imon[ch] = snap.imon[ch];
+    data.vset[ch] = snap.vset[ch];
+    data.iset[ch] = snap.iset[ch];
+    data.status[ch] = snap.status[ch];
+  }
+  memcpy(words, &data, sizeof(data));
+
+  N1470ShmSlot *slot = slotOf(header_, bd);
+  std::atomic_ref<uint64_t> seq(slot->seqlock);
+  uint64_t before = seq.load(std::memory_order_relaxed);
+
+  seq.store(before + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for (unsigned int word = 0; word < sizeof(words) / sizeof(uint64_t); word++)
+    std::atomic_ref<uint64_t>(slot->words[word]).store(words[word], std::memory_order_relaxed);
+
+  seq.store(before + 2, std::memory_order_release);
+}
+
+
+N1470ShmReader::N1470ShmReader() :
+  header_(NULL),
+  size_(0){
+
+};
+
+N1470ShmReader::~N1470ShmReader(){
+
+  close();
+
+};
+
+int N1470ShmReader::open(const char *name){
+
+  struct stat st;
+  void *map;
+  int fd;
+
+  close();
+
+  if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+    return -1;
+
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(N1470ShmHeader)
+      || (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+    ::close(fd);
+    return -2;
+  }
+  ::close(fd);
+
+  const N1470ShmHeader *header = (const N1470ShmHeader *)map;
+
+  // Same version, and at least the fields this reader knows of
+  if (memcmp(header->magic, SHM_MAGIC, sizeof(SHM_MAGIC)) != 0 || header->version != SHM_VERSION_N1470
+      || header->data_size < sizeof(N1470ShmData) || header->slot_size < sizeof(N1470ShmSlot)
+      || header->n_slots < SHM_BOARDS_N1470
+      || (size_t)st.st_size < header->header_size + (size_t)header->n_slots * header->slot_size){
+    fprintf(stderr,"Shared memory %s does not have a version %d layout\n",name,SHM_VERSION_N1470);
+    munmap(map, st.st_size);
+    return -3;
+  }
+
+  header_ = header;
+  size_ = st.st_size;
+
+  return 0;
+}
+
+void N1470ShmReader::close(){
+
+  if (header_ == NULL)
+    return;
+
+  munmap((void *)header_, size_);
+  header_ = NULL;
+}
+
+uint64_t N1470ShmReader::read(int bd, N1470ShmData *data){
+
+  uint64_t words[sizeof(N1470ShmData) / sizeof(uint64_t)];
+  uint64_t before, after;
+  int tries = 0;
+
+  if (header_ == NULL || bd < 0 || bd >= SHM_BOARDS_N1470)
+    return 0;
+
+  N1470ShmSlot *slot = slotOf(header_, bd);
+  std::atomic_ref<uint64_t> seq(slot->seqlock);
+
+  do {
+
+    // A publisher that died mid-write leaves the slot odd for good
+    if (++tries > SHM_READ_TRIES_N1470)
+      return 0;
+
+    before = seq.load(std::memory_order_acquire);
+
+    for (unsigned int word = 0; word < sizeof(words) / sizeof(uint64_t); word++)
+      words[word] = std::atomic_ref<uint64_t>(slot->words[word]).load(std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    after = seq.load(std::memory_order_relaxed);
+
+  } while ((before & 1) || before != after);
+
+  memcpy(data, words, sizeof(words));
+  return data->sequence;
+}
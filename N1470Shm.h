@@ -0,0 +1,113 @@
+#ifndef N1470SHM_H
+#define N1470SHM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct N1470Snapshot;
+
+#define SHM_NAME_N1470 "/n1470" // default POSIX shared memory object
+#define SHM_VERSION_N1470 1
+#define SHM_BOARDS_N1470 32 // one slot per BD on a daisy chain
+#define SHM_CH_N1470 4
+#define SHM_READ_TRIES_N1470 100000 // attempts at a consistent copy before giving up
+
+// State of one board as published to other processes
+struct N1470ShmData{
+
+  int64_t time_ns; // CLOCK_REALTIME of the sweep in ns since the epoch
+  uint64_t sequence; // Number of the sweep, starting from 1
+  double vmon[SHM_CH_N1470]; // V
+  double imon[SHM_CH_N1470]; // uA
+  double vset[SHM_CH_N1470]; // V
+  double iset[SHM_CH_N1470]; // uA
+  uint32_t status[SHM_CH_N1470]; // channel status words
+
+};
+static_assert(sizeof(N1470ShmData) % sizeof(uint64_t) == 0, "N1470ShmData must be a whole number of 64-bit words");
+
+// One slot, on its own cache lines so that boards do not share them.
+// seqlock is odd while the publisher is writing; data is stored as 64-bit
+// words so that readers never race a half-written word.
+struct alignas(64) N1470ShmSlot{
+
+  uint64_t seqlock;
+  uint64_t words[sizeof(N1470ShmData) / sizeof(uint64_t)];
+
+};
+
+// Start of the segment, followed by SHM_BOARDS_N1470 slots indexed by BD.
+// The version changes when fields move; fields are only ever added at the
+// end of N1470ShmData, and slot_size tells readers how far apart slots are.
+struct alignas(64) N1470ShmHeader{
+
+  char magic[8]; // "N1470SHM"
+  uint32_t version; // SHM_VERSION_N1470
+  uint32_t header_size; // sizeof(N1470ShmHeader)
+  uint32_t slot_size; // sizeof(N1470ShmSlot) of the publisher
+  uint32_t data_size; // sizeof(N1470ShmData) of the publisher
+  uint32_t n_slots; // SHM_BOARDS_N1470
+  uint32_t reserved;
+  uint64_t publisher_pid; // process that owns the device
+
+};
+
+// The owner of the device publishes each board's snapshots into a POSIX
+// shared memory segment. N1470::setSharedStatus() does this from the poller.
+
+class N1470ShmWriter{
+
+ private:
+
+  char name_[64];
+  N1470ShmHeader *header_;
+  size_t size_;
+
+ public:
+
+  N1470ShmWriter();
+  ~N1470ShmWriter();
+
+  // Creates (or takes over) the segment. Returns 0 on success.
+  int open(const char *name = SHM_NAME_N1470);
+  // Unmaps and removes the segment
+  void close();
+
+  // Publishes the state of board bd. Only one thread may publish a given
+  // board at a time, which the board's own publish lock ensures.
+  void publish(int bd, const N1470Snapshot &);
+
+};
+
+// Any number of readers, in any process, copy consistent board states out
+// of the segment with plain memory reads.
+
+class N1470ShmReader{
+
+ private:
+
+  const N1470ShmHeader *header_;
+  size_t size_;
+
+ public:
+
+  N1470ShmReader();
+  ~N1470ShmReader();
+
+  // Maps the segment read-only. Returns 0 on success, negative if it does
+  // not exist or has a layout this reader does not understand.
+  int open(const char *name = SHM_NAME_N1470);
+  void close();
+
+  // Copies the latest state of board bd. Returns its sequence number, 0 if
+  // the board has never been published or no consistent copy could be made.
+  uint64_t read(int bd, N1470ShmData *);
+
+  // Process that publishes the segment
+  pid_t getPublisher(){ return header_ ? header_->publisher_pid : 0; }
+
+};
+
+#endif
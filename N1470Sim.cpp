@@ -0,0 +1,546 @@
+#include "N1470Sim.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+N1470Sim::N1470Sim(unsigned long boardMask) :
+  last_update_(std::chrono::steady_clock::now()),
+  latency_us_(SIM_LATENCY_US),
+  baud_(SIM_BAUD),
+  host_baud_(0),
+  line_free_(std::chrono::steady_clock::now()),
+  interrupted_(false),
+  pty_fd_(-1),
+  pty_slave_fd_(-1),
+  serving_(false){
+
+  for (int bd = 0; bd < SIM_BD_MAX; bd++){
+
+    Board &board = boards_[bd];
+
+    board.present = (boardMask >> bd) & 0x1;
+    board.ilk_closed = true;
+    board.interlock = false;
+    board.killed = false;
+
+    // Power-on settings of a module fresh from the factory
+    for (int ch = 0; ch < SIM_CH_MAX; ch++){
+
+      Channel &c = board.ch[ch];
+
+      c.vset = 0;
+      c.iset = 1000;
+      c.vmax = 8000;
+      c.trip = 10;
+      c.rup = 50;
+      c.rdw = 50;
+      c.kill = false;
+      c.on = false;
+      c.polarity = 1;
+      c.load = 100;
+      c.vmon = 0;
+      c.imon = 0;
+      c.overcurrent = 0;
+      c.tripped = false;
+      c.ramp = 0;
+    }
+  }
+
+};
+
+N1470Sim::~N1470Sim(){
+
+  closePty();
+
+};
+
+
+void N1470Sim::update(std::chrono::steady_clock::time_point now){
+
+  double dt = std::chrono::duration<double>(now - last_update_).count();
+  last_update_ = now;
+
+  if (dt <= 0)
+    return;
+
+  for (int bd = 0; bd < SIM_BD_MAX; bd++){
+
+    Board &board = boards_[bd];
+    if (!board.present)
+      continue;
+
+    bool interlocked = (board.interlock == board.ilk_closed);
+
+    for (int ch = 0; ch < SIM_CH_MAX; ch++){
+
+      Channel &c = board.ch[ch];
+
+      // Front panel KILL and the interlock switch the output off at once
+      if (board.killed || interlocked){
+	c.on = false;
+	c.vmon = 0;
+      }
+
+      double target = c.on ? (c.vset < c.vmax ? c.vset : c.vmax) : 0;
+
+      if (c.vmon < target){
+	c.vmon += c.rup * dt;
+	c.ramp = 1;
+	if (c.vmon >= target){
+	  c.vmon = target;
+	  c.ramp = 0;
+	}
+      }
+      else if (c.vmon > target){
+	c.vmon -= c.rdw * dt;
+	c.ramp = -1;
+	if (c.vmon <= target){
+	  c.vmon = target;
+	  c.ramp = 0;
+	}
+      }
+      else
+	c.ramp = 0;
+
+      c.imon = c.vmon / c.load;
+
+      // Over ISET for longer than TRIP seconds trips the channel
+      if (c.on && c.imon > c.iset){
+	c.overcurrent += dt;
+	if (c.overcurrent >= c.trip){
+	  c.on = false;
+	  c.tripped = true;
+	  c.overcurrent = 0;
+	  if (c.kill){
+	    c.vmon = 0;
+	    c.imon = 0;
+	  }
+	}
+      }
+      else
+	c.overcurrent = 0;
+    }
+  }
+}
+
+int N1470Sim::status(const Board &board, const Channel &c){
+
+  int stat = 0;
+
+  if (c.on) stat |= 1 << 0;
+  if (c.ramp > 0) stat |= 1 << 1;
+  if (c.ramp < 0) stat |= 1 << 2;
+  if (c.on && c.imon > c.iset) stat |= 1 << 3;
+  // Only once the ramp is over, as on the module; a VSET above MAXV ends there
+  if (c.on && c.ramp == 0 && c.vmon > c.vset + SIM_VTOL) stat |= 1 << 4;
+  if (c.on && c.ramp == 0 && c.vmon < c.vset - SIM_VTOL) stat |= 1 << 5;
+  if (c.on && c.vmon >= c.vmax) stat |= 1 << 6;
+  if (c.tripped) stat |= 1 << 7;
+  if (board.killed) stat |= 1 << 11;
+  if (board.interlock == board.ilk_closed) stat |= 1 << 12;
+
+  return stat;
+}
+
+std::string N1470Sim::monitorChannel(const Channel &c, const std::string &par){
+
+  char text[16];
+
+  if (par == "VSET") snprintf(text, sizeof(text), "%06.1f", c.vset);
+  else if (par == "ISET") snprintf(text, sizeof(text), "%07.2f", c.iset);
+  else if (par == "MAXV") snprintf(text, sizeof(text), "%04.0f", c.vmax);
+  else if (par == "RUP") snprintf(text, sizeof(text), "%03d", c.rup);
+  else if (par == "RDW") snprintf(text, sizeof(text), "%03d", c.rdw);
+  else if (par == "TRIP") snprintf(text, sizeof(text), "%06.1f", c.trip);
+  else if (par == "PDWN") snprintf(text, sizeof(text), "%s", c.kill ? "KILL" : "RAMP");
+  else if (par == "POL") snprintf(text, sizeof(text), "%s", c.polarity > 0 ? "+" : "-");
+  else if (par == "VMON") snprintf(text, sizeof(text), "%06.1f", c.vmon);
+  else if (par == "IMON") snprintf(text, sizeof(text), "%07.2f", c.imon);
+  else
+    return std::string();
+
+  return text;
+}
+
+bool N1470Sim::setChannel(Channel &c, const std::string &par, const std::string &value, bool hasValue){
+
+  double v = hasValue ? atof(value.c_str()) : 0;
+
+  if (par == "ON"){
+    c.on = true;
+    c.tripped = false;
+    return true;
+  }
+  if (par == "OFF"){
+    c.on = false;
+    return true;
+  }
+
+  if (!hasValue)
+    return false;
+
+  if (par == "VSET"){ if (v < 0 || v > c.vmax) return false; c.vset = v; }
+  else if (par == "ISET"){ if (v < 0 || v > 3000) return false; c.iset = v; }
+  else if (par == "MAXV"){ if (v < 0 || v > 8100) return false; c.vmax = v; }
+  else if (par == "RUP"){ if (v < 1 || v > 500) return false; c.rup = (int)v; }
+  else if (par == "RDW"){ if (v < 1 || v > 500) return false; c.rdw = (int)v; }
+  else if (par == "TRIP"){ if (v < 0 || v > 1000) return false; c.trip = v; }
+  else if (par == "PDWN"){
+    if (value == "KILL") c.kill = true;
+    else if (value == "RAMP") c.kill = false;
+    else return false;
+  }
+  else
+    return false;
+
+  return true;
+}
+
+std::string N1470Sim::execute(const std::string &command){
+
+  std::string bdField, cmd, chField, par, value;
+  bool hasCh = false, hasValue = false;
+  size_t start = 0, comma, colon;
+  char head[16];
+
+  // Split $BD:xx,CMD:xxx,CH:x,PAR:xxx,VAL:xxx into its fields
+  while (start < command.size()){
+
+    comma = command.find(',', start);
+    if (comma == std::string::npos)
+      comma = command.size();
+
+    std::string field = command.substr(start, comma - start);
+    start = comma + 1;
+
+    if ((colon = field.find(':')) == std::string::npos)
+      continue;
+
+    std::string key = field.substr(0, colon);
+    std::string val = field.substr(colon + 1);
+
+    if (key == "$BD") bdField = val;
+    else if (key == "CMD") cmd = val;
+    else if (key == "CH"){ chField = val; hasCh = true; }
+    else if (key == "PAR") par = val;
+    else if (key == "VAL"){ value = val; hasValue = true; }
+  }
+
+  if (bdField.empty())
+    return std::string();
+
+  int bd = atoi(bdField.c_str());
+  if (bd < 0 || bd >= SIM_BD_MAX || !boards_[bd].present)
+    return std::string(); // nobody at that address
+
+  Board &board = boards_[bd];
+  snprintf(head, sizeof(head), "#BD:%02d", bd);
+  std::string reply = head;
+
+  if (cmd != "MON" && cmd != "SET")
+    return reply + ",CMD:ERR";
+
+  // Board level parameters
+  if (!hasCh){
+
+    if (cmd == "MON"){
+      if (par == "BDNAME") return reply + ",CMD:OK,VAL:N1470";
+      if (par == "BDNCH") return reply + ",CMD:OK,VAL:4";
+      if (par == "BDILKM") return reply + ",CMD:OK,VAL:" + (board.ilk_closed ? "CLOSED" : "OPEN");
+      return reply + ",PAR:ERR";
+    }
+
+    if (par == "BDCLR"){
+      for (int ch = 0; ch < SIM_CH_MAX; ch++)
+	board.ch[ch].tripped = false;
+      return reply + ",CMD:OK";
+    }
+    if (par == "BDILKM"){
+      if (value == "OPEN") board.ilk_closed = false;
+      else if (value == "CLOSED") board.ilk_closed = true;
+      else return reply + ",VAL:ERR";
+      return reply + ",CMD:OK";
+    }
+    return reply + ",PAR:ERR";
+  }
+
+  int ch = atoi(chField.c_str());
+  if (chField.empty() || ch < 0 || ch > SIM_CH_MAX)
+    return reply + ",CH:ERR";
+
+  int first = (ch == SIM_CH_MAX) ? 0 : ch;
+  int last = (ch == SIM_CH_MAX) ? SIM_CH_MAX - 1 : ch;
+
+  if (cmd == "MON"){
+
+    std::string values;
+
+    for (int c = first; c <= last; c++){
+
+      std::string one;
+      if (par == "STAT"){
+	char stat[8];
+	snprintf(stat, sizeof(stat), "%05d", status(board, board.ch[c]));
+	one = stat;
+      }
+      else
+	one = monitorChannel(board.ch[c], par);
+
+      if (one.empty())
+	return reply + ",PAR:ERR";
+
+      if (c != first)
+	values += ";";
+      values += one;
+    }
+
+    return reply + ",CMD:OK,VAL:" + values;
+  }
+
+  // Check the whole command before touching any channel
+  for (int c = first; c <= last; c++){
+    Channel check = board.ch[c];
+    if (!setChannel(check, par, value, hasValue)){
+      if (par != "VSET" && par != "ISET" && par != "MAXV" && par != "RUP" && par != "RDW"
+	  && par != "TRIP" && par != "PDWN" && par != "ON" && par != "OFF")
+	return reply + ",PAR:ERR";
+      return reply + ",VAL:ERR";
+    }
+  }
+
+  for (int c = first; c <= last; c++)
+    setChannel(board.ch[c], par, value, hasValue);
+
+  return reply + ",CMD:OK";
+}
+
+std::chrono::microseconds N1470Sim::lineTime(size_t n){
+
+  // 8N1 framing: ten bits per byte
+  if (baud_ <= 0)
+    return std::chrono::microseconds(0);
+
+  return std::chrono::microseconds((long)(n * 10 * 1000000L / baud_));
+}
+
+void N1470Sim::release(std::chrono::steady_clock::time_point now){
+
+  while (!replies_.empty() && replies_.front().ready <= now){
+    output_ += replies_.front().text;
+    replies_.pop_front();
+  }
+}
+
+
+void N1470Sim::setLoad(int bd, int ch, double mohm){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (bd >= 0 && bd < SIM_BD_MAX && ch >= 0 && ch < SIM_CH_MAX && mohm > 0)
+    boards_[bd].ch[ch].load = mohm;
+}
+
+void N1470Sim::setPolarity(int bd, int ch, int polarity){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (bd >= 0 && bd < SIM_BD_MAX && ch >= 0 && ch < SIM_CH_MAX)
+    boards_[bd].ch[ch].polarity = (polarity < 0) ? -1 : 1;
+}
+
+void N1470Sim::setKill(int bd, bool killed){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (bd >= 0 && bd < SIM_BD_MAX){
+    update(std::chrono::steady_clock::now());
+    boards_[bd].killed = killed;
+  }
+}
+
+void N1470Sim::setInterlockInput(int bd, bool closed){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (bd >= 0 && bd < SIM_BD_MAX){
+    update(std::chrono::steady_clock::now());
+    boards_[bd].interlock = closed;
+  }
+}
+
+
+int N1470Sim::write(const char *data, size_t length){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  size_t end;
+
+  // At the wrong speed the bytes are garbled beyond recognition
+  if (host_baud_ != 0 && host_baud_ != baud_)
+    return length;
+
+  input_.append(data, length);
+
+  while ((end = input_.find("\r\n")) != std::string::npos){
+
+    std::string command = input_.substr(0, end);
+    input_.erase(0, end + 2);
+
+    // The command has to arrive before the board can think about it
+    std::chrono::steady_clock::time_point arrived = now + lineTime(end + 2);
+
+    update(now);
+    std::string reply = execute(command);
+    if (reply.empty())
+      continue;
+    reply += "\r\n";
+
+    // Replies share the line, so each starts after the previous one is out
+    std::chrono::steady_clock::time_point start = arrived + std::chrono::microseconds(latency_us_);
+    if (start < line_free_)
+      start = line_free_;
+
+    Pending pending;
+    pending.ready = start + lineTime(reply.size());
+    pending.text = reply;
+    line_free_ = pending.ready;
+    replies_.push_back(pending);
+  }
+
+  ready_cv_.notify_all();
+  return length;
+}
+
+int N1470Sim::read(char *buf, size_t length, int timeoutMs){
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+  std::chrono::steady_clock::time_point now;
+
+  while (1){
+
+    now = std::chrono::steady_clock::now();
+    release(now);
+
+    if (!output_.empty() || now >= deadline || interrupted_)
+      break;
+
+    if (!replies_.empty() && replies_.front().ready < deadline)
+      ready_cv_.wait_until(lock, replies_.front().ready);
+    else
+      ready_cv_.wait_until(lock, deadline);
+  }
+
+  interrupted_ = false;
+
+  size_t n = (output_.size() < length) ? output_.size() : length;
+  memcpy(buf, output_.data(), n);
+  output_.erase(0, n);
+
+  return n;
+}
+
+size_t N1470Sim::available(){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  release(std::chrono::steady_clock::now());
+  return output_.size();
+}
+
+void N1470Sim::interrupt(){
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  interrupted_ = true;
+  ready_cv_.notify_all();
+}
+
+
+int N1470Sim::openPty(std::string *slaveName){
+
+  struct termios tio;
+
+  closePty();
+
+  if ((pty_fd_ = posix_openpt(O_RDWR | O_NOCTTY)) < 0){
+    perror("posix_openpt");
+    return -1;
+  }
+
+  if (grantpt(pty_fd_) != 0 || unlockpt(pty_fd_) != 0){
+    perror("grantpt");
+    ::close(pty_fd_);
+    pty_fd_ = -1;
+    return -2;
+  }
+
+  *slaveName = ptsname(pty_fd_);
+
+  // Raw bytes both ways, as on the module's serial port
+  if (tcgetattr(pty_fd_, &tio) == 0){
+    cfmakeraw(&tio);
+    tcsetattr(pty_fd_, TCSANOW, &tio);
+  }
+
+  // Holding the slave open ourselves keeps the master from reporting a hangup
+  // while no client is connected
+  pty_slave_fd_ = ::open(slaveName->c_str(), O_RDWR | O_NOCTTY);
+
+  serving_ = true;
+  pty_thread_ = std::thread(&N1470Sim::ptyLoop, this);
+
+  return 0;
+}
+
+void N1470Sim::closePty(){
+
+  serving_ = false;
+
+  if (pty_thread_.joinable())
+    pty_thread_.join();
+
+  if (pty_slave_fd_ >= 0)
+    ::close(pty_slave_fd_);
+  if (pty_fd_ >= 0)
+    ::close(pty_fd_);
+
+  pty_slave_fd_ = -1;
+  pty_fd_ = -1;
+}
+
+void N1470Sim::ptyLoop(){
+
+  char buf[256];
+  struct pollfd pfd;
+  int timeoutMs, n;
+
+  pfd.fd = pty_fd_;
+  pfd.events = POLLIN;
+
+  while (serving_){
+
+    // Wake for the next reply that is due, or at least every 100 ms to notice closePty
+    timeoutMs = 100;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!replies_.empty()){
+	long ms = std::chrono::duration_cast<std::chrono::milliseconds>(replies_.front().ready - std::chrono::steady_clock::now()).count();
+	timeoutMs = (ms < 0) ? 0 : (ms < timeoutMs ? ms + 1 : timeoutMs);
+      }
+    }
+
+    if (poll(&pfd, 1, timeoutMs) > 0 && (pfd.revents & POLLIN)){
+      if ((n = ::read(pty_fd_, buf, sizeof(buf))) > 0)
+	write(buf, n);
+    }
+
+    if ((n = read(buf, sizeof(buf), 0)) > 0){
+      if (::write(pty_fd_, buf, n) != n)
+	perror("N1470Sim pty write");
+    }
+  }
+}
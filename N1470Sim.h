@@ -0,0 +1,142 @@
+#ifndef N1470SIM_H
+#define N1470SIM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+#define SIM_BD_MAX 32 // board addresses the simulator can answer for
+#define SIM_CH_MAX 4
+#define SIM_LATENCY_US 2000 // default time a simulated board takes to think
+#define SIM_BAUD 9600 // default simulated line speed
+#define SIM_VTOL 250 // VMON off VSET by more than this sets OVV/UNV
+
+// A simulated daisy chain of N1470 modules speaking the $BD:..,CMD:.. protocol.
+//
+// Each board models VSET/ISET/MAXV/RUP/RDW/TRIP/PDWN and ON/OFF per channel,
+// ramps VMON towards its target at RUP/RDW, draws IMON through a load
+// resistor, trips after TRIP seconds over ISET and reports the status bits of
+// the real module. Replies appear after the configured response latency plus
+// the time the bytes take on the line at the configured baud rate; replies
+// leave one after the other as on the real half-duplex link.
+//
+// Reach it in-process with write()/read(), or through a pseudo-terminal with
+// openPty() so that a serial driver can talk to it like to a tty.
+
+class N1470Sim{
+
+ private:
+
+  struct Channel{
+    double vset, iset, vmax, trip;
+    int rup, rdw;
+    bool kill; // PDWN: true = KILL, false = RAMP
+    bool on;
+    int polarity; // +1 or -1
+    double load; // load resistance in MOhm, IMON = VMON / load
+    double vmon, imon;
+    double overcurrent; // seconds IMON has been above ISET
+    bool tripped;
+    int ramp; // +1 ramping up, -1 ramping down, 0 stable
+  };
+
+  struct Board{
+    bool present;
+    bool ilk_closed; // BDILKM: interlock active when the input is CLOSED
+    bool interlock; // state of the interlock input, true = closed
+    bool killed; // front panel KILL input
+    Channel ch[SIM_CH_MAX];
+  };
+
+  // A reply waiting for its time on the line
+  struct Pending{
+    std::chrono::steady_clock::time_point ready;
+    std::string text;
+  };
+
+  std::mutex mutex_;
+  std::condition_variable ready_cv_;
+
+  Board boards_[SIM_BD_MAX];
+  std::chrono::steady_clock::time_point last_update_;
+
+  long latency_us_;
+  int baud_;
+  int host_baud_; // 0 when the host follows baud_
+  std::chrono::steady_clock::time_point line_free_; // when the line finishes the last reply
+
+  std::string input_; // command bytes not yet terminated by \r\n
+  std::deque<Pending> replies_;
+  std::string output_; // reply bytes that are ready to be read
+  bool interrupted_; // set by interrupt(), ends the next read() early
+
+  // Pseudo-terminal server
+  int pty_fd_;
+  int pty_slave_fd_;
+  std::atomic<bool> serving_;
+  std::thread pty_thread_;
+
+  // Advances ramps, currents and trips of every board to now
+  void update(std::chrono::steady_clock::time_point now);
+  // Carries out one command and returns the reply, without \r\n, or an
+  // empty string if no board answers
+  std::string execute(const std::string &);
+  // Applies a SET to one channel. Returns false if the value is out of range.
+  bool setChannel(Channel &, const std::string &par, const std::string &value, bool hasValue);
+  // Value of one monitored channel parameter, empty if PAR is not known
+  std::string monitorChannel(const Channel &, const std::string &par);
+  // The 14 status bits of a channel
+  int status(const Board &, const Channel &);
+  // Time for n bytes on the line
+  std::chrono::microseconds lineTime(size_t n);
+  // Moves replies whose time has come to output_. Called with mutex_ held.
+  void release(std::chrono::steady_clock::time_point now);
+
+  // Body of the pseudo-terminal thread
+  void ptyLoop();
+
+ public:
+
+  // A chain with the given boards present, as a bit mask of BD addresses
+  N1470Sim(unsigned long boardMask = 0x1);
+  ~N1470Sim();
+
+  // Response latency of every board in microseconds
+  void setLatency(long us){ std::lock_guard<std::mutex> lock(mutex_); latency_us_ = us; }
+  // Line speed in bits per second, 0 for an infinitely fast line
+  void setBaudRate(int baud){ std::lock_guard<std::mutex> lock(mutex_); baud_ = baud; }
+  int getBaudRate(){ std::lock_guard<std::mutex> lock(mutex_); return baud_; }
+  // Line speed the host's UART runs at, 0 to always match the boards. While
+  // the two differ the boards only see garbage and never answer.
+  void setHostBaudRate(int baud){ std::lock_guard<std::mutex> lock(mutex_); host_baud_ = baud; input_.clear(); }
+
+  // Test controls: load resistance in MOhm, polarity, and the front panel inputs
+  void setLoad(int bd, int ch, double mohm);
+  void setPolarity(int bd, int ch, int polarity);
+  void setKill(int bd, bool killed);
+  void setInterlockInput(int bd, bool closed);
+
+  // In-process link. write() takes command bytes as the module would; read()
+  // waits up to timeoutMs for reply bytes and returns how many it copied.
+  int write(const char *, size_t);
+  int read(char *, size_t, int timeoutMs);
+  // Bytes that read() could return right now
+  size_t available();
+  // Makes a read() in progress, or the next one, return at once
+  void interrupt();
+
+  // Serves the chain on a new pseudo-terminal from a background thread.
+  // Fills in the name of the slave side to open. Returns 0 on success.
+  int openPty(std::string *slaveName);
+  void closePty();
+
+};
+
+#endif
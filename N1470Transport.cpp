@@ -0,0 +1,665 @@
+#include "N1470Transport.h"
+#include "N1470Sim.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#include <thread>
+
+N1470Transport * N1470Transport::create(const char *spec){
+
+  std::string s(spec);
+  std::string kind = s.substr(0, s.find(':'));
+  std::string arg = (s.find(':') == std::string::npos) ? std::string() : s.substr(s.find(':') + 1);
+
+#ifndef NO_DEVICE
+  if (kind == "d2xx")
+    return new N1470D2xxTransport(arg.empty() ? 0 : atoi(arg.c_str()));
+  if (kind == "d2xx-serial")
+    return new N1470D2xxTransport(arg.c_str(), FT_OPEN_BY_SERIAL_NUMBER);
+  if (kind == "d2xx-desc")
+    return new N1470D2xxTransport(arg.c_str(), FT_OPEN_BY_DESCRIPTION);
+#endif
+
+  if (kind == "tty" && !arg.empty())
+    return new N1470SerialTransport(arg.c_str());
+
+  if (kind == "tcp" && !arg.empty()){
+    size_t colon = arg.rfind(':');
+    if (colon == std::string::npos)
+      return new N1470TcpTransport(arg.c_str());
+    return new N1470TcpTransport(arg.substr(0, colon).c_str(), atoi(arg.substr(colon + 1).c_str()));
+  }
+
+  if (kind == "sim")
+    return new N1470SimTransport(NULL, arg.empty() ? 0xffffffffUL : strtoul(arg.c_str(), NULL, 0));
+
+  fprintf(stderr,"Unknown or unavailable transport: %s\n",spec);
+  return NULL;
+}
+
+N1470LinkProfile N1470Transport::defaultProfile(){
+
+  N1470LinkProfile profile;
+
+  profile.latency_ms = LATENCY_TIMER_MS_N1470;
+  profile.usb_size = USB_TRANSFER_N1470;
+  profile.read_timeout_ms = READ_TIMEOUT_MS_N1470;
+  profile.write_timeout_ms = WRITE_TIMEOUT_MS_N1470;
+  profile.event_char = true;
+
+  return profile;
+}
+
+
+#ifndef NO_DEVICE
+
+N1470D2xxTransport::N1470D2xxTransport(int deviceIndex) :
+  open_by_(0),
+  index_(deviceIndex),
+  dev_(NULL),
+  rx_interrupt_(false){
+
+  // The driver signals this condition whenever characters arrive
+  pthread_mutex_init(&rx_event_.eMutex, NULL);
+  pthread_cond_init(&rx_event_.eCondVar, NULL);
+
+};
+
+N1470D2xxTransport::N1470D2xxTransport(const char *id, int openBy) :
+  open_by_(openBy),
+  index_(0),
+  id_(id),
+  dev_(NULL),
+  rx_interrupt_(false){
+
+  pthread_mutex_init(&rx_event_.eMutex, NULL);
+  pthread_cond_init(&rx_event_.eCondVar, NULL);
+
+};
+
+N1470D2xxTransport::~N1470D2xxTransport(){
+
+  if (dev_ != NULL)
+    close();
+
+  pthread_cond_destroy(&rx_event_.eCondVar);
+  pthread_mutex_destroy(&rx_event_.eMutex);
+
+};
+
+int N1470D2xxTransport::open(){
+
+  unsigned long ret;
+
+  if (open_by_ == 0){
+    if ((ret = FT_Open(index_, &dev_)) != FT_OK){
+      PRINT_ERR("FT_Open", ret);
+      dev_ = NULL;
+      return -1;
+    }
+  }
+  else if ((ret = FT_OpenEx((PVOID)id_.c_str(), open_by_, &dev_)) != FT_OK){
+    PRINT_ERR("FT_OpenEx", ret);
+    dev_ = NULL;
+    return -1;
+  }
+
+  if ((ret = FT_SetBaudRate(dev_, BAUD_N1470)) != FT_OK){
+    PRINT_ERR("FT_SetBaudRate",ret);
+    return -2;
+  }
+
+  if ((ret = FT_SetDataCharacteristics(dev_, FT_BITS_8, FT_STOP_BITS_1, FT_PARITY_NONE )) != FT_OK){
+    PRINT_ERR("FT_SetDataCharacteristics",ret);
+    return -3;
+  }
+
+  if ((ret = FT_Purge(dev_, (FT_PURGE_RX | FT_PURGE_TX))) != FT_OK){
+    PRINT_ERR("FT_Purge", ret);
+    return -4;
+  }
+
+  // Wake receive() as soon as characters come in instead of sleeping blind
+  if ((ret = FT_SetEventNotification(dev_, FT_EVENT_RXCHAR, (PVOID)&rx_event_)) != FT_OK){
+    PRINT_ERR("FT_SetEventNotification", ret);
+    return -5;
+  }
+
+  return 0;
+}
+
+int N1470D2xxTransport::setBaudRate(int baud){
+
+  unsigned long ret;
+
+  if (dev_ == NULL)
+    return -1;
+
+  if ((ret = FT_SetBaudRate(dev_, baud)) != FT_OK){
+    PRINT_ERR("FT_SetBaudRate",ret);
+    return -2;
+  }
+
+  if ((ret = FT_Purge(dev_, (FT_PURGE_RX | FT_PURGE_TX))) != FT_OK){
+    PRINT_ERR("FT_Purge", ret);
+    return -3;
+  }
+
+  return 0;
+}
+
+int N1470D2xxTransport::tune(const N1470LinkProfile &profile){
+
+  unsigned long ret;
+
+  if (dev_ == NULL)
+    return -1;
+
+  if ((ret = FT_SetLatencyTimer(dev_, profile.latency_ms)) != FT_OK){
+    PRINT_ERR("FT_SetLatencyTimer", ret);
+    return -2;
+  }
+
+  if ((ret = FT_SetUSBParameters(dev_, profile.usb_size, profile.usb_size)) != FT_OK){
+    PRINT_ERR("FT_SetUSBParameters", ret);
+    return -3;
+  }
+
+  if ((ret = FT_SetTimeouts(dev_, profile.read_timeout_ms, profile.write_timeout_ms)) != FT_OK){
+    PRINT_ERR("FT_SetTimeouts", ret);
+    return -4;
+  }
+
+  // Event character \n, no error character
+  if ((ret = FT_SetChars(dev_, '\n', profile.event_char ? 1 : 0, 0, 0)) != FT_OK){
+    PRINT_ERR("FT_SetChars", ret);
+    return -5;
+  }
+
+  return 0;
+}
+
+std::string N1470D2xxTransport::getSerialNumber(){
+
+  FT_DEVICE type;
+  DWORD id;
+  char serial[64], description[64];
+
+  if (dev_ == NULL || FT_GetDeviceInfo(dev_, &type, &id, serial, description, NULL) != FT_OK)
+    return std::string();
+
+  return serial;
+}
+
+int N1470D2xxTransport::close(){
+
+  unsigned long ret;
+
+  if (dev_ == NULL)
+    return 0;
+
+  if ((ret = FT_Purge(dev_, (FT_PURGE_RX | FT_PURGE_TX))) != FT_OK){
+    PRINT_ERR("FT_Purge", ret);
+    return -1;
+  }
+
+  if ((ret = FT_Close(dev_)) != FT_OK){
+    PRINT_ERR("FT_Close", ret);
+    return -2;
+  }
+
+  dev_ = NULL;
+  return 0;
+}
+
+int N1470D2xxTransport::write(const char *data, int length){
+
+  DWORD bufWrit;
+  unsigned long ret;
+
+  if ((ret = FT_Write(dev_, (LPVOID)data, length, &bufWrit)) != FT_OK){
+    PRINT_ERR("FT_Write", ret);
+    return -1;
+  }
+
+  return bufWrit;
+}
+
+int N1470D2xxTransport::receive(char *buf, int size, int timeoutMs){
+
+  DWORD rxBytes, bufRead;
+  struct timespec deadline;
+  unsigned long ret;
+
+  // pthread_cond_timedwait takes an absolute CLOCK_REALTIME deadline
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeoutMs / 1000;
+  deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L){
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  // The driver signals RXCHAR with the event mutex held, so checking the
+  // queue under the same mutex cannot miss a wakeup
+  pthread_mutex_lock(&rx_event_.eMutex);
+
+  if ((ret = FT_GetQueueStatus(dev_, &rxBytes)) == FT_OK && rxBytes == 0 && !rx_interrupt_ && timeoutMs > 0){
+    pthread_cond_timedwait(&rx_event_.eCondVar, &rx_event_.eMutex, &deadline);
+    ret = FT_GetQueueStatus(dev_, &rxBytes);
+  }
+  rx_interrupt_ = false;
+
+  pthread_mutex_unlock(&rx_event_.eMutex);
+
+  if (ret != FT_OK){
+    PRINT_ERR("FT_GetQueueStatus", ret);
+    return -1;
+  }
+
+  if (rxBytes == 0)
+    return 0;
+
+  if (rxBytes > (DWORD)size)
+    rxBytes = size;
+
+  if ((ret = FT_Read(dev_, buf, rxBytes, &bufRead)) != FT_OK){
+    PRINT_ERR("FT_Read", ret);
+    return -1;
+  }
+
+  return bufRead;
+}
+
+void N1470D2xxTransport::interrupt(){
+
+  pthread_mutex_lock(&rx_event_.eMutex);
+  rx_interrupt_ = true;
+  pthread_cond_signal(&rx_event_.eCondVar);
+  pthread_mutex_unlock(&rx_event_.eMutex);
+}
+
+std::string N1470D2xxTransport::describe(){
+
+  if (open_by_ == 0)
+    return "D2XX device " + std::to_string(index_);
+
+  return "D2XX adapter " + id_;
+}
+
+#endif
+
+
+N1470FdTransport::N1470FdTransport() :
+  fd_(-1){
+
+  wake_[0] = -1;
+  wake_[1] = -1;
+
+};
+
+N1470FdTransport::~N1470FdTransport(){
+
+  close();
+
+};
+
+int N1470FdTransport::open(){
+
+  int ret;
+
+  close();
+
+  if (pipe(wake_) != 0){
+    perror("pipe");
+    return -1;
+  }
+  fcntl(wake_[0], F_SETFL, O_NONBLOCK);
+  fcntl(wake_[1], F_SETFL, O_NONBLOCK);
+
+  if ((ret = connect()) != 0){
+    close();
+    return ret;
+  }
+
+  return 0;
+}
+
+int N1470FdTransport::close(){
+
+  if (fd_ >= 0)
+    ::close(fd_);
+  if (wake_[0] >= 0)
+    ::close(wake_[0]);
+  if (wake_[1] >= 0)
+    ::close(wake_[1]);
+
+  fd_ = -1;
+  wake_[0] = -1;
+  wake_[1] = -1;
+
+  return 0;
+}
+
+int N1470FdTransport::write(const char *data, int length){
+
+  int written = 0, n;
+  struct pollfd pfd;
+
+  pfd.fd = fd_;
+  pfd.events = POLLOUT;
+
+  // The descriptor is non-blocking so that receive() never hangs in read()
+  while (written < length){
+
+    if ((n = ::write(fd_, data + written, length - written)) > 0){
+      written += n;
+      continue;
+    }
+
+    if (n < 0 && errno != EAGAIN && errno != EINTR){
+      perror("N1470 transport write");
+      return -1;
+    }
+
+    poll(&pfd, 1, 100);
+  }
+
+  return written;
+}
+
+int N1470FdTransport::receive(char *buf, int size, int timeoutMs){
+
+  struct pollfd pfd[2];
+  char drain[16];
+  int n;
+
+  pfd[0].fd = fd_;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = wake_[0];
+  pfd[1].events = POLLIN;
+
+  if ((n = poll(pfd, 2, timeoutMs > 0 ? timeoutMs : 0)) < 0){
+    if (errno == EINTR)
+      return 0;
+    perror("poll");
+    return -1;
+  }
+
+  if (pfd[1].revents & POLLIN)
+    while (::read(wake_[0], drain, sizeof(drain)) > 0);
+
+  if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+    return 0;
+
+  if ((n = ::read(fd_, buf, size)) < 0){
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
+    perror("N1470 transport read");
+    return -1;
+  }
+
+  // A closed TCP connection reads as end of file
+  if (n == 0 && (pfd[0].revents & POLLHUP))
+    return -1;
+
+  return n;
+}
+
+void N1470FdTransport::interrupt(){
+
+  char c = 0;
+
+  if (wake_[1] >= 0 && ::write(wake_[1], &c, 1) < 0 && errno != EAGAIN)
+    perror("N1470 transport interrupt");
+}
+
+
+int N1470SerialTransport::connect(){
+
+  struct termios tio;
+
+  if ((fd_ = ::open(path_.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0){
+    perror(path_.c_str());
+    return -1;
+  }
+
+  if (tcgetattr(fd_, &tio) != 0){
+    perror("tcgetattr");
+    return -2;
+  }
+
+  // Raw 8N1 without flow control, reads never wait inside the driver
+  cfmakeraw(&tio);
+  tio.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+  tio.c_cflag |= CS8 | CLOCAL | CREAD;
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, B9600);
+  cfsetospeed(&tio, B9600);
+
+  if (tcsetattr(fd_, TCSANOW, &tio) != 0){
+    perror("tcsetattr");
+    return -3;
+  }
+
+  if (tcflush(fd_, TCIOFLUSH) != 0){
+    perror("tcflush");
+    return -4;
+  }
+
+  return 0;
+}
+
+
+int N1470SerialTransport::setBaudRate(int baud){
+
+  struct termios tio;
+  speed_t speed;
+
+  switch (baud){
+  case 9600: speed = B9600; break;
+  case 19200: speed = B19200; break;
+  case 38400: speed = B38400; break;
+  case 57600: speed = B57600; break;
+  case 115200: speed = B115200; break;
+  default: return -1;
+  }
+
+  if (fd_ < 0 || tcgetattr(fd_, &tio) != 0)
+    return -2;
+
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+
+  if (tcsetattr(fd_, TCSANOW, &tio) != 0 || tcflush(fd_, TCIOFLUSH) != 0){
+    perror("N1470 set baud rate");
+    return -3;
+  }
+
+  return 0;
+}
+
+int N1470SerialTransport::tune(const N1470LinkProfile &profile){
+
+  struct serial_struct serial;
+  char tty[PATH_MAX];
+  std::string sys;
+  FILE *out;
+
+  if (fd_ < 0)
+    return -1;
+
+  // Reads already wake on the first byte: poll() with VMIN and VTIME at 0.
+  // What holds a short reply back is the adapter's latency timer.
+  if (realpath(path_.c_str(), tty) != NULL){
+
+    sys = std::string("/sys/bus/usb-serial/devices/") + basename(tty) + "/latency_timer";
+
+    // Writable by root only, unless a udev rule says otherwise
+    if ((out = fopen(sys.c_str(), "w")) != NULL){
+      bool written = fprintf(out, "%d\n", profile.latency_ms) > 0;
+      if (fclose(out) == 0 && written)
+	return 0;
+    }
+  }
+
+  // ftdi_sio turns low latency into a 1 ms timer; a pty has neither
+  if (ioctl(fd_, TIOCGSERIAL, &serial) != 0)
+    return 1;
+
+  if (profile.latency_ms <= LATENCY_TIMER_MS_N1470)
+    serial.flags |= ASYNC_LOW_LATENCY;
+  else
+    serial.flags &= ~ASYNC_LOW_LATENCY;
+
+  if (ioctl(fd_, TIOCSSERIAL, &serial) != 0){
+    perror("TIOCSSERIAL");
+    return -2;
+  }
+
+  return 0;
+}
+
+std::string N1470SerialTransport::getSerialNumber(){
+
+  char tty[PATH_MAX], device[PATH_MAX];
+  std::string dir, sys;
+  char serial[64];
+  FILE *in;
+
+  if (realpath(path_.c_str(), tty) == NULL)
+    return std::string();
+
+  sys = std::string("/sys/class/tty/") + basename(tty) + "/device";
+  if (realpath(sys.c_str(), device) == NULL)
+    return std::string();
+
+  // Walk up from the tty to the USB device that carries the serial number
+  for (dir = device; dir.size() > strlen("/sys/devices"); dir = dir.substr(0, dir.rfind('/'))){
+
+    if ((in = fopen((dir + "/serial").c_str(), "r")) == NULL)
+      continue;
+
+    if (fgets(serial, sizeof(serial), in) == NULL)
+      serial[0] = '\0';
+    fclose(in);
+
+    serial[strcspn(serial, "\r\n")] = '\0';
+    return serial;
+  }
+
+  return std::string();
+}
+
+
+int N1470TcpTransport::connect(){
+
+  struct addrinfo hints, *found, *ai;
+  std::string port = std::to_string(port_);
+  int one = 1, ret;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if ((ret = getaddrinfo(host_.c_str(), port.c_str(), &hints, &found)) != 0){
+    fprintf(stderr,"Could not resolve %s: %s\n",host_.c_str(),gai_strerror(ret));
+    return -1;
+  }
+
+  for (ai = found; ai != NULL; ai = ai->ai_next){
+
+    if ((fd_ = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+      continue;
+
+    if (::connect(fd_, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+  freeaddrinfo(found);
+
+  if (fd_ < 0){
+    fprintf(stderr,"Could not connect to %s\n",describe().c_str());
+    return -2;
+  }
+
+  // Commands are a few dozen bytes each; send them at once rather than batching
+  setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(fd_, F_SETFL, O_NONBLOCK);
+
+  return 0;
+}
+
+
+N1470SimTransport::N1470SimTransport(N1470Sim *sim, unsigned long boardMask) :
+  sim_(sim ? sim : new N1470Sim(boardMask)),
+  owns_sim_(sim == NULL),
+  tuned_(false){
+
+};
+
+N1470SimTransport::~N1470SimTransport(){
+
+  if (owns_sim_)
+    delete sim_;
+
+};
+
+int N1470SimTransport::write(const char *data, int length){
+
+  return sim_->write(data, length);
+}
+
+int N1470SimTransport::receive(char *buf, int size, int timeoutMs){
+
+  int n = sim_->read(buf, size, timeoutMs > 0 ? timeoutMs : 0);
+
+  if (!tuned_ || n <= 0)
+    return n;
+
+  // The chip sends at once on the event character or a full transfer
+  // (less its two status bytes), otherwise when the latency timer runs out
+  if ((profile_.event_char && memchr(buf, '\n', n) != NULL) || n >= profile_.usb_size - 2)
+    return n;
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(profile_.latency_ms));
+
+  int more = sim_->read(buf + n, size - n, 0);
+  return (more > 0) ? n + more : n;
+}
+
+void N1470SimTransport::interrupt(){
+
+  sim_->interrupt();
+}
+
+int N1470SimTransport::setBaudRate(int baud){
+
+  sim_->setHostBaudRate(baud);
+  return 0;
+}
+
+int N1470SimTransport::tune(const N1470LinkProfile &profile){
+
+  profile_ = profile;
+  tuned_ = true;
+  return 0;
+}
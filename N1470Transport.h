@@ -0,0 +1,235 @@
+#ifndef N1470TRANSPORT_H
+#define N1470TRANSPORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "ftd2xx.h"
+
+#include <string>
+
+class N1470Sim;
+
+#define BAUD_N1470 9600 // line speed of the module's serial port as shipped
+#define BAUD_RATES_N1470 115200, 57600, 38400, 19200, 9600 // speeds the module can be set to, fastest first
+#define LATENCY_TIMER_MS_N1470 2 // FTDI latency timer; the chip's default of 16 ms dominates a short reply
+#define USB_TRANSFER_N1470 64 // USB transfer size in bytes, the smallest, as replies are short
+#define READ_TIMEOUT_MS_N1470 100 // D2XX read and write timeouts
+#define WRITE_TIMEOUT_MS_N1470 1000
+#define TCP_PORT_N1470 4001 // default port of a TCP serial server
+#define PRINT_ERR(name, err) fprintf(stderr,"Function %s failed with error code %lu in line %d of file %s\n", name, err, __LINE__, __FILE__)
+
+// How a USB serial adapter passes bytes on. The FTDI chip holds received
+// bytes until its buffer fills, the latency timer runs out or, if enabled,
+// the event character comes in; every reply ends in \n, so that sends each
+// reply up as soon as it is complete.
+struct N1470LinkProfile{
+
+  int latency_ms; // 1 to 255
+  int usb_size; // transfer size both ways, a multiple of 64
+  int read_timeout_ms;
+  int write_timeout_ms;
+  bool event_char; // flush on \n
+
+};
+
+// The byte pipe between N1470Bus and a daisy chain of modules.
+//
+// The bus only writes commands, waits for reply bytes and occasionally
+// needs to wake a waiting reader, so that is all a transport provides.
+// Pick one at runtime with create(), e.g.
+//   "d2xx:0"              FTDI D2XX, device index 0
+//   "d2xx-serial:A1B2C3"  FTDI D2XX, adapter with that serial number
+//   "d2xx-desc:N1470 USB" FTDI D2XX, adapter with that description
+//   "tty:/dev/ttyUSB0"    kernel serial driver (ftdi_sio) through termios
+//   "tcp:host:4001"       raw TCP serial server
+//   "sim" or "sim:0x3"    in-memory simulated chain, optional board mask
+
+class N1470Transport{
+
+ public:
+
+  virtual ~N1470Transport(){}
+
+  // Opens the link and sets up the line at BAUD_N1470, 8N1.
+  // Returns 0 on success, negative on failure.
+  virtual int open() = 0;
+  // Closes the link, discarding anything not yet read. Returns 0 on success.
+  virtual int close() = 0;
+
+  // Writes all the bytes. Returns the number written, -1 on error.
+  virtual int write(const char *, int) = 0;
+  // Waits up to timeoutMs for bytes and reads what is there into buf.
+  // Returns the number of bytes read, 0 if none came in time or the wait
+  // was interrupted, -1 on error.
+  virtual int receive(char *buf, int size, int timeoutMs) = 0;
+  // Makes a receive() in progress, or the next one, return at once
+  virtual void interrupt() = 0;
+
+  // What the transport is connected to, for messages
+  virtual std::string describe() = 0;
+
+  // Changes the line speed, discarding anything in flight. Returns 0 on
+  // success, negative if the speed is not supported or cannot be changed
+  // from here (a TCP server has its own setting).
+  virtual int setBaudRate(int){ return -1; }
+  // Serial number of the USB adapter, empty if there is none to tell
+  virtual std::string getSerialNumber(){ return std::string(); }
+  // Applies a tuning profile. Returns 0 on success, 1 if the transport
+  // has nothing to tune, which is no failure, negative if tuning failed.
+  virtual int tune(const N1470LinkProfile &){ return 1; }
+
+  // The profile N1470Bus::open applies
+  static N1470LinkProfile defaultProfile();
+
+  // Builds the transport named by spec, unopened. Returns NULL if the spec
+  // is not understood or the transport is not built in.
+  static N1470Transport * create(const char *spec);
+
+};
+
+#ifndef NO_DEVICE
+
+// FTDI D2XX, woken by the driver's RXCHAR event
+class N1470D2xxTransport : public N1470Transport{
+
+ private:
+
+  // How the device is picked: FT_OPEN_BY_SERIAL_NUMBER, FT_OPEN_BY_DESCRIPTION
+  // or 0 for a device index
+  int open_by_;
+  int index_;
+  std::string id_;
+
+  FT_HANDLE dev_;
+  // Signalled by the driver when characters arrive on the device
+  EVENT_HANDLE rx_event_;
+  // Set by interrupt() under the event mutex, cleared by receive()
+  bool rx_interrupt_;
+
+ public:
+
+  N1470D2xxTransport(int deviceIndex);
+  N1470D2xxTransport(const char *id, int openBy);
+  ~N1470D2xxTransport();
+
+  int open();
+  int close();
+  int write(const char *, int);
+  int receive(char *buf, int size, int timeoutMs);
+  void interrupt();
+  std::string describe();
+  int setBaudRate(int);
+  std::string getSerialNumber();
+  int tune(const N1470LinkProfile &);
+
+  // The D2XX handle, NULL if not open
+  FT_HANDLE getDeviceHandle(){ return dev_; }
+
+};
+
+#endif
+
+// Anything reachable as a file descriptor. A self-pipe lets interrupt()
+// break a poll() in progress.
+class N1470FdTransport : public N1470Transport{
+
+ protected:
+
+  int fd_;
+  int wake_[2];
+
+  // Opens fd_ in the derived class. Returns 0 on success.
+  virtual int connect() = 0;
+
+ public:
+
+  N1470FdTransport();
+  ~N1470FdTransport();
+
+  int open();
+  int close();
+  int write(const char *, int);
+  int receive(char *buf, int size, int timeoutMs);
+  void interrupt();
+
+};
+
+// Kernel serial driver, e.g. ftdi_sio's /dev/ttyUSB0, in raw mode
+class N1470SerialTransport : public N1470FdTransport{
+
+ private:
+
+  std::string path_;
+
+ protected:
+
+  int connect();
+
+ public:
+
+  N1470SerialTransport(const char *path) : path_(path){}
+  std::string describe(){ return path_; }
+  int setBaudRate(int);
+  // Read from sysfs, the adapter's USB device being a parent of the tty
+  std::string getSerialNumber();
+  // Sets the latency timer through ftdi_sio's sysfs file, or failing that
+  // asks the driver for ASYNC_LOW_LATENCY. The other fields have no
+  // counterpart here.
+  int tune(const N1470LinkProfile &);
+
+};
+
+// Raw TCP serial server (terminal server or ser2net in raw mode)
+class N1470TcpTransport : public N1470FdTransport{
+
+ private:
+
+  std::string host_;
+  int port_;
+
+ protected:
+
+  int connect();
+
+ public:
+
+  N1470TcpTransport(const char *host, int port = TCP_PORT_N1470) : host_(host), port_(port){}
+  std::string describe(){ return host_ + ":" + std::to_string(port_); }
+
+};
+
+// In-memory loopback to a simulated chain. Once tuned it also holds
+// replies back the way an FTDI adapter with that profile would.
+class N1470SimTransport : public N1470Transport{
+
+ private:
+
+  N1470Sim *sim_;
+  bool owns_sim_;
+  bool tuned_;
+  N1470LinkProfile profile_;
+
+ public:
+
+  // Talks to the given simulator, or to a private one with the boards in
+  // boardMask present if sim is NULL
+  N1470SimTransport(N1470Sim *sim = NULL, unsigned long boardMask = 0xffffffffUL);
+  ~N1470SimTransport();
+
+  int open(){ return 0; }
+  int close(){ return 0; }
+  int write(const char *, int);
+  int receive(char *buf, int size, int timeoutMs);
+  void interrupt();
+  std::string describe(){ return "simulator"; }
+  // Sets the host side of the line; see N1470Sim::setHostBaudRate
+  int setBaudRate(int);
+  int tune(const N1470LinkProfile &);
+
+  N1470Sim * getSimulator(){ return sim_; }
+
+};
+
+#endif
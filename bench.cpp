@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include "N1470Response.h"
+#include "N1470Bus.h"
+#include "N1470Command.h"
+#include "N1470Sim.h"
+#include "N1470Recorder.h"
+
+#include <time.h>
+#include <unistd.h>
+
+// Benchmarks for the N1470 driver that run without a device.
+// Build with "make bench" and run ./bench, or ./bench <transport>... to also
+// time round trips over each transport, e.g. ./bench sim tty:/dev/ttyUSB0 d2xx:0
+
+#define BENCH_ITERATIONS 1000000
+#define BENCH_ROUND_TRIPS 200
+#define BENCH_RECORDS 20000000UL // a week of 4 channels on 8 boards at 1 Hz is 19.4 M
+#define BENCH_RATE_TRIPS 20 // round trips timed at each line speed
+#define BENCH_LOAD_THREADS 4 // threads keeping the link busy during the emergency OFF
+
+static const char *replies_[] = {
+  "#BD:01,CMD:OK,VAL:0123.4\r\n",
+  "#BD:01,CMD:OK,VAL:-\r\n",
+  "#BD:01,CMD:OK,VAL:00001\r\n",
+  "#BD:01,CMD:OK\r\n"
+};
+#define N_REPLIES 4
+
+// The parser the driver used before N1470Response: heap string per reply,
+// find scans, a substr copy and sscanf
+static int legacyParse(std::string *response, double *value){
+
+  int loc = response->find("OK");
+  if (loc == -1)
+    return -9;
+
+  if (response->find("VAL:+\r\n",0,5) != std::string::npos){
+    *value = 1;
+    return 0;
+  }
+  else if (response->find("VAL:-\r\n",0,5) != std::string::npos){
+    *value = -1;
+    return 0;
+  }
+
+  if (sscanf(response->substr(loc).c_str(),"OK,VAL:%lf",value) != 1)
+    return -2;
+
+  return 0;
+}
+
+static double nsPerCall(std::chrono::steady_clock::time_point start){
+
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / BENCH_ITERATIONS;
+
+}
+
+static void benchParse(){
+
+  std::chrono::steady_clock::time_point start;
+  N1470Response result;
+  double value, sum = 0;
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ITERATIONS; i++){
+    std::string *response = new std::string(replies_[i % N_REPLIES]);
+    if (legacyParse(response, &value) == 0)
+      sum += value;
+    delete(response);
+  }
+  printf("%-32s %6.1f ns per response\n", "parse, string/find/sscanf:", nsPerCall(start));
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ITERATIONS; i++){
+    if (N1470Response::parse(replies_[i % N_REPLIES], &result) == ERR_NONE && result.nValues > 0)
+      sum += result.values[0];
+  }
+  printf("%-32s %6.1f ns per response\n", "parse, string_view/from_chars:", nsPerCall(start));
+
+  // Keep the compiler from dropping the loops
+  if (sum == 0.5)
+    printf("%g\n", sum);
+}
+
+// Round trips of a short BDNAME request to board 0 over one transport
+static void benchTransport(const char *spec){
+
+  N1470Bus bus;
+  std::string response;
+  std::chrono::steady_clock::time_point start;
+  double best = 1e9, us;
+  int failed = 0;
+
+  if (bus.open(spec) != 0){
+    fprintf(stderr,"Could not open %s\n",spec);
+    return;
+  }
+
+  double total = 0;
+  for (int i = 0; i < BENCH_ROUND_TRIPS; i++){
+    response.clear();
+    start = std::chrono::steady_clock::now();
+    if (bus.transaction(0, "$BD:0,CMD:MON,PAR:BDNAME\r\n", &response) != 0)
+      failed++;
+    us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    total += us;
+    if (us < best)
+      best = us;
+  }
+
+  printf("%-32s %8.1f us mean, %8.1f us best, %d failed\n", spec, total / BENCH_ROUND_TRIPS, best, failed);
+
+  bus.close();
+}
+
+// Latency and throughput of board 0 at each line speed the module can be set
+// to. On the simulator the boards follow the host; on a real link only the
+// speed set on the module's front panel answers. Then lets the bus find
+// that speed by itself.
+static void benchBaud(const char *spec){
+
+  static const int rates[] = {BAUD_RATES_N1470};
+  N1470Bus bus;
+  std::string response;
+  std::chrono::steady_clock::time_point start;
+  char name[CMD_SIZE_N1470], vmon[CMD_SIZE_N1470];
+  double us, total, seconds;
+  int failed;
+
+  if (bus.open(spec) != 0){
+    fprintf(stderr,"Could not open %s\n",spec);
+    return;
+  }
+
+  N1470Command::boardMonitor(name, 0, PAR_BDNAME);
+  N1470Command::monitor(vmon, 0, 4, PAR_VMON);
+
+  for (unsigned int i = 0; i < sizeof(rates) / sizeof(rates[0]); i++){
+
+    if (bus.getSimulator() != NULL)
+      bus.getSimulator()->setBaudRate(rates[i]);
+
+    if (bus.setBaudRate(rates[i]) != 0){
+      printf("%-24s %6d baud: cannot be set\n", spec, rates[i]);
+      continue;
+    }
+
+    total = 0;
+    failed = 0;
+    for (int j = 0; j < BENCH_RATE_TRIPS; j++){
+      response.clear();
+      start = std::chrono::steady_clock::now();
+      if (bus.transaction(0, name, &response, BAUD_PROBE_TIMEOUT_MS_N1470) != 0)
+	failed++;
+      total += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    }
+    us = total / BENCH_RATE_TRIPS;
+
+    start = std::chrono::steady_clock::now();
+    for (int j = 0; j < BENCH_RATE_TRIPS; j++){
+      response.clear();
+      if (bus.transaction(0, vmon, &response, BAUD_PROBE_TIMEOUT_MS_N1470) != 0)
+	failed++;
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%-24s %6d baud: %8.1f us BDNAME, %6.1f CH:4 VMON reads/s, %d failed\n", spec, rates[i], us, BENCH_RATE_TRIPS / seconds, failed);
+  }
+
+  // The simulated boards stay at 38400 while the host starts over at 9600
+  if (bus.getSimulator() != NULL){
+    bus.getSimulator()->setBaudRate(38400);
+    bus.setBaudRate(BAUD_N1470);
+  }
+
+  start = std::chrono::steady_clock::now();
+  int found = bus.negotiateBaudRate(0, NULL);
+  printf("%-24s negotiated %d baud in %.0f ms\n", spec, found, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+  bus.close();
+}
+
+// Emergency OFF of a full simulated chain of BD_MAX boards while other
+// threads keep the link busy, the worst case short of boards not answering
+static void benchEmergency(bool pipelined){
+
+  N1470Bus bus;
+  std::vector<std::thread> load;
+  std::atomic<bool> running(true);
+  double ms;
+
+  if (bus.open("sim:0xffffffff") != 0){
+    fprintf(stderr,"Could not open the simulator\n");
+    return;
+  }
+  if (pipelined)
+    bus.startPipeline();
+
+  for (int bd = 0; bd < BD_MAX; bd++)
+    bus.board(bd);
+
+  for (int i = 0; i < BENCH_LOAD_THREADS; i++)
+    load.push_back(std::thread([&bus, &running, i]{
+      char cmd[CMD_SIZE_N1470];
+      N1470Command::monitor(cmd, i, 4, PAR_VMON);
+      while (running)
+	bus.submit(i, cmd).get();
+    }));
+
+  usleep(200000);
+  int missing = bus.emergencyOff(&ms);
+  running = false;
+
+  for (unsigned int i = 0; i < load.size(); i++)
+    load[i].join();
+
+  printf("%-32s %8.1f ms for %d boards, %d not acknowledged\n", pipelined ? "emergency off, pipelined:" : "emergency off, stop-and-wait:", ms, BD_MAX, missing);
+
+  bus.close();
+}
+
+// Writes BENCH_RECORDS samples through the recorder and scans them back
+static void benchRecorder(){
+
+  char dir[] = "/tmp/n1470benchXXXXXX";
+  std::string prefix;
+  std::chrono::steady_clock::time_point start;
+  N1470Recorder recorder;
+  N1470RecordReader reader;
+  N1470Record sample;
+  double seconds, sum = 0;
+  uint64_t n;
+
+  if (mkdtemp(dir) == NULL){
+    perror("mkdtemp");
+    return;
+  }
+  prefix = std::string(dir) + "/hv";
+
+  if (recorder.open(prefix.c_str()) != 0)
+    return;
+
+  memset(&sample, 0, sizeof(sample));
+
+  start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < BENCH_RECORDS; i++){
+    sample.time_ns = 1700000000000000000LL + (int64_t)(i / 32) * 1000000000LL;
+    sample.bd = (i / 4) % 8;
+    sample.ch = i % 4;
+    sample.vmon = 900 + (i % 7) * 0.1f;
+    recorder.record(sample);
+  }
+  recorder.close();
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%-32s %6.1f ns per record\n", "record:", seconds * 1e9 / BENCH_RECORDS);
+
+  reader.open(prefix.c_str());
+  start = std::chrono::steady_clock::now();
+  n = reader.scan([&sum](const N1470Record *records, size_t count){
+      for (size_t i = 0; i < count; i++)
+	sum += records[i].vmon;
+    });
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%-32s %6.2f GB/s, %lu records\n", "scan:", n * sizeof(N1470Record) / seconds / 1e9, (unsigned long)n);
+
+  if (sum == 0.5)
+    printf("%g\n", sum);
+
+  std::string clean = std::string("rm -rf ") + dir;
+  if (system(clean.c_str()) != 0)
+    fprintf(stderr,"Could not remove %s\n",dir);
+}
+
+int main(int argc, char **argv){
+
+  benchParse();
+  benchRecorder();
+  benchEmergency(false);
+  benchEmergency(true);
+
+  for (int i = 1; i < argc; i++){
+    benchTransport(argv[i]);
+    benchBaud(argv[i]);
+  }
+
+  return 0;
+}
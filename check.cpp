@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "N1470.h"
+#include "N1470Bus.h"
+#include "N1470Command.h"
+#include "N1470Response.h"
+#include "N1470Config.h"
+#include "N1470LinkScheduler.h"
+#include "N1470Sim.h"
+#include "N1470Transport.h"
+
+#include <unistd.h>
+
+// Regression checks of the driver against the simulator, no device needed.
+// Build with "make check" and run ./check; it prints one line per check and
+// exits with the number that failed.
+
+#define CHECK_SNAPSHOT_MS 500 // how long the snapshot readers race the poller
+#define CHECK_OFF_CALLERS 4 // threads calling emergencyOff at once
+
+static int failures_ = 0;
+
+static void expect(bool ok, const char *what){
+
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok)
+    failures_++;
+}
+
+// Simulator link that remembers the parameter of every SET sent over it
+class RecordingTransport : public N1470SimTransport{
+
+ private:
+
+  std::mutex mutex_;
+  std::vector<std::string> sets_;
+
+ public:
+
+  RecordingTransport(unsigned long boardMask) : N1470SimTransport(NULL, boardMask){}
+
+  int write(const char *cmd, int size){
+    std::string text(cmd, size);
+    size_t par = text.find(",PAR:");
+    if (text.find(",CMD:SET") != std::string::npos && par != std::string::npos){
+      std::lock_guard<std::mutex> lock(mutex_);
+      sets_.push_back(text.substr(par + 5, text.find_first_of(",\r", par + 5) - par - 5));
+    }
+    return N1470SimTransport::write(cmd, size);
+  }
+
+  // The parameters set since the last call, space separated
+  std::string takeSets(){
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string all;
+    for (unsigned int i = 0; i < sets_.size(); i++)
+      all += (i ? " " : "") + sets_[i];
+    sets_.clear();
+    return all;
+  }
+
+};
+
+static void checkParse(){
+
+  N1470Response reply;
+
+  N1470Response::parse("#BD:01,CMD:OK,VAL:0001.0;0002.5;0100.0;7999.9\r\n", &reply);
+  expect(reply.error == ERR_NONE && reply.bd == 1 && reply.nValues == 4 &&
+	 reply.values[0] == 1.0 && reply.values[1] == 2.5 && reply.values[2] == 100.0 && reply.values[3] == 7999.9,
+	 "CH:4 reply gives four values");
+
+  N1470Response::parse("#BD:02,CMD:OK,VAL:+;-;-;+\r\n", &reply);
+  expect(reply.error == ERR_NONE && reply.nValues == 4 &&
+	 reply.values[0] == 1 && reply.values[1] == -1 && reply.values[2] == -1 && reply.values[3] == 1,
+	 "CH:4 polarity reply gives four signs");
+
+  N1470Response::parse("#BD:03,CMD:OK,VAL:00001;00003;00000;00129\r\n", &reply);
+  expect(reply.nValues == 4 && reply.values[3] == 129, "CH:4 status reply gives four words");
+
+  N1470Response::parse("#BD:01,CMD:OK,VAL:0001.0;0002.0;x;0004.0\r\n", &reply);
+  expect(reply.nValues == 0, "CH:4 reply with a bad value gives none");
+
+  N1470Response::parse("#BD:01,CH:ERR\r\n", &reply);
+  expect(reply.error == ERR_CH, "CH:ERR reply is reported");
+}
+
+static void checkClose(){
+
+  N1470Bus never, failed;
+
+  expect(never.close() == 0, "closing a bus that never opened does nothing");
+  expect(failed.open((N1470Transport *)NULL) != 0 && failed.close() == 0, "closing a bus whose open failed does nothing");
+}
+
+static void checkPipeline(){
+
+  N1470Bus bus;
+  char cmd[CMD_SIZE_N1470];
+  N1470Response parsed;
+  bool matched = true;
+
+  if (bus.open("sim:0xf") != 0){
+    expect(false, "pipelined link opens");
+    return;
+  }
+
+  N1470Sim *sim = bus.getSimulator();
+  sim->setBaudRate(0);
+
+  // Each board gets a VSET of its own to tell the replies apart
+  for (int bd = 0; bd < 4; bd++)
+    bus.board(bd)->setVoltage(CH_ALL, 100 * (bd + 1));
+
+  bus.startPipeline(4);
+
+  std::vector<std::future<N1470Reply> > replies;
+  for (int round = 0; round < 5; round++)
+    for (int bd = 3; bd >= 0; bd--){
+      N1470Command::monitor(cmd, bd, CH_ALL, PAR_VSET);
+      replies.push_back(bus.submit(bd, cmd));
+    }
+
+  for (unsigned int i = 0; i < replies.size(); i++){
+    int bd = 3 - i % 4;
+    N1470Reply reply = replies[i].get();
+    if (reply.status != 0 || N1470Response::parse(reply.response, &parsed) != ERR_NONE ||
+	parsed.bd != bd || parsed.nValues != 4 || parsed.values[0] != 100 * (bd + 1))
+      matched = false;
+  }
+  expect(matched, "pipelined replies reach the request of their board");
+
+  // A reply that comes after its request timed out must not answer the next
+  sim->setLatency(150000);
+  N1470Command::boardMonitor(cmd, 0, PAR_BDNAME);
+  N1470Reply late = bus.submit(0, cmd, 50).get();
+  expect(late.status == 2, "pipelined request times out");
+
+  sim->setLatency(SIM_LATENCY_US);
+  N1470Command::monitor(cmd, 0, CH_ALL, PAR_VSET);
+  N1470Reply next = bus.submit(0, cmd).get();
+  expect(next.status == 0 && N1470Response::parse(next.response, &parsed) == ERR_NONE &&
+	 parsed.nValues == 4 && parsed.values[0] == 100,
+	 "next request to that board gets its own reply, not the late one");
+
+  N1470Command::monitor(cmd, 1, CH_ALL, PAR_VSET);
+  N1470Reply other = bus.submit(1, cmd).get();
+  expect(other.status == 0 && N1470Response::parse(other.response, &parsed) == ERR_NONE &&
+	 parsed.bd == 1 && parsed.values[0] == 200,
+	 "other boards are not held back by the late reply");
+
+  bus.stopPipeline();
+}
+
+static void checkModeSwitch(){
+
+  N1470Bus bus;
+  std::atomic<bool> running(true);
+  std::atomic<int> failed(0), reads(0);
+  std::vector<std::thread> callers;
+
+  if (bus.open("sim:0xf") != 0){
+    expect(false, "mode switch link opens");
+    return;
+  }
+  bus.getSimulator()->setBaudRate(0);
+
+  for (int bd = 0; bd < 4; bd++)
+    bus.board(bd)->setVoltage(CH_ALL, 100 * (bd + 1));
+
+  // Blocking callers on every board while the bus goes in and out of
+  // pipelined mode. A command still queued when pipelining stops fails
+  // with an I/O error; any reply that arrives must be its own.
+  for (int bd = 0; bd < 4; bd++)
+    callers.push_back(std::thread([&bus, &running, &failed, &reads, bd]{
+	  char cmd[CMD_SIZE_N1470];
+	  std::string response;
+	  N1470Response parsed;
+	  N1470Command::monitor(cmd, bd, CH_ALL, PAR_VSET);
+	  while (running){
+	    response.clear();
+	    int status = bus.transaction(bd, cmd, &response);
+	    if (status == 1)
+	      continue;
+	    if (status != 0 || N1470Response::parse(response, &parsed) != ERR_NONE ||
+		parsed.bd != bd || parsed.nValues != CH_MAX || parsed.values[0] != 100 * (bd + 1))
+	      failed++;
+	    reads++;
+	  }
+	}));
+
+  for (int i = 0; i < 50; i++){
+    bus.startPipeline(2);
+    usleep(2000);
+    bus.stopPipeline();
+    usleep(2000);
+  }
+
+  running = false;
+  for (unsigned int i = 0; i < callers.size(); i++)
+    callers[i].join();
+
+  expect(reads > 0 && failed == 0, "blocking reads stay matched while pipelining starts and stops");
+}
+
+static void checkChannelArgument(){
+
+  N1470Bus bus;
+
+  if (bus.open("sim:0x1") != 0){
+    expect(false, "argument link opens");
+    return;
+  }
+  bus.getSimulator()->setBaudRate(0);
+
+  N1470 *hv = bus.board(0);
+
+  // Blocking calls report a channel out of range like the async ones do
+  expect(hv->setVoltage(7, 100) == -ERR_ARG && hv->getActualVoltage(-1) == -ERR_ARG &&
+	 hv->switchState(5, true) == -ERR_ARG && hv->getMaxVoltage(CH_ALL) == -ERR_ARG,
+	 "blocking calls refuse a bad channel with ERR_ARG");
+  expect(hv->monitorAsync(9, PAR_VMON).get().error == ERR_ARG, "async calls refuse a bad channel with ERR_ARG");
+}
+
+static void checkSnapshot(){
+
+  N1470Bus bus;
+  std::atomic<bool> running(true);
+  std::atomic<int> torn(0), backwards(0), reads(0);
+  std::vector<std::thread> readers;
+
+  if (bus.open("sim:0x1") != 0){
+    expect(false, "snapshot link opens");
+    return;
+  }
+  bus.getSimulator()->setBaudRate(0);
+  bus.getSimulator()->setLatency(0);
+
+  N1470 *hv = bus.board(0);
+
+  // VSET changes for all channels at once, so a snapshot mixing two
+  // publications shows channels with different VSETs
+  std::thread setter([&]{
+      for (int i = 0; running; i++)
+	hv->setVoltage(CH_ALL, (i % 2) ? 200 : 100);
+    });
+  std::thread poller([&]{
+      while (running)
+	hv->pollOnce();
+    });
+
+  for (int i = 0; i < 3; i++)
+    readers.push_back(std::thread([&]{
+	  N1470Snapshot snap;
+	  unsigned long last = 0, seq;
+	  while (running){
+	    if ((seq = hv->getSnapshot(&snap)) == 0)
+	      continue;
+	    reads++;
+	    if (seq < last || snap.sequence != seq)
+	      backwards++;
+	    last = seq;
+	    for (int ch = 1; ch < CH_MAX; ch++)
+	      if (snap.vset[ch] != snap.vset[0])
+		torn++;
+	  }
+	}));
+
+  usleep(CHECK_SNAPSHOT_MS * 1000);
+  running = false;
+
+  setter.join();
+  poller.join();
+  for (unsigned int i = 0; i < readers.size(); i++)
+    readers[i].join();
+
+  expect(reads > 0 && torn == 0, "snapshots read during polling are never torn");
+  expect(backwards == 0, "snapshot sequence numbers only go forward");
+}
+
+static void checkConfig(){
+
+  RecordingTransport *link = new RecordingTransport(0x1);
+  N1470Bus bus;
+  N1470Config config;
+  std::vector<N1470ConfigChange> changes;
+
+  if (bus.open(link) != 0){
+    expect(false, "configured link opens");
+    return;
+  }
+  bus.getSimulator()->setBaudRate(0);
+
+  N1470 *hv = bus.board(0);
+  hv->setMaxVoltage(CH_ALL, 500);
+  link->takeSets();
+
+  // Raising MAXV has to come before the VSET it allows, and ON last
+  config.parseLine("BD:0 CH:4 MAXV:1000 VSET:900 ON");
+
+  expect(config.apply(&bus, &changes, true) == 0 && changes.size() == 12 && link->takeSets().empty(),
+	 "dry run finds every difference and writes nothing");
+
+  changes.clear();
+  expect(config.apply(&bus, &changes) == 0 && changes.size() == 12, "configuration applies");
+  expect(link->takeSets() == "MAXV VSET ON", "MAXV is raised before VSET, channels go on last");
+
+  changes.clear();
+  expect(config.apply(&bus, &changes) == 0 && changes.empty() && link->takeSets().empty(),
+	 "applied configuration has nothing left to change");
+
+  // Lowering MAXV has to wait until VSET is below it
+  config.clear();
+  config.parseLine("BD:0 CH:4 MAXV:850 VSET:800 ON");
+
+  changes.clear();
+  expect(config.apply(&bus, &changes) == 0 && changes.size() == 8, "lowered configuration applies");
+  expect(link->takeSets() == "VSET MAXV", "VSET is lowered before MAXV");
+
+  hv->switchState(CH_ALL, false);
+
+  // A VSET the board refuses stops the board there, before anything goes on
+  hv->setMaxVoltage(CH_ALL, 500);
+  link->takeSets();
+  config.clear();
+  config.parseLine("BD:0 CH:4 VSET:900 ON");
+
+  changes.clear();
+  bool on = false;
+  int status[CH_MAX];
+  unsigned long sent = hv->getSentWrites();
+  expect(config.apply(&bus, &changes) != 0 && link->takeSets() == "VSET", "refused VSET stops the configuration");
+  expect(hv->getSentWrites() == sent, "refused VSET is not counted as a write sent");
+  expect(hv->getAllStatus(status) == 0, "status reads after the refusal");
+  for (int ch = 0; ch < CH_MAX; ch++)
+    if (status[ch] & STAT_ON_N1470)
+      on = true;
+  expect(!on, "no channel goes on after a refused VSET");
+}
+
+static void checkEmergencyOff(bool pipelined){
+
+  N1470Bus bus;
+  std::vector<std::thread> callers;
+  std::atomic<int> missing(0);
+  std::atomic<bool> running(true);
+  int status[CH_MAX];
+  bool off = true;
+
+  if (bus.open("sim:0xf") != 0){
+    expect(false, "emergency link opens");
+    return;
+  }
+  bus.getSimulator()->setBaudRate(0);
+
+  for (int bd = 0; bd < 4; bd++){
+    bus.board(bd)->setVoltage(CH_ALL, 100);
+    bus.board(bd)->switchState(CH_ALL, true);
+  }
+
+  if (pipelined)
+    bus.startPipeline(2);
+
+  // Ordinary traffic keeps the link busy meanwhile
+  std::thread load([&]{
+      double voltages[CH_MAX];
+      while (running)
+	bus.board(1)->getAllVoltages(voltages);
+    });
+
+  for (int i = 0; i < CHECK_OFF_CALLERS; i++)
+    callers.push_back(std::thread([&]{ missing += bus.emergencyOff(); }));
+  for (unsigned int i = 0; i < callers.size(); i++)
+    callers[i].join();
+
+  running = false;
+  load.join();
+
+  for (int bd = 0; bd < 4; bd++)
+    if (bus.board(bd)->getAllStatus(status) != 0)
+      off = false;
+    else
+      for (int ch = 0; ch < CH_MAX; ch++)
+	if (status[ch] & STAT_ON_N1470)
+	  off = false;
+
+  expect(missing == 0, pipelined ? "concurrent pipelined emergency OFFs are all acknowledged" :
+	 "concurrent emergency OFFs are all acknowledged");
+  expect(off, pipelined ? "every channel is off after pipelined emergency OFFs" :
+	 "every channel is off after emergency OFFs");
+
+  if (pipelined)
+    bus.stopPipeline();
+}
+
+static void checkScheduler(){
+
+  {
+    N1470LinkScheduler scheduler;
+    N1470Priority prio[] = {PRIO_DIAG, PRIO_CONFIG, PRIO_STATUS, PRIO_MONITOR, PRIO_STATUS};
+    int bd[] = {0, 1, 2, 3, 4};
+    expect(scheduler.pick(prio, bd, 5) == 2, "most urgent class goes first, earliest of equals");
+  }
+
+  {
+    N1470LinkScheduler scheduler;
+    N1470Priority prio[] = {PRIO_STATUS, PRIO_EMERGENCY};
+    int bd[] = {0, 1};
+    expect(scheduler.pick(prio, bd, 2) == 1, "emergency OFF goes before STAT");
+    expect(scheduler.pick(prio, bd, 0) == -1, "nothing waiting picks nothing");
+  }
+
+  {
+    N1470LinkScheduler scheduler;
+    N1470Priority prio[] = {PRIO_MONITOR, PRIO_DIAG};
+    int bd[] = {0, 1};
+    scheduler.started(PRIO_MONITOR, 0);
+    scheduler.finished(PRIO_MONITOR, 0, 10 * LINK_BURST_MS_N1470);
+    expect(scheduler.pick(prio, bd, 2) == 1, "overspent class goes behind one that has time in hand");
+  }
+
+  {
+    N1470LinkScheduler scheduler;
+    N1470Priority prio[] = {PRIO_CONFIG, PRIO_STATUS};
+    int bd[] = {0, 1};
+    scheduler.started(PRIO_STATUS, 0);
+    scheduler.finished(PRIO_STATUS, 1, 10 * LINK_BURST_MS_N1470);
+    expect(scheduler.pick(prio, bd, 2) == 1, "STAT is never held back by its budget");
+  }
+
+  {
+    N1470LinkScheduler scheduler;
+    N1470Priority prio[] = {PRIO_CONFIG, PRIO_CONFIG};
+    int bd[] = {0, 1};
+    scheduler.setBoardShare(0.5);
+    scheduler.started(PRIO_CONFIG, 0);
+    scheduler.finished(PRIO_CONFIG, 0, 10 * LINK_BURST_MS_N1470);
+    expect(scheduler.pick(prio, bd, 2) == 1, "overspent board goes behind the others");
+  }
+}
+
+int main(){
+
+  checkParse();
+  checkClose();
+  checkPipeline();
+  checkModeSwitch();
+  checkChannelArgument();
+  checkSnapshot();
+  checkConfig();
+  checkEmergencyOff(false);
+  checkEmergencyOff(true);
+  checkScheduler();
+
+  printf("%d failed\n", failures_);
+
+  return failures_;
+}
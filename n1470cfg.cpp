@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "N1470Config.h"
+
+// Brings the boards on a link to the configuration in a file and reports
+// what changed. Build with "make config" and run
+// ./n1470cfg <transport spec> <file> [-n], where -n only shows the differences.
+
+int main(int argc, char **argv){
+
+  std::vector<N1470ConfigChange> changes;
+  N1470Config config;
+  N1470Bus bus;
+  struct timespec start, end;
+  int problems;
+
+  if (argc < 3){
+    fprintf(stderr,"Usage: %s <transport spec> <file> [-n]\n",argv[0]);
+    return 2;
+  }
+
+  bool dryRun = (argc > 3 && strcmp(argv[3], "-n") == 0);
+
+  if (config.load(argv[2]) != 0)
+    return 2;
+
+  // Probe the line speed with a board the configuration expects
+  for (int bd = 0; bd < BD_MAX; bd++)
+    if (config.getBoard(bd).present){
+      bus.setProbeBoard(bd);
+      break;
+    }
+
+  if (bus.open(argv[1]) != 0){
+    fprintf(stderr,"Could not open %s\n",argv[1]);
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  problems = config.apply(&bus, &changes, dryRun);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  N1470Config::print(changes);
+  fprintf(stderr,"%zu difference(s), %d problem(s), %.2f s\n",changes.size(),problems,
+	  (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+  return problems ? 1 : 0;
+}
@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+
+#include "N1470Daemon.h"
+
+// Owns the link to the modules and serves local clients until interrupted.
+// Build with "make daemon" and run ./n1470d [transport spec] [socket path];
+// clients talk to it through N1470DaemonClient.
+
+static N1470Daemon *daemon_ = NULL;
+
+static void onSignal(int){ if (daemon_) daemon_->stop(); }
+
+int main(int argc, char **argv){
+
+  const char *spec = (argc > 1) ? argv[1] : "d2xx:0";
+  const char *path = (argc > 2) ? argv[2] : DAEMON_SOCKET_N1470;
+  N1470Bus bus;
+
+  if (bus.open(spec) != 0){
+    fprintf(stderr,"Could not open %s\n",spec);
+    return 1;
+  }
+
+  N1470Daemon daemon(&bus);
+  if (daemon.open(path) != 0)
+    return 1;
+
+  daemon_ = &daemon;
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stderr,"Serving %s on %s\n",spec,path);
+  daemon.run();
+
+  N1470DaemonStats stats = daemon.getStats();
+  fprintf(stderr,"%lu requests, %lu transactions, %lu coalesced, %lu from cache\n",
+	  stats.requests,stats.transactions,stats.coalesced,stats.cached);
+
+  return 0;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "N1470Sim.h"
+
+// Serves a simulated N1470 chain on a pseudo-terminal until interrupted.
+// Build with "make sim" and run ./n1470sim [board mask] [latency us] [baud];
+// the name of the tty to open is printed on stdout.
+
+static volatile sig_atomic_t stop_ = 0;
+
+static void onSignal(int){ stop_ = 1; }
+
+int main(int argc, char **argv){
+
+  unsigned long mask = (argc > 1) ? strtoul(argv[1], NULL, 0) : 0x1;
+  N1470Sim sim(mask);
+  std::string slave;
+
+  if (argc > 2)
+    sim.setLatency(atol(argv[2]));
+  if (argc > 3)
+    sim.setBaudRate(atoi(argv[3]));
+
+  if (sim.openPty(&slave) != 0){
+    fprintf(stderr,"Could not open a pseudo-terminal\n");
+    return 1;
+  }
+
+  printf("%s\n", slave.c_str());
+  fflush(stdout);
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  while (!stop_)
+    pause();
+
+  sim.closePty();
+
+  return 0;
+}
@@ -49,7 +49,9 @@ int main(int argc, char **argv){
   }
   std::cerr << "========================================" << std::endl;
   
-  sleep(10);
+  // Returns as soon as every channel is at voltage
+  if (hv->waitUntilStable(NULL, 0, 2.0, 60000) != 0)
+    fprintf(stderr,"Channels did not reach their set voltage\n");
 
   for(int ii = 0; ii <=3; ii++){
     std::cerr << "Now on channel " << ii << std::endl;	
@@ -58,7 +60,10 @@ int main(int argc, char **argv){
     hv->printStatus(ii);
   }
   std::cerr << "========================================" << std::endl;	  
-  sleep(10);
+
+  // Settle within 1 V instead of sitting out a fixed 10 s
+  if (hv->waitUntilStable(NULL, 0, 1.0, 10000) != 0)
+    fprintf(stderr,"Channels did not settle\n");
 
   fprintf(stderr,"Switching channels off\n");
   for(int ii = 0; ii <=3; ii++){
@@ -68,38 +73,16 @@ int main(int argc, char **argv){
   }
   std::cerr << "========================================" << std::endl;
 
-  sleep(10);
- 
-  int stat_check[4] ={0,0,0,0};
-  int sum;
- 
+  if (hv->waitUntilStable(NULL, 0, 2.0, 60000) != 0)
+    fprintf(stderr,"Channels did not ramp down\n");
+
   for(int ii = 0; ii <=3; ii++){
     std::cerr << "Now on channel " << ii << std::endl;	
     hv->getActualVoltage(ii);
     hv->getActualCurrent(ii);
-    stat_check[ii] = ((int)hv->printStatus(ii) & 0x1);
+    hv->printStatus(ii);
   }
   std::cerr << "========================================" << std::endl;	  
-  
-  while (1){
-
-    for(int ii = 0; ii <=3; ii++){
-      std::cerr << "Now on channel " << ii << std::endl;	
-      hv->getActualVoltage(ii);
-      hv->getActualCurrent(ii);
-      stat_check[ii] = ((int)hv->printStatus(ii) & 0x1);
-    }	
-    
-    for(int ii=0;ii <=3; ii++)
-      sum+=stat_check[ii];
-      
-    if (sum == 0)
-      break;
-    else
-      sum = 0;
-
-    sleep(5);	      
-  }
    
   hv->dropConnection();
 